@@ -0,0 +1,727 @@
+/*
+    Throughput and latency benchmark for Map.
+
+    Build next to the library, no test framework needed:
+        cc -O2 -DNDEBUG -o bench bench.c map.c concurrent_map.c numa_map.c -lm -pthread
+    Add -DNUMA_MAP_LIBNUMA -lnuma to place the NUMA map's nodes on their own memory.
+
+    Usage:
+        ./bench [--sizes 1000,10000,...] [--keys int,pod16,str8,str64] [--storage chained,pow2,flat,dense]
+                [--patterns uniform,zipf,seq] [--seed N] [--threads N]
+
+    Every storage x key type x size runs in its own child process (where fork is available) so the reported
+    peak RSS belongs to that run only. Lookup patterns only change the order of map_get hits, inserts always
+    add every key once, shuffled unless the pattern is seq.
+
+    Output is one line per measured operation:
+        storage keys size pattern op ns/op p50 p99 peak_rss_kb
+    ns/op is the wall time of the whole loop divided by its operations. p50 and p99 come from timing one in every
+    BENCH_SAMPLE_EVERY operations on its own, minus the measured cost of reading the clock. iterate, optimize and
+    get_batch report ns per entry and no percentiles.
+
+    --threads N replaces the storage runs with a comparison of one ConcurrentMap shared by every thread (shared),
+    a NumaMap with a node per NUMA node (numa) and the same with a copy per node (replica), for int keys of every size.
+    The pattern column is the thread count. add fills the map from one thread, get is N pinned threads looking up
+    uniform random keys and mixed replaces one in BENCH_SHARDED_WRITE_EVERY lookups by an update.
+    ns/op is the wall time of all threads divided by all their operations, so it falls as threads scale.
+*/
+/* CPU affinity for the --threads run. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "map.h"
+#if !defined(_WIN32)
+#include "numa_map.h"
+#include <pthread.h>
+#endif
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_SAMPLE_EVERY 16
+/* Keys handed to map_get_batch per call. */
+#define BENCH_BATCH 256
+#define BENCH_ZIPF_THETA 0.99
+/* Operations every thread of a --threads run makes, and how many of them update in mixed. */
+#define BENCH_SHARDED_OPS 2000000
+#define BENCH_SHARDED_WRITE_EVERY 16
+
+static uint64_t bench_now_ns(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Peak resident set of this process in KB, 0 where unknown. */
+static long bench_peak_rss_kb(void)
+{
+#if defined(_WIN32)
+    return 0;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static uint64_t bench_rng_state = 0x9E3779B97F4A7C15ULL;
+
+/* splitmix64 */
+static uint64_t bench_rand(void)
+{
+    uint64_t z = (bench_rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static double bench_rand01(void)
+{
+    return (double)(bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Zipfian ranks over [0, n) following Gray et al., "Quickly generating billion-record synthetic databases". */
+typedef struct
+{
+    size_t n;
+    double theta, alpha, zetan, eta;
+} BenchZipf;
+
+static void bench_zipf_init(BenchZipf *zipf, size_t n, double theta)
+{
+    double zeta2 = 1.0 + pow(0.5, theta);
+    size_t i;
+    zipf->n = n;
+    zipf->theta = theta;
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->zetan = 0;
+    for (i = 1; i <= n; i++)
+        zipf->zetan += 1.0 / pow((double)i, theta);
+    zipf->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+static size_t bench_zipf_next(const BenchZipf *zipf)
+{
+    double u = bench_rand01(), uz = u * zipf->zetan;
+    size_t rank;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, zipf->theta))
+        return 1;
+    rank = (size_t)((double)zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+    return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+typedef struct
+{
+    uint64_t a;
+    uint64_t b;
+} BenchPod16;
+
+static size_t bench_int_hash(const void *key)
+{
+    return (size_t)*(const int *)key;
+}
+
+static int bench_int_cmp(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t bench_pod16_hash(const void *key)
+{
+    return map_hash_bytes(key, sizeof(BenchPod16));
+}
+
+static int bench_pod16_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(BenchPod16));
+}
+
+/* Keys 0..n-1 are inserted, n..2n-1 are used for misses. */
+typedef struct
+{
+    const char *name;
+    size_t key_size;
+    size_t (*hash)(const void *);
+    int (*cmp)(const void *, const void *);
+    byte *keys;
+    char *strings;
+} BenchKeys;
+
+static int bench_keys_make(BenchKeys *keys, const char *name, size_t n)
+{
+    size_t i, total = 2 * n;
+    memset(keys, 0, sizeof(*keys));
+    keys->name = name;
+    if (strcmp(name, "int") == 0)
+    {
+        keys->key_size = sizeof(int);
+        keys->hash = bench_int_hash;
+        keys->cmp = bench_int_cmp;
+        keys->keys = (byte *)malloc(total * sizeof(int));
+        if (keys->keys == NULL)
+            return -1;
+        for (i = 0; i < total; i++)
+            ((int *)keys->keys)[i] = (int)i;
+        return 0;
+    }
+    if (strcmp(name, "pod16") == 0)
+    {
+        keys->key_size = sizeof(BenchPod16);
+        keys->hash = bench_pod16_hash;
+        keys->cmp = bench_pod16_cmp;
+        keys->keys = (byte *)malloc(total * sizeof(BenchPod16));
+        if (keys->keys == NULL)
+            return -1;
+        for (i = 0; i < total; i++)
+        {
+            ((BenchPod16 *)keys->keys)[i].a = i;
+            ((BenchPod16 *)keys->keys)[i].b = i * 0x9E3779B97F4A7C15ULL;
+        }
+        return 0;
+    }
+    if (strcmp(name, "str8") == 0 || strcmp(name, "str64") == 0)
+    {
+        size_t width = strcmp(name, "str8") == 0 ? 8 : 64;
+        keys->key_size = sizeof(char *);
+        keys->hash = map_fast_hash_str;
+        keys->cmp = map_default_cmp_str;
+        keys->keys = (byte *)malloc(total * sizeof(char *));
+        keys->strings = (char *)malloc(total * (width + 1));
+        if (keys->keys == NULL || keys->strings == NULL)
+            return -1;
+        for (i = 0; i < total; i++)
+        {
+            char *str = keys->strings + i * (width + 1);
+            /* Shared prefix for the long keys, so comparisons have to read most of the string. */
+            memset(str, 'p', width);
+            snprintf(str + width - 8, 9, "%08x", (unsigned)i);
+            ((char **)keys->keys)[i] = str;
+        }
+        return 0;
+    }
+    fprintf(stderr, "unknown key type %s\n", name);
+    return -1;
+}
+
+static void bench_keys_free(BenchKeys *keys)
+{
+    free(keys->keys);
+    free(keys->strings);
+}
+
+static const void *bench_key(const BenchKeys *keys, size_t i)
+{
+    return keys->keys + i * keys->key_size;
+}
+
+static MapTypeData bench_type(const BenchKeys *keys, const char *storage)
+{
+    MapTypeData type = MAP_TYPE(int, uint64_t, keys->hash, keys->cmp, NULL, NULL);
+    type.key_size = keys->key_size;
+    if (strcmp(storage, "pow2") == 0)
+        type.flags = MAP_FLAG_POW2;
+    else if (strcmp(storage, "flat") == 0)
+        type.storage = MAP_STORAGE_FLAT;
+    else if (strcmp(storage, "dense") == 0)
+        type.storage = MAP_STORAGE_DENSE;
+    return type;
+}
+
+static int bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Collects per operation samples and prints one result line. */
+typedef struct
+{
+    const char *storage, *keys, *pattern;
+    size_t size;
+    uint64_t *samples;
+    size_t sample_count;
+    uint64_t timer_overhead;
+} BenchRun;
+
+static void bench_report(BenchRun *run, const char *op, uint64_t total_ns, size_t ops)
+{
+    uint64_t p50 = 0, p99 = 0;
+    if (run->sample_count > 0)
+    {
+        qsort(run->samples, run->sample_count, sizeof(uint64_t), bench_cmp_u64);
+        p50 = run->samples[run->sample_count / 2];
+        p99 = run->samples[(size_t)((double)(run->sample_count - 1) * 0.99)];
+    }
+    printf("%-8s %-6s %10zu %-8s %-10s %9.1f %7llu %7llu %10ld\n", run->storage, run->keys, run->size, run->pattern, op,
+           ops ? (double)total_ns / (double)ops : 0.0, (unsigned long long)p50, (unsigned long long)p99, bench_peak_rss_kb());
+    fflush(stdout);
+    run->sample_count = 0;
+}
+
+static void bench_sample(BenchRun *run, uint64_t start)
+{
+    uint64_t elapsed = bench_now_ns() - start;
+    run->samples[run->sample_count++] = elapsed > run->timer_overhead ? elapsed - run->timer_overhead : 0;
+}
+
+static uint64_t bench_timer_overhead(void)
+{
+    uint64_t best = (uint64_t)-1;
+    int i;
+    for (i = 0; i < 1000; i++)
+    {
+        uint64_t start = bench_now_ns(), elapsed = bench_now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+/* Fills order with the indices looked up under pattern. */
+static void bench_pattern(size_t *order, size_t n, const char *pattern)
+{
+    size_t i;
+    if (strcmp(pattern, "seq") == 0)
+    {
+        for (i = 0; i < n; i++)
+            order[i] = i;
+    }
+    else if (strcmp(pattern, "zipf") == 0)
+    {
+        BenchZipf zipf;
+        bench_zipf_init(&zipf, n, BENCH_ZIPF_THETA);
+        /* Scatter the hot ranks over the key space instead of keeping them at the front. */
+        for (i = 0; i < n; i++)
+            order[i] = (size_t)(((uint64_t)bench_zipf_next(&zipf) * 0x9E3779B1ULL) % n);
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+            order[i] = (size_t)(bench_rand() % n);
+    }
+}
+
+static void bench_shuffle(size_t *order, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (i = n; i > 1; i--)
+    {
+        size_t j = (size_t)(bench_rand() % i), tmp = order[i - 1];
+        order[i - 1] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/* Volatile sink so the compiler cannot drop lookups whose result is unused. */
+static volatile uint64_t bench_sink;
+
+static int bench_one(const char *storage, const char *key_name, size_t n, const char **patterns, size_t pattern_count)
+{
+    BenchKeys keys;
+    BenchRun run;
+    size_t *order = (size_t *)malloc(n * sizeof(size_t)), i, p;
+    uint64_t start, total;
+    Map *map;
+    void *batch_values[BENCH_BATCH];
+    byte *batch_keys;
+
+    run.samples = (uint64_t *)malloc((n / BENCH_SAMPLE_EVERY + 1) * sizeof(uint64_t));
+    if (order == NULL || run.samples == NULL || bench_keys_make(&keys, key_name, n) != 0 ||
+        (batch_keys = (byte *)malloc(n * keys.key_size)) == NULL)
+    {
+        fprintf(stderr, "out of memory for %s %zu\n", key_name, n);
+        return -1;
+    }
+    run.storage = storage;
+    run.keys = key_name;
+    run.size = n;
+    run.sample_count = 0;
+    run.timer_overhead = bench_timer_overhead();
+
+    for (p = 0; p < pattern_count; p++)
+    {
+        run.pattern = patterns[p];
+        map = map_new(bench_type(&keys, storage), MAP_DEFAULT_BUCKETS_COUNT);
+        if (map == NULL)
+            return -1;
+
+        if (strcmp(patterns[p], "seq") == 0)
+            bench_pattern(order, n, "seq");
+        else
+            bench_shuffle(order, n);
+        total = bench_now_ns();
+        for (i = 0; i < n; i++)
+        {
+            uint64_t value = order[i];
+            if (i % BENCH_SAMPLE_EVERY == 0)
+            {
+                start = bench_now_ns();
+                map_add(map, bench_key(&keys, order[i]), &value);
+                bench_sample(&run, start);
+            }
+            else
+                map_add(map, bench_key(&keys, order[i]), &value);
+        }
+        bench_report(&run, "add", bench_now_ns() - total, n);
+
+        bench_pattern(order, n, patterns[p]);
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+            bench_sink += *(uint64_t *)map_get(map, bench_key(&keys, order[i]));
+        total = bench_now_ns() - start;
+        for (i = 0; i < n; i += BENCH_SAMPLE_EVERY)
+        {
+            start = bench_now_ns();
+            bench_sink += *(uint64_t *)map_get(map, bench_key(&keys, order[i]));
+            bench_sample(&run, start);
+        }
+        bench_report(&run, "get_hit", total, n);
+
+        start = bench_now_ns();
+        for (i = 0; i < n; i++)
+            bench_sink += map_get(map, bench_key(&keys, n + order[i])) != NULL;
+        total = bench_now_ns() - start;
+        for (i = 0; i < n; i += BENCH_SAMPLE_EVERY)
+        {
+            start = bench_now_ns();
+            bench_sink += map_get(map, bench_key(&keys, n + order[i])) != NULL;
+            bench_sample(&run, start);
+        }
+        bench_report(&run, "get_miss", total, n);
+
+        /* Same hits as get_hit, gathered into one array first the way a join would hand them over. */
+        for (i = 0; i < n; i++)
+            memcpy(batch_keys + i * keys.key_size, bench_key(&keys, order[i]), keys.key_size);
+        start = bench_now_ns();
+        for (i = 0; i < n; i += BENCH_BATCH)
+            map_get_batch(map, batch_keys + i * keys.key_size, n - i < BENCH_BATCH ? n - i : BENCH_BATCH, batch_values);
+        bench_report(&run, "get_batch", bench_now_ns() - start, n);
+        bench_sink += batch_values[0] != NULL;
+
+        start = bench_now_ns();
+        MAP_FOR_EACH(map, byte, key, uint64_t, value)
+        {
+            bench_sink += *value;
+        }
+        bench_report(&run, "iterate", bench_now_ns() - start, n);
+
+        start = bench_now_ns();
+        map_optimize(&map);
+        bench_report(&run, "optimize", bench_now_ns() - start, n);
+
+        bench_shuffle(order, n);
+        total = bench_now_ns();
+        for (i = 0; i < n; i++)
+        {
+            if (i % BENCH_SAMPLE_EVERY == 0)
+            {
+                start = bench_now_ns();
+                map_remove(map, bench_key(&keys, order[i]));
+                bench_sample(&run, start);
+            }
+            else
+                map_remove(map, bench_key(&keys, order[i]));
+        }
+        bench_report(&run, "remove", bench_now_ns() - total, n);
+        map_free(map);
+    }
+
+    bench_keys_free(&keys);
+    free(batch_keys);
+    free(run.samples);
+    free(order);
+    return 0;
+}
+
+#if !defined(_WIN32)
+/* The maps compared by --threads, behind one signature. */
+typedef struct
+{
+    const char *name;
+    void *map;
+    int (*add)(void *map, const void *key, const void *value);
+    int (*get)(void *map, const void *key, void *value_out);
+    void (*free)(void *map);
+} BenchShared;
+
+static int bench_shared_add(void *map, const void *key, const void *value)
+{
+    return concurrent_map_add((ConcurrentMap *)map, key, value);
+}
+
+static int bench_shared_get(void *map, const void *key, void *value_out)
+{
+    return concurrent_map_get((ConcurrentMap *)map, key, value_out);
+}
+
+static void bench_shared_free(void *map)
+{
+    concurrent_map_free((ConcurrentMap *)map);
+}
+
+static int bench_numa_add(void *map, const void *key, const void *value)
+{
+    return numa_map_add((NumaMap *)map, key, value);
+}
+
+static int bench_numa_get(void *map, const void *key, void *value_out)
+{
+    return numa_map_get((NumaMap *)map, key, value_out);
+}
+
+static void bench_numa_free(void *map)
+{
+    numa_map_free((NumaMap *)map);
+}
+
+typedef struct
+{
+    const BenchShared *shared;
+    const int *keys;
+    size_t n;
+    int cpu, mixed;
+    uint64_t rng;
+    pthread_barrier_t *start;
+    uint64_t found;
+} BenchThread;
+
+static void *bench_thread(void *arg)
+{
+    BenchThread *thread = (BenchThread *)arg;
+    uint64_t value, found = 0;
+    size_t i;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(thread->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    pthread_barrier_wait(thread->start);
+    for (i = 0; i < BENCH_SHARDED_OPS; i++)
+    {
+        /* xorshift of its own, bench_rand is not shared between threads. */
+        thread->rng ^= thread->rng << 13;
+        thread->rng ^= thread->rng >> 7;
+        thread->rng ^= thread->rng << 17;
+        const int *key = &thread->keys[thread->rng % thread->n];
+        if (thread->mixed && i % BENCH_SHARDED_WRITE_EVERY == 0)
+        {
+            value = (uint64_t)i;
+            thread->shared->add(thread->shared->map, key, &value);
+        }
+        else
+            found += thread->shared->get(thread->shared->map, key, &value) == 0;
+    }
+    thread->found = found;
+    return NULL;
+}
+
+/* Wall time of threads_count threads running bench_thread together. */
+static uint64_t bench_threads(const BenchShared *shared, const BenchKeys *keys, size_t n, int threads_count, int mixed)
+{
+    pthread_t threads[256];
+    BenchThread args[256];
+    pthread_barrier_t start;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+    pthread_barrier_init(&start, NULL, (unsigned)threads_count + 1);
+    for (i = 0; i < threads_count; i++)
+    {
+        args[i].shared = shared;
+        args[i].keys = (const int *)keys->keys;
+        args[i].n = n;
+        args[i].cpu = (int)(i % (cpus > 0 ? cpus : 1));
+        args[i].mixed = mixed;
+        args[i].rng = bench_rand() | 1;
+        args[i].start = &start;
+        pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+    }
+    pthread_barrier_wait(&start);
+    uint64_t begin = bench_now_ns();
+    for (i = 0; i < threads_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        bench_sink += args[i].found;
+    }
+    uint64_t elapsed = bench_now_ns() - begin;
+    pthread_barrier_destroy(&start);
+    return elapsed;
+}
+
+static int bench_sharded(size_t n, int threads_count)
+{
+    BenchKeys keys;
+    BenchRun run;
+    char pattern[16];
+    size_t i, e, nodes = numa_map_nodes_available();
+    if (bench_keys_make(&keys, "int", n) != 0)
+        return -1;
+    MapTypeData type = bench_type(&keys, "chained");
+    snprintf(pattern, sizeof(pattern), "t%d", threads_count);
+    memset(&run, 0, sizeof(run));
+    run.keys = keys.name;
+    run.size = n;
+    run.pattern = pattern;
+
+    for (e = 0; e < 3; e++)
+    {
+        BenchShared shared;
+        if (e == 0)
+        {
+            /* As many locks as the NUMA map has in total, so only the placement differs. */
+            shared.name = "shared";
+            shared.map = concurrent_map_new(type, n, CONCURRENT_MAP_DEFAULT_SHARDS * nodes);
+            shared.add = bench_shared_add;
+            shared.get = bench_shared_get;
+            shared.free = bench_shared_free;
+        }
+        else
+        {
+            shared.name = e == 1 ? "numa" : "replica";
+            shared.map = numa_map_new(type, e == 1 ? n / nodes : n, 0, e == 1 ? 0 : NUMA_MAP_REPLICATED);
+            shared.add = bench_numa_add;
+            shared.get = bench_numa_get;
+            shared.free = bench_numa_free;
+        }
+        if (shared.map == NULL)
+        {
+            bench_keys_free(&keys);
+            return -1;
+        }
+        run.storage = shared.name;
+
+        uint64_t value = 0, start = bench_now_ns();
+        for (i = 0; i < n; i++)
+        {
+            value = i;
+            shared.add(shared.map, bench_key(&keys, i), &value);
+        }
+        bench_report(&run, "add", bench_now_ns() - start, n);
+        bench_report(&run, "get", bench_threads(&shared, &keys, n, threads_count, 0), (size_t)threads_count * BENCH_SHARDED_OPS);
+        bench_report(&run, "mixed", bench_threads(&shared, &keys, n, threads_count, 1), (size_t)threads_count * BENCH_SHARDED_OPS);
+        shared.free(shared.map);
+    }
+    bench_keys_free(&keys);
+    return 0;
+}
+#endif
+
+/* Splits a comma separated list in place. */
+static size_t bench_split(char *list, const char **out, size_t max)
+{
+    size_t count = 0;
+    char *token = strtok(list, ",");
+    while (token != NULL && count < max)
+    {
+        out[count++] = token;
+        token = strtok(NULL, ",");
+    }
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    char default_sizes[] = "1000,10000,100000,1000000";
+    char default_keys[] = "int,pod16,str8,str64";
+    char default_storage[] = "chained,pow2,flat,dense";
+    char default_patterns[] = "uniform,zipf,seq";
+    char *size_list = default_sizes, *key_list = default_keys, *storage_list = default_storage, *pattern_list = default_patterns;
+    const char *size_names[32], *key_names[8], *storages[8], *patterns[8];
+    size_t size_count, key_count, storage_count, pattern_count, s, k, z;
+    int i, threads_count = 0;
+
+    for (i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--sizes") == 0)
+            size_list = argv[i + 1];
+        else if (strcmp(argv[i], "--keys") == 0)
+            key_list = argv[i + 1];
+        else if (strcmp(argv[i], "--storage") == 0)
+            storage_list = argv[i + 1];
+        else if (strcmp(argv[i], "--patterns") == 0)
+            pattern_list = argv[i + 1];
+        else if (strcmp(argv[i], "--seed") == 0)
+            bench_rng_state = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0)
+            threads_count = atoi(argv[i + 1]);
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    size_count = bench_split(size_list, size_names, 32);
+    key_count = bench_split(key_list, key_names, 8);
+    storage_count = bench_split(storage_list, storages, 8);
+    pattern_count = bench_split(pattern_list, patterns, 8);
+
+    printf("%-8s %-6s %10s %-8s %-10s %9s %7s %7s %10s\n", "storage", "keys", "size", "pattern", "op", "ns/op", "p50", "p99", "rss_kb");
+    /* Children inherit unflushed output. */
+    fflush(stdout);
+#if !defined(_WIN32)
+    if (threads_count > 0)
+    {
+        if (threads_count > 256)
+            threads_count = 256;
+        for (z = 0; z < size_count; z++)
+        {
+            size_t n = (size_t)strtod(size_names[z], NULL);
+            pid_t pid = fork();
+            if (pid == 0)
+                exit(bench_sharded(n, threads_count) == 0 ? 0 : 1);
+            if (pid > 0)
+                waitpid(pid, NULL, 0);
+            else
+                bench_sharded(n, threads_count);
+        }
+        return 0;
+    }
+#endif
+    for (s = 0; s < storage_count; s++)
+        for (k = 0; k < key_count; k++)
+            for (z = 0; z < size_count; z++)
+            {
+                size_t n = (size_t)strtod(size_names[z], NULL);
+#if defined(_WIN32)
+                bench_one(storages[s], key_names[k], n, patterns, pattern_count);
+#else
+                pid_t pid = fork();
+                if (pid == 0)
+                    exit(bench_one(storages[s], key_names[k], n, patterns, pattern_count) == 0 ? 0 : 1);
+                if (pid > 0)
+                    waitpid(pid, NULL, 0);
+                else
+                    bench_one(storages[s], key_names[k], n, patterns, pattern_count);
+#endif
+                /* Children consumed their random numbers, vary the stream for the next configuration. */
+                bench_rand();
+            }
+    return 0;
+}
@@ -0,0 +1,765 @@
+#include "concurrent_map.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+/* The upper half picks the shard, lock free shards index their buckets with the lower half. */
+#define CONCURRENT_MAP_SHARD_INDEX(map, hash) (((hash) >> (sizeof(size_t) * 4)) & ((map)->shards_count - 1))
+
+static ConcurrentMapShard *concurrent_map_shard(const ConcurrentMap *map, const void *key)
+{
+    return &map->shards[CONCURRENT_MAP_SHARD_INDEX(map, map_mix_hash(map_type_hash(&map->type, key)))];
+}
+
+static void *concurrent_map_mem_alloc(const MapAllocator *allocator, size_t size)
+{
+    if (allocator->alloc != NULL)
+        return allocator->alloc(allocator->context, size);
+    return malloc(size);
+}
+
+static void concurrent_map_mem_free(const MapAllocator *allocator, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+    if (allocator->free != NULL)
+        allocator->free(allocator->context, ptr, size);
+    else if (allocator->alloc == NULL)
+        free(ptr);
+}
+
+/* Blocks are over allocated by a line so their start can be moved onto one. */
+static size_t concurrent_map_aligned_size(size_t size)
+{
+    return size + CONCURRENT_MAP_CACHE_LINE - 1;
+}
+
+static void *concurrent_map_align(void *block)
+{
+    return (void *)(((uintptr_t)block + CONCURRENT_MAP_CACHE_LINE - 1) & ~(uintptr_t)(CONCURRENT_MAP_CACHE_LINE - 1));
+}
+
+/*
+    Lock free storage (concurrent_map_new_lock_free).
+
+    Every entry is a node of its own, allocated with the key at key_offset and value at value_offset. Once a node is reachable by readers
+    nothing in it changes but next, writers replace nodes instead of editing them. Unlinked nodes and tables go on the shard's retired lists
+    tagged with the epoch they were unlinked in, and are freed once no reader announces an epoch at or before it.
+*/
+
+typedef struct ConcurrentMapNode
+{
+    _Atomic(struct ConcurrentMapNode *) next;
+    size_t hash;
+    struct ConcurrentMapNode *retired_next;
+    uint64_t retired_epoch;
+    unsigned release;
+} ConcurrentMapNode;
+
+/* What reclaiming a node calls, copies made while growing own nothing. */
+#define CONCURRENT_MAP_RELEASE_KEY 0x1u
+#define CONCURRENT_MAP_RELEASE_VALUE 0x2u
+
+typedef struct ConcurrentMapTable
+{
+    struct ConcurrentMapTable *retired_next;
+    uint64_t retired_epoch;
+    size_t buckets_count;
+    _Atomic(ConcurrentMapNode *) buckets[];
+} ConcurrentMapTable;
+
+/* 0 while the slot is unused or its reader is between lookups, otherwise the epoch the reader entered in. */
+struct ConcurrentMapReader
+{
+    _Atomic uint64_t epoch;
+    atomic_int used;
+    byte pad[CONCURRENT_MAP_CACHE_LINE - sizeof(uint64_t) - sizeof(int)];
+};
+
+/* Writer side of a shard, only touched with the shard's lock held. */
+typedef struct
+{
+    size_t length;
+    ConcurrentMapNode *retired_nodes;
+    ConcurrentMapTable *retired_tables;
+    size_t retired_count;
+} ConcurrentMapLockFreeShard;
+
+/* Readers only read tables and write their own slot, the writer side lives in lines of its own. */
+struct ConcurrentMapLockFree
+{
+    struct ConcurrentMapReader readers[CONCURRENT_MAP_MAX_READERS];
+    _Atomic uint64_t epoch;
+    byte pad[CONCURRENT_MAP_CACHE_LINE - sizeof(uint64_t)];
+    void *block;
+    size_t key_offset;
+    size_t value_offset;
+    size_t node_size;
+    _Atomic(ConcurrentMapTable *) *tables;
+    ConcurrentMapLockFreeShard *writers;
+};
+
+static size_t concurrent_map_lock_free_size(size_t shards_count)
+{
+    return sizeof(struct ConcurrentMapLockFree) + shards_count * (sizeof(_Atomic(ConcurrentMapTable *)) + sizeof(ConcurrentMapLockFreeShard)) + CONCURRENT_MAP_CACHE_LINE;
+}
+
+static size_t concurrent_map_table_size(size_t buckets_count)
+{
+    return sizeof(ConcurrentMapTable) + buckets_count * sizeof(_Atomic(ConcurrentMapNode *));
+}
+
+static ConcurrentMapTable *concurrent_map_table_new(ConcurrentMap *map, size_t buckets_count)
+{
+    size_t i;
+    ConcurrentMapTable *table = (ConcurrentMapTable *)concurrent_map_mem_alloc(&map->type.allocator, concurrent_map_table_size(buckets_count));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+    table->retired_next = NULL;
+    table->retired_epoch = 0;
+    table->buckets_count = buckets_count;
+    for (i = 0; i < buckets_count; i++)
+    {
+        atomic_init(&table->buckets[i], NULL);
+    }
+    return table;
+}
+
+static void concurrent_map_node_free(ConcurrentMap *map, ConcurrentMapNode *node)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    if (node->release & CONCURRENT_MAP_RELEASE_KEY)
+        map->type.key_free((byte *)node + lf->key_offset);
+    if (node->release & CONCURRENT_MAP_RELEASE_VALUE)
+        map->type.value_free((byte *)node + lf->value_offset);
+    concurrent_map_mem_free(&map->type.allocator, node, lf->node_size);
+}
+
+static void concurrent_map_retire_node(ConcurrentMap *map, ConcurrentMapLockFreeShard *shard, ConcurrentMapNode *node, unsigned release)
+{
+    node->release = release;
+    node->retired_epoch = atomic_load(&map->lock_free->epoch);
+    node->retired_next = shard->retired_nodes;
+    shard->retired_nodes = node;
+    shard->retired_count++;
+}
+
+static void concurrent_map_retire_table(ConcurrentMap *map, ConcurrentMapLockFreeShard *shard, ConcurrentMapTable *table)
+{
+    table->retired_epoch = atomic_load(&map->lock_free->epoch);
+    table->retired_next = shard->retired_tables;
+    shard->retired_tables = table;
+    shard->retired_count++;
+}
+
+/* Frees what every current reader entered after, force frees everything and is only for concurrent_map_free. */
+static void concurrent_map_reclaim(ConcurrentMap *map, ConcurrentMapLockFreeShard *shard, int force)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    uint64_t oldest = UINT64_MAX;
+    size_t i;
+    if (!force)
+    {
+        /* Readers entering from now on cannot reach anything retired so far. */
+        atomic_fetch_add(&lf->epoch, 1);
+        for (i = 0; i < CONCURRENT_MAP_MAX_READERS; i++)
+        {
+            uint64_t epoch = atomic_load(&lf->readers[i].epoch);
+            if (epoch != 0 && epoch < oldest)
+                oldest = epoch;
+        }
+    }
+
+    ConcurrentMapNode **node_link = &shard->retired_nodes;
+    while (*node_link != NULL)
+    {
+        ConcurrentMapNode *node = *node_link;
+        if (force || node->retired_epoch < oldest)
+        {
+            *node_link = node->retired_next;
+            concurrent_map_node_free(map, node);
+            shard->retired_count--;
+        }
+        else
+            node_link = &node->retired_next;
+    }
+    ConcurrentMapTable **table_link = &shard->retired_tables;
+    while (*table_link != NULL)
+    {
+        ConcurrentMapTable *table = *table_link;
+        if (force || table->retired_epoch < oldest)
+        {
+            *table_link = table->retired_next;
+            concurrent_map_mem_free(&map->type.allocator, table, concurrent_map_table_size(table->buckets_count));
+            shard->retired_count--;
+        }
+        else
+            table_link = &table->retired_next;
+    }
+}
+
+static void concurrent_map_maybe_reclaim(ConcurrentMap *map, ConcurrentMapLockFreeShard *shard)
+{
+    if (shard->retired_count >= CONCURRENT_MAP_RECLAIM_BATCH)
+        concurrent_map_reclaim(map, shard, 0);
+}
+
+/* Copies the shard into a table of buckets_count buckets and publishes it, readers keep walking the old one until they leave. */
+static int concurrent_map_rebuild(ConcurrentMap *map, size_t index, size_t buckets_count, int keep_entries)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    ConcurrentMapLockFreeShard *shard = &lf->writers[index];
+    ConcurrentMapTable *old_table = atomic_load_explicit(&lf->tables[index], memory_order_relaxed);
+    ConcurrentMapTable *table = concurrent_map_table_new(map, buckets_count);
+    ConcurrentMapNode *node;
+    size_t i;
+    if (table == NULL)
+    {
+        return -1;
+    }
+    for (i = 0; keep_entries && i < old_table->buckets_count; i++)
+    {
+        for (node = atomic_load_explicit(&old_table->buckets[i], memory_order_relaxed); node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed))
+        {
+            ConcurrentMapNode *copy = (ConcurrentMapNode *)concurrent_map_mem_alloc(&map->type.allocator, lf->node_size);
+            if (copy == NULL)
+            {
+                /* Nobody has seen the new table yet, drop it and keep the old one. */
+                for (i = 0; i < buckets_count; i++)
+                {
+                    ConcurrentMapNode *next;
+                    for (node = atomic_load_explicit(&table->buckets[i], memory_order_relaxed); node != NULL; node = next)
+                    {
+                        next = atomic_load_explicit(&node->next, memory_order_relaxed);
+                        concurrent_map_mem_free(&map->type.allocator, node, lf->node_size);
+                    }
+                }
+                concurrent_map_mem_free(&map->type.allocator, table, concurrent_map_table_size(buckets_count));
+                return -1;
+            }
+            memcpy(copy, node, lf->node_size);
+            _Atomic(ConcurrentMapNode *) *bucket = &table->buckets[node->hash & (buckets_count - 1)];
+            atomic_init(&copy->next, atomic_load_explicit(bucket, memory_order_relaxed));
+            atomic_store_explicit(bucket, copy, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&lf->tables[index], table, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* The copies own the keys and values now, unless the entries are being dropped. */
+    unsigned release = keep_entries ? 0 : CONCURRENT_MAP_RELEASE_KEY | CONCURRENT_MAP_RELEASE_VALUE;
+    for (i = 0; i < old_table->buckets_count; i++)
+    {
+        for (node = atomic_load_explicit(&old_table->buckets[i], memory_order_relaxed); node != NULL; node = atomic_load_explicit(&node->next, memory_order_relaxed))
+        {
+            concurrent_map_retire_node(map, shard, node, release);
+        }
+    }
+    concurrent_map_retire_table(map, shard, old_table);
+    if (!keep_entries)
+        shard->length = 0;
+    concurrent_map_reclaim(map, shard, 0);
+    return 0;
+}
+
+static size_t concurrent_map_pow2(size_t count)
+{
+    size_t pow2 = 1;
+    while (pow2 < count)
+        pow2 <<= 1;
+    return pow2;
+}
+
+static size_t concurrent_map_align_of(size_t size)
+{
+    size_t align = 1;
+    while (align < 16 && size % (align * 2) == 0)
+        align *= 2;
+    return align;
+}
+
+static size_t concurrent_map_round_up(size_t value, size_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+static void concurrent_map_table_free(ConcurrentMap *map, ConcurrentMapTable *table)
+{
+    size_t i;
+    for (i = 0; i < table->buckets_count; i++)
+    {
+        ConcurrentMapNode *node = atomic_load_explicit(&table->buckets[i], memory_order_relaxed), *next;
+        for (; node != NULL; node = next)
+        {
+            next = atomic_load_explicit(&node->next, memory_order_relaxed);
+            node->release = CONCURRENT_MAP_RELEASE_KEY | CONCURRENT_MAP_RELEASE_VALUE;
+            concurrent_map_node_free(map, node);
+        }
+    }
+    concurrent_map_mem_free(&map->type.allocator, table, concurrent_map_table_size(table->buckets_count));
+}
+
+static void concurrent_map_lock_free_free(ConcurrentMap *map)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    size_t i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        concurrent_map_reclaim(map, &lf->writers[i], 1);
+        ConcurrentMapTable *table = atomic_load_explicit(&lf->tables[i], memory_order_relaxed);
+        if (table != NULL)
+            concurrent_map_table_free(map, table);
+    }
+    concurrent_map_mem_free(&map->type.allocator, lf->block, concurrent_map_lock_free_size(map->shards_count));
+    map->lock_free = NULL;
+}
+
+static int concurrent_map_lock_free_init(ConcurrentMap *map, size_t buckets_count)
+{
+    size_t i;
+    void *block = concurrent_map_mem_alloc(&map->type.allocator, concurrent_map_lock_free_size(map->shards_count));
+    if (block == NULL)
+    {
+        return -1;
+    }
+    struct ConcurrentMapLockFree *lf = (struct ConcurrentMapLockFree *)concurrent_map_align(block);
+    lf->block = block;
+    for (i = 0; i < CONCURRENT_MAP_MAX_READERS; i++)
+    {
+        atomic_init(&lf->readers[i].epoch, 0);
+        atomic_init(&lf->readers[i].used, 0);
+    }
+    atomic_init(&lf->epoch, 1);
+
+    size_t key_align = concurrent_map_align_of(map->type.key_size), value_align = concurrent_map_align_of(map->type.value_size);
+    size_t node_align = key_align > value_align ? key_align : value_align;
+    if (node_align < sizeof(void *))
+        node_align = sizeof(void *);
+    lf->key_offset = concurrent_map_round_up(sizeof(ConcurrentMapNode), key_align);
+    lf->value_offset = concurrent_map_round_up(lf->key_offset + map->type.key_size, value_align);
+    lf->node_size = concurrent_map_round_up(lf->value_offset + map->type.value_size, node_align);
+
+    lf->tables = (_Atomic(ConcurrentMapTable *) *)(lf + 1);
+    lf->writers = (ConcurrentMapLockFreeShard *)(lf->tables + map->shards_count);
+    map->lock_free = lf;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        memset(&lf->writers[i], 0, sizeof(ConcurrentMapLockFreeShard));
+        atomic_init(&lf->tables[i], NULL);
+    }
+    for (i = 0; i < map->shards_count; i++)
+    {
+        ConcurrentMapTable *table = concurrent_map_table_new(map, buckets_count);
+        if (table == NULL)
+        {
+            concurrent_map_lock_free_free(map);
+            return -1;
+        }
+        atomic_init(&lf->tables[i], table);
+    }
+    return 0;
+}
+
+/* Reader side of a lookup, the caller has announced its epoch. */
+static ConcurrentMapNode *concurrent_map_lock_free_find(const ConcurrentMap *map, size_t hash, const void *key)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    ConcurrentMapTable *table = atomic_load_explicit(&lf->tables[CONCURRENT_MAP_SHARD_INDEX(map, hash)], memory_order_acquire);
+    ConcurrentMapNode *node = atomic_load_explicit(&table->buckets[hash & (table->buckets_count - 1)], memory_order_acquire);
+    while (node != NULL)
+    {
+        if (node->hash == hash && map->type.key_cmp((byte *)node + lf->key_offset, key) == 0)
+        {
+            return node;
+        }
+        node = atomic_load_explicit(&node->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+static int concurrent_map_lock_free_read(ConcurrentMap *map, struct ConcurrentMapReader *reader, const void *key, void *value_out)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    size_t hash = map_mix_hash(map_type_hash(&map->type, key));
+    /* The fence keeps the announcement ahead of every load of the table. */
+    atomic_store(&reader->epoch, atomic_load(&lf->epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+    ConcurrentMapNode *node = concurrent_map_lock_free_find(map, hash, key);
+    if (node != NULL && value_out != NULL)
+    {
+        memcpy(value_out, (byte *)node + lf->value_offset, map->type.value_size);
+    }
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    return node == NULL ? -1 : 0;
+}
+
+static struct ConcurrentMapReader *concurrent_map_claim_reader(struct ConcurrentMapLockFree *lf)
+{
+    size_t i;
+    for (i = 0; i < CONCURRENT_MAP_MAX_READERS; i++)
+    {
+        int unused = 0;
+        if (atomic_load_explicit(&lf->readers[i].used, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&lf->readers[i].used, &unused, 1))
+        {
+            return &lf->readers[i];
+        }
+    }
+    return NULL;
+}
+
+static int concurrent_map_lock_free_add(ConcurrentMap *map, const void *key, const void *value)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    size_t hash = map_mix_hash(map_type_hash(&map->type, key)), index = CONCURRENT_MAP_SHARD_INDEX(map, hash);
+    ConcurrentMapLockFreeShard *shard = &lf->writers[index];
+    ConcurrentMapTable *table = atomic_load_explicit(&lf->tables[index], memory_order_relaxed);
+    _Atomic(ConcurrentMapNode *) *link = &table->buckets[hash & (table->buckets_count - 1)];
+    ConcurrentMapNode *node;
+
+    for (node = atomic_load_explicit(link, memory_order_relaxed); node != NULL; node = atomic_load_explicit(link, memory_order_relaxed))
+    {
+        if (node->hash == hash && map->type.key_cmp((byte *)node + lf->key_offset, key) == 0)
+        {
+            /* Key already contained, readers may be copying the old value so it is replaced by a new node. */
+            ConcurrentMapNode *copy = (ConcurrentMapNode *)concurrent_map_mem_alloc(&map->type.allocator, lf->node_size);
+            if (copy == NULL)
+            {
+                return -1;
+            }
+            memcpy(copy, node, lf->node_size);
+            memcpy((byte *)copy + lf->value_offset, value, map->type.value_size);
+            atomic_init(&copy->next, atomic_load_explicit(&node->next, memory_order_relaxed));
+            atomic_store_explicit(link, copy, memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            /* The key moved into the copy, only the old value is released. */
+            concurrent_map_retire_node(map, shard, node, CONCURRENT_MAP_RELEASE_VALUE);
+            concurrent_map_maybe_reclaim(map, shard);
+            return 1;
+        }
+        link = &node->next;
+    }
+
+    if ((double)(shard->length + 1) > map->type.max_load_factor * (double)table->buckets_count &&
+        concurrent_map_rebuild(map, index, table->buckets_count * 2, 1) == 0)
+    {
+        /* Growth failing is not fatal, the chains just get longer. */
+        table = atomic_load_explicit(&lf->tables[index], memory_order_relaxed);
+    }
+
+    node = (ConcurrentMapNode *)concurrent_map_mem_alloc(&map->type.allocator, lf->node_size);
+    if (node == NULL)
+    {
+        return -1;
+    }
+    _Atomic(ConcurrentMapNode *) *bucket = &table->buckets[hash & (table->buckets_count - 1)];
+    node->hash = hash;
+    node->retired_next = NULL;
+    node->retired_epoch = 0;
+    node->release = 0;
+    memcpy((byte *)node + lf->key_offset, key, map->type.key_size);
+    memcpy((byte *)node + lf->value_offset, value, map->type.value_size);
+    atomic_init(&node->next, atomic_load_explicit(bucket, memory_order_relaxed));
+    /* Release publishes the key and value along with the node. */
+    atomic_store_explicit(bucket, node, memory_order_release);
+    shard->length++;
+    return 0;
+}
+
+static int concurrent_map_lock_free_remove(ConcurrentMap *map, const void *key)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    size_t hash = map_mix_hash(map_type_hash(&map->type, key)), index = CONCURRENT_MAP_SHARD_INDEX(map, hash);
+    ConcurrentMapLockFreeShard *shard = &lf->writers[index];
+    ConcurrentMapTable *table = atomic_load_explicit(&lf->tables[index], memory_order_relaxed);
+    _Atomic(ConcurrentMapNode *) *link = &table->buckets[hash & (table->buckets_count - 1)];
+    ConcurrentMapNode *node;
+
+    for (node = atomic_load_explicit(link, memory_order_relaxed); node != NULL; node = atomic_load_explicit(link, memory_order_relaxed))
+    {
+        if (node->hash == hash && map->type.key_cmp((byte *)node + lf->key_offset, key) == 0)
+        {
+            /* Readers standing on the node still find the rest of the chain through its next. */
+            atomic_store_explicit(link, atomic_load_explicit(&node->next, memory_order_relaxed), memory_order_release);
+            atomic_thread_fence(memory_order_seq_cst);
+            concurrent_map_retire_node(map, shard, node, CONCURRENT_MAP_RELEASE_KEY | CONCURRENT_MAP_RELEASE_VALUE);
+            shard->length--;
+            concurrent_map_maybe_reclaim(map, shard);
+            return 0;
+        }
+        link = &node->next;
+    }
+    return -1;
+}
+
+static void concurrent_map_lock_free_for_each(ConcurrentMap *map, size_t index, void (*fn)(const void *key, const void *value, void *context), void *context)
+{
+    struct ConcurrentMapLockFree *lf = map->lock_free;
+    ConcurrentMapTable *table = atomic_load_explicit(&lf->tables[index], memory_order_acquire);
+    size_t i;
+    for (i = 0; i < table->buckets_count; i++)
+    {
+        ConcurrentMapNode *node = atomic_load_explicit(&table->buckets[i], memory_order_acquire);
+        for (; node != NULL; node = atomic_load_explicit(&node->next, memory_order_acquire))
+        {
+            fn((byte *)node + lf->key_offset, (byte *)node + lf->value_offset, context);
+        }
+    }
+}
+
+static ConcurrentMap *concurrent_map_create(MapTypeData type, size_t buckets_count, size_t shards_count, int lock_free)
+{
+    size_t i;
+    if (type.key_hash == NULL)
+    {
+        type.key_hash = map_default_hash;
+    }
+    if (type.key_cmp == NULL)
+    {
+        type.key_cmp = map_default_cmp;
+    }
+    if (type.key_free == NULL)
+    {
+        type.key_free = map_default_free;
+    }
+    if (type.value_free == NULL)
+    {
+        type.value_free = map_default_free;
+    }
+    if (type.max_load_factor <= 0)
+    {
+        type.max_load_factor = MAP_DEFAULT_MAX_LOAD_FACTOR;
+    }
+    if (type.key_hash_seeded != NULL && type.seed == 0)
+    {
+        /* Picked once, so the shards and the shard index agree on every hash. */
+        type.seed = map_random_seed();
+    }
+    shards_count = concurrent_map_pow2(shards_count == 0 ? CONCURRENT_MAP_DEFAULT_SHARDS : shards_count);
+
+    ConcurrentMap *map = (ConcurrentMap *)concurrent_map_mem_alloc(&type.allocator, sizeof(ConcurrentMap));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    map->type = type;
+    map->shards_count = shards_count;
+    map->lock_free = NULL;
+    map->shards_block = concurrent_map_mem_alloc(&type.allocator, concurrent_map_aligned_size(shards_count * sizeof(ConcurrentMapShard)));
+    if (map->shards_block == NULL)
+    {
+        concurrent_map_mem_free(&type.allocator, map, sizeof(ConcurrentMap));
+        return NULL;
+    }
+    /* Shards start on a cache line so each lock has its lines to itself. */
+    map->shards = (ConcurrentMapShard *)concurrent_map_align(map->shards_block);
+
+    size_t shard_buckets = buckets_count / shards_count == 0 ? 1 : buckets_count / shards_count;
+    if (lock_free && concurrent_map_lock_free_init(map, concurrent_map_pow2(shard_buckets)) != 0)
+    {
+        concurrent_map_mem_free(&type.allocator, map->shards_block, concurrent_map_aligned_size(shards_count * sizeof(ConcurrentMapShard)));
+        concurrent_map_mem_free(&type.allocator, map, sizeof(ConcurrentMap));
+        return NULL;
+    }
+    for (i = 0; i < shards_count; i++)
+    {
+        ConcurrentMapShard *shard = &map->shards[i];
+        shard->s.map = lock_free ? NULL : map_new(type, shard_buckets);
+        if ((!lock_free && shard->s.map == NULL) || pthread_rwlock_init(&shard->s.lock, NULL) != 0)
+        {
+            if (shard->s.map != NULL)
+                map_free(shard->s.map);
+            while (i-- > 0)
+            {
+                pthread_rwlock_destroy(&map->shards[i].s.lock);
+                if (map->shards[i].s.map != NULL)
+                    map_free(map->shards[i].s.map);
+            }
+            if (lock_free)
+                concurrent_map_lock_free_free(map);
+            concurrent_map_mem_free(&type.allocator, map->shards_block, concurrent_map_aligned_size(shards_count * sizeof(ConcurrentMapShard)));
+            concurrent_map_mem_free(&type.allocator, map, sizeof(ConcurrentMap));
+            return NULL;
+        }
+    }
+    return map;
+}
+
+ConcurrentMap *concurrent_map_new(MapTypeData type, size_t buckets_count, size_t shards_count)
+{
+    return concurrent_map_create(type, buckets_count, shards_count, 0);
+}
+
+ConcurrentMap *concurrent_map_new_lock_free(MapTypeData type, size_t buckets_count, size_t shards_count)
+{
+    return concurrent_map_create(type, buckets_count, shards_count, 1);
+}
+
+void concurrent_map_free(ConcurrentMap *map)
+{
+    MapAllocator allocator = map->type.allocator;
+    size_t i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        pthread_rwlock_destroy(&map->shards[i].s.lock);
+        if (map->shards[i].s.map != NULL)
+            map_free(map->shards[i].s.map);
+    }
+    if (map->lock_free != NULL)
+        concurrent_map_lock_free_free(map);
+    concurrent_map_mem_free(&allocator, map->shards_block, concurrent_map_aligned_size(map->shards_count * sizeof(ConcurrentMapShard)));
+    concurrent_map_mem_free(&allocator, map, sizeof(ConcurrentMap));
+}
+
+int concurrent_map_add(ConcurrentMap *map, const void *key, const void *value)
+{
+    ConcurrentMapShard *shard = concurrent_map_shard(map, key);
+    int result;
+    pthread_rwlock_wrlock(&shard->s.lock);
+    if (map->lock_free != NULL)
+        result = concurrent_map_lock_free_add(map, key, value);
+    else
+        /* Growing happens inside map_add, a step at a time and only for this shard. */
+        result = map_add(shard->s.map, key, value);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return result;
+}
+
+int concurrent_map_get(ConcurrentMap *map, const void *key, void *value_out)
+{
+    if (map->lock_free != NULL)
+    {
+        struct ConcurrentMapReader *reader;
+        while ((reader = concurrent_map_claim_reader(map->lock_free)) == NULL)
+        {
+            /* Every slot is busy, one frees up as soon as its lookup is done. */
+            sched_yield();
+        }
+        int result = concurrent_map_lock_free_read(map, reader, key, value_out);
+        atomic_store_explicit(&reader->used, 0, memory_order_release);
+        return result;
+    }
+    ConcurrentMapShard *shard = concurrent_map_shard(map, key);
+    pthread_rwlock_rdlock(&shard->s.lock);
+    /* map_get never migrates buckets, so readers only read the shard. */
+    void *value = map_get(shard->s.map, key);
+    if (value != NULL && value_out != NULL)
+    {
+        memcpy(value_out, value, map->type.value_size);
+    }
+    pthread_rwlock_unlock(&shard->s.lock);
+    return value == NULL ? -1 : 0;
+}
+
+ConcurrentMapReader *concurrent_map_reader_new(ConcurrentMap *map)
+{
+    if (map->lock_free == NULL)
+    {
+        return NULL;
+    }
+    return concurrent_map_claim_reader(map->lock_free);
+}
+
+void concurrent_map_reader_free(ConcurrentMap *map, ConcurrentMapReader *reader)
+{
+    if (reader != NULL)
+    {
+        atomic_store_explicit(&reader->used, 0, memory_order_release);
+    }
+}
+
+int concurrent_map_read(ConcurrentMap *map, ConcurrentMapReader *reader, const void *key, void *value_out)
+{
+    if (map->lock_free == NULL || reader == NULL)
+    {
+        return concurrent_map_get(map, key, value_out);
+    }
+    return concurrent_map_lock_free_read(map, reader, key, value_out);
+}
+
+int concurrent_map_remove(ConcurrentMap *map, const void *key)
+{
+    ConcurrentMapShard *shard = concurrent_map_shard(map, key);
+    int result;
+    pthread_rwlock_wrlock(&shard->s.lock);
+    if (map->lock_free != NULL)
+        result = concurrent_map_lock_free_remove(map, key);
+    else
+        result = map_remove(shard->s.map, key);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return result;
+}
+
+size_t concurrent_map_length(ConcurrentMap *map)
+{
+    size_t length = 0, i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        pthread_rwlock_rdlock(&map->shards[i].s.lock);
+        length += map->lock_free != NULL ? map->lock_free->writers[i].length : map->shards[i].s.map->length;
+        pthread_rwlock_unlock(&map->shards[i].s.lock);
+    }
+    return length;
+}
+
+void concurrent_map_for_each(ConcurrentMap *map, void (*fn)(const void *key, const void *value, void *context), void *context)
+{
+    size_t i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        size_t idx = 0;
+        MapNode *node = NULL;
+        pthread_rwlock_rdlock(&map->shards[i].s.lock);
+        if (map->lock_free != NULL)
+        {
+            concurrent_map_lock_free_for_each(map, i, fn, context);
+        }
+        else
+        {
+            /* Read under the lock, concurrent_map_optimize may replace the shard's Map. */
+            Map *shard = map->shards[i].s.map;
+            while (map_iter_next(shard, &idx, &node))
+            {
+                fn(map_iter_key(shard, node), map_iter_value(shard, node), context);
+            }
+        }
+        pthread_rwlock_unlock(&map->shards[i].s.lock);
+    }
+}
+
+void concurrent_map_optimize(ConcurrentMap *map)
+{
+    size_t i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        pthread_rwlock_wrlock(&map->shards[i].s.lock);
+        if (map->lock_free != NULL)
+        {
+            double load_factor = map->type.max_load_factor < 0.75 ? map->type.max_load_factor : 0.75;
+            concurrent_map_rebuild(map, i, concurrent_map_pow2((size_t)((double)map->lock_free->writers[i].length / load_factor) + 1), 1);
+        }
+        else
+            map_optimize(&map->shards[i].s.map);
+        pthread_rwlock_unlock(&map->shards[i].s.lock);
+    }
+}
+
+void concurrent_map_clear(ConcurrentMap *map)
+{
+    size_t i;
+    for (i = 0; i < map->shards_count; i++)
+    {
+        pthread_rwlock_wrlock(&map->shards[i].s.lock);
+        if (map->lock_free != NULL)
+        {
+            ConcurrentMapTable *table = atomic_load_explicit(&map->lock_free->tables[i], memory_order_relaxed);
+            concurrent_map_rebuild(map, i, table->buckets_count, 0);
+        }
+        else
+            map_clear(map->shards[i].s.map);
+        pthread_rwlock_unlock(&map->shards[i].s.lock);
+    }
+}
@@ -0,0 +1,211 @@
+#ifndef _CONCURRENT_MAP_H
+#define _CONCURRENT_MAP_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "map.h"
+#include <pthread.h>
+
+#define CONCURRENT_MAP_DEFAULT_SHARDS 16
+
+#define CONCURRENT_MAP_CACHE_LINE 64
+
+/**
+ * @brief Number of threads that can read a lock free map at the same time, see concurrent_map_reader_new.
+ *
+ */
+#ifndef CONCURRENT_MAP_MAX_READERS
+#define CONCURRENT_MAP_MAX_READERS 64
+#endif
+
+/**
+ * @brief Retired nodes a shard collects before a writer tries to reclaim them.
+ *
+ */
+#define CONCURRENT_MAP_RECLAIM_BATCH 64
+
+    struct ConcurrentMapLockFree;
+
+    /**
+     * @brief Epoch slot of one reading thread, see concurrent_map_reader_new.
+     *
+     */
+    typedef struct ConcurrentMapReader ConcurrentMapReader;
+
+    /**
+     * @brief One independently locked part of a ConcurrentMap, padded to whole cache lines so neighbouring locks do not share one.
+     *
+     */
+    typedef union
+    {
+        struct
+        {
+            pthread_rwlock_t lock;
+            Map *map;
+        } s;
+        byte pad[(sizeof(pthread_rwlock_t) + sizeof(Map *) + CONCURRENT_MAP_CACHE_LINE - 1) / CONCURRENT_MAP_CACHE_LINE * CONCURRENT_MAP_CACHE_LINE];
+    } ConcurrentMapShard;
+
+    /**
+     * @brief Thread safe map made of shards_count Maps, each behind its own reader-writer lock.
+     *
+     * @details The shard is picked from the upper bits of the key_hash after mixing it, so weak hashes like identity still spread over every shard without correlating with the buckets inside it.
+     *
+     * @details Lookups take a read lock and never block each other. Each shard grows on its own and incrementally, so a growing shard only holds up keys that hash into it.
+     *
+     * @warning A custom MapTypeData.allocator is shared by every shard and must be thread safe.
+     *
+     * @note With MAP_STATS the counters of a shard are bumped by concurrent readers without atomics, treat them as estimates.
+     *
+     * @details Maps made with concurrent_map_new_lock_free leave the shards' Map NULL and keep their entries in lock_free instead, the shard locks then only order the writers.
+     */
+    typedef struct
+    {
+        MapTypeData type;
+        size_t shards_count;
+        ConcurrentMapShard *shards;
+        void *shards_block;
+        struct ConcurrentMapLockFree *lock_free;
+    } ConcurrentMap;
+
+    /**
+     * @brief Create a new concurrent map.
+     *
+     * @param type
+     * @param buckets_count Buckets of the whole map, split between the shards.
+     * @param shards_count Rounded up to a power of two, 0 for CONCURRENT_MAP_DEFAULT_SHARDS.
+     * @return ConcurrentMap* or NULL on failure.
+     */
+    ConcurrentMap *concurrent_map_new(MapTypeData type, size_t buckets_count, size_t shards_count);
+
+    /**
+     * @brief Create a concurrent map whose lookups never take a lock.
+     *
+     * @param type storage and flags are ignored, entries are always chained nodes of their own.
+     * @param buckets_count Buckets of the whole map, split between the shards.
+     * @param shards_count Rounded up to a power of two, 0 for CONCURRENT_MAP_DEFAULT_SHARDS.
+     * @return ConcurrentMap* or NULL on failure.
+     *
+     * @details Writers still lock their shard against each other. They publish new nodes with release stores and never change a node readers can reach:
+     * updating a key links in a new node in place of the old one, and growing copies the shard into a new table that replaces the old one in a single store.
+     *
+     * @details Unlinked nodes and tables are freed, and their key_free and value_free called, once every reader that could still see them has left,
+     * readers announce the epoch they read in through their own cache line and write nothing else.
+     *
+     * @note Every write copies a node, so this suits maps that are read far more often than they are written.
+     */
+    ConcurrentMap *concurrent_map_new_lock_free(MapTypeData type, size_t buckets_count, size_t shards_count);
+
+    /**
+     * @brief Free the map and every entry in it.
+     *
+     * @param map
+     *
+     * @warning No other thread may be using the map.
+     */
+    void concurrent_map_free(ConcurrentMap *map);
+
+    /**
+     * @brief Add a key, or update its value if it is already in the map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param value Valid memory address to value.
+     * @return 0 on success, -1 on failure, 1 if the key is already in the map and it updated the value.
+     */
+    int concurrent_map_add(ConcurrentMap *map, const void *key, const void *value);
+
+    /**
+     * @brief Find a key and copy its value out while the shard is locked.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param value_out value_size bytes to copy the value into, may be NULL to only check for the key.
+     * @return 0 if the key was found, -1 if not.
+     *
+     * @details The value is copied because another thread may remove or update the entry as soon as the lock is released.
+     * Values holding pointers are only safe to dereference if nothing frees them concurrently.
+     */
+    int concurrent_map_get(ConcurrentMap *map, const void *key, void *value_out);
+
+    /**
+     * @brief Claim an epoch slot for the calling thread, to read with concurrent_map_read.
+     *
+     * @param map
+     * @return ConcurrentMapReader* or NULL if all CONCURRENT_MAP_MAX_READERS slots are taken or the map is not lock free.
+     *
+     * @details concurrent_map_get on a lock free map claims a slot for each call, a reader keeps one for as long as the thread needs it.
+     */
+    ConcurrentMapReader *concurrent_map_reader_new(ConcurrentMap *map);
+
+    /**
+     * @brief Give the slot back.
+     *
+     * @param map
+     * @param reader May be NULL.
+     */
+    void concurrent_map_reader_free(ConcurrentMap *map, ConcurrentMapReader *reader);
+
+    /**
+     * @brief Lock free lookup through a reader of the calling thread.
+     *
+     * @param map
+     * @param reader Only used by one thread at a time.
+     * @param key Valid memory address to key.
+     * @param value_out value_size bytes to copy the value into, may be NULL to only check for the key.
+     * @return 0 if the key was found, -1 if not.
+     *
+     * @details Same as concurrent_map_get without taking any lock or claiming a slot.
+     */
+    int concurrent_map_read(ConcurrentMap *map, ConcurrentMapReader *reader, const void *key, void *value_out);
+
+    /**
+     * @brief Remove a key from the map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return 0 on success, -1 if the key is not in the map.
+     */
+    int concurrent_map_remove(ConcurrentMap *map, const void *key);
+
+    /**
+     * @brief Number of entries in the map.
+     *
+     * @param map
+     * @return size_t
+     *
+     * @note Shards are counted one after the other, concurrent adds and removes may or may not be included.
+     */
+    size_t concurrent_map_length(ConcurrentMap *map);
+
+    /**
+     * @brief Call fn on every entry, holding the read lock of one shard at a time.
+     *
+     * @param map
+     * @param fn Must not modify the map.
+     * @param context Passed to fn.
+     */
+    void concurrent_map_for_each(ConcurrentMap *map, void (*fn)(const void *key, const void *value, void *context), void *context);
+
+    /**
+     * @brief Rebuild every shard with map_optimize, one shard at a time.
+     *
+     * @param map
+     */
+    void concurrent_map_optimize(ConcurrentMap *map);
+
+    /**
+     * @brief Remove all elements from the map, one shard at a time.
+     *
+     * @param map
+     */
+    void concurrent_map_clear(ConcurrentMap *map);
+
+#ifdef __cplusplus
+} /* Extern "C" */
+#endif
+
+#endif /* _CONCURRENT_MAP_H */
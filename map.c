@@ -1,6 +1,33 @@
 #include "map.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#define MAP_HAVE_MMAP
+#include <fcntl.h>
+/* sys/mman.h defines a MAP_TYPE of its own, keep the one from map.h. */
+#pragma push_macro("MAP_TYPE")
+#undef MAP_TYPE
+#include <sys/mman.h>
+#undef MAP_TYPE
+#pragma pop_macro("MAP_TYPE")
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <time.h>
+#if !defined(MAP_NO_THREADS) && !defined(_WIN32)
+#define MAP_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(MAP_SIMD_AVX2)
+#include <immintrin.h>
+#elif defined(MAP_SIMD_SSE2)
+#include <emmintrin.h>
+#elif defined(MAP_SIMD_NEON)
+#include <arm_neon.h>
+#endif
 
 size_t map_default_hash(const void *key)
 {
@@ -48,258 +75,3754 @@ void map_default_free(void *ptr)
     return;
 }
 
-Map *map_new(MapTypeData type, size_t buckets_count)
+/* Every allocation of a map goes through its allocator, a NULL alloc means malloc and free. */
+static void *map_mem_alloc(const MapAllocator *allocator, size_t size)
 {
-    Map *map = (Map *)malloc(sizeof(Map));
-    if (map == NULL)
-    {
-        return NULL;
-    }
-    if (type.key_hash == NULL)
+    if (allocator->alloc != NULL)
+        return allocator->alloc(allocator->context, size);
+    return malloc(size);
+}
+
+static void *map_mem_calloc(const MapAllocator *allocator, size_t count, size_t size)
+{
+    if (allocator->alloc == NULL)
+        return calloc(count, size);
+    void *ptr = allocator->alloc(allocator->context, count * size);
+    if (ptr != NULL)
+        memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static void map_mem_free(const MapAllocator *allocator, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+    if (allocator->free != NULL)
+        allocator->free(allocator->context, ptr, size);
+    else if (allocator->alloc == NULL)
+        free(ptr);
+}
+
+#ifdef MAP_STATS
+static uint64_t map_stats_now(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+    return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+static void map_stats_probe(MapStats *stats, size_t length)
+{
+    size_t bin = 0;
+    while (length >> bin != 0 && bin < MAP_STATS_HISTOGRAM_SIZE - 1)
+        bin++;
+    stats->probe_histogram[bin]++;
+    stats->probe_total += length;
+    if (length > stats->probe_max)
+        stats->probe_max = length;
+}
+
+#define MAP_STAT(map, field) ((map)->stats->field++)
+#define MAP_STAT_ADD(map, field, n) ((map)->stats->field += (n))
+#define MAP_STAT_PROBE(map, length) map_stats_probe((map)->stats, (length))
+#define MAP_STAT_CLOCK(start) uint64_t start = map_stats_now()
+#define MAP_STAT_RESIZE_TIME(map, start) ((map)->stats->resize_ns += map_stats_now() - (start))
+#else
+#define MAP_STAT(map, field) ((void)0)
+#define MAP_STAT_ADD(map, field, n) ((void)(n))
+#define MAP_STAT_PROBE(map, length) ((void)(length))
+#define MAP_STAT_CLOCK(start) ((void)0)
+#define MAP_STAT_RESIZE_TIME(map, start) ((void)0)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MAP_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define MAP_PREFETCH(addr) ((void)(addr))
+#endif
+
+/* Slabs are this header followed by count nodes. */
+struct MapSlab
+{
+    struct MapSlab *next;
+    size_t count;
+};
+
+#define MAP_SLAB_HEADER_SIZE ((sizeof(struct MapSlab) + 15) / 16 * 16)
+
+static MapNode *map_node_alloc(Map *map)
+{
+    MapNodePool *pool = &map->pool;
+    MapNode *node = pool->free_nodes;
+    if (node != NULL)
     {
-        type.key_hash = map_default_hash;
+        pool->free_nodes = node->next;
+        return node;
     }
-    if (type.key_cmp == NULL)
+    if (pool->bump_left == 0 && pool->spare_slabs != NULL)
     {
-        type.key_cmp = map_default_cmp;
+        struct MapSlab *slab = pool->spare_slabs;
+        pool->spare_slabs = slab->next;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (byte *)slab + MAP_SLAB_HEADER_SIZE;
+        pool->bump_left = slab->count;
     }
-    if (type.key_free == NULL)
+    if (pool->bump_left == 0)
     {
-        type.key_free = map_default_free;
+        size_t count = pool->slabs == NULL ? MAP_POOL_FIRST_SLAB : pool->slabs->count * 2;
+        if (count > MAP_POOL_MAX_SLAB)
+            count = MAP_POOL_MAX_SLAB;
+        struct MapSlab *slab = (struct MapSlab *)map_mem_alloc(&map->type.allocator, MAP_SLAB_HEADER_SIZE + count * map->entry_size);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        slab->count = count;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (byte *)slab + MAP_SLAB_HEADER_SIZE;
+        pool->bump_left = count;
     }
-    if (type.value_free == NULL)
+    node = (MapNode *)pool->bump;
+    pool->bump += map->entry_size;
+    pool->bump_left--;
+    return node;
+}
+
+/* Freed nodes are kept for the next map_add, slabs are only returned by map_free. */
+static void map_node_release(Map *map, MapNode *node)
+{
+    node->next = map->pool.free_nodes;
+    map->pool.free_nodes = node;
+}
+
+static void map_slabs_free(Map *map, struct MapSlab *slab)
+{
+    while (slab != NULL)
     {
-        type.value_free = map_default_free;
+        struct MapSlab *next = slab->next;
+        map_mem_free(&map->type.allocator, slab, MAP_SLAB_HEADER_SIZE + slab->count * map->entry_size);
+        slab = next;
     }
+}
 
-    map->type = type;
-    map->length = 0;
-    map->buckets_count = buckets_count;
-    map->buckets = (MapNode *)calloc(map->buckets_count, sizeof(MapNode));
-    if (map->buckets == NULL)
+static void map_pool_free(Map *map)
+{
+    map_slabs_free(map, map->pool.slabs);
+    map_slabs_free(map, map->pool.spare_slabs);
+    memset(&map->pool, 0, sizeof(map->pool));
+}
+
+/* Every node is unused again, the slabs are kept to be bumped through once more. */
+static void map_pool_reset(Map *map)
+{
+    MapNodePool *pool = &map->pool;
+    while (pool->slabs != NULL)
     {
-        free(map);
-        return NULL;
+        struct MapSlab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        slab->next = pool->spare_slabs;
+        pool->spare_slabs = slab;
     }
+    pool->free_nodes = NULL;
+    pool->bump = NULL;
+    pool->bump_left = 0;
+}
 
-    return map;
+/* key_free and value_free do nothing, so entries can be dropped without visiting them. */
+static int map_trivial(const Map *map)
+{
+    return map->type.key_free == map_default_free && map->type.value_free == map_default_free;
 }
 
-void map_free(Map *map)
+/* Arena blocks are this header followed by the memory handed out. */
+struct MapArenaBlock
 {
-    size_t i;
-    for (i = 0; i < map->buckets_count; i++)
+    struct MapArenaBlock *next;
+    size_t size;
+};
+
+#define MAP_ARENA_HEADER_SIZE ((sizeof(struct MapArenaBlock) + 15) / 16 * 16)
+
+/* Maps start with an empty string arena, it only allocates once a long MapStr key is copied in. */
+#define MAP_STR_ARENA_BLOCK_SIZE 4096
+
+static void *map_arena_alloc(void *context, size_t size)
+{
+    MapArena *arena = (MapArena *)context;
+    size = (size + 15) / 16 * 16;
+    if (size > arena->left)
     {
-        int c = 0;
-        MapNode *node = &map->buckets[i];
-        while (node != NULL)
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        struct MapArenaBlock *block = (struct MapArenaBlock *)malloc(MAP_ARENA_HEADER_SIZE + block_size);
+        if (block == NULL)
         {
-            MapNode *next = node->next;
-            if (map->type.key_free)
-                map->type.key_free(node->key);
-            if (map->type.value_free)
-                map->type.value_free(node->value);
-            free(node->key);
-            free(node->value);
-            if (c++ > 0)
-                free(node);
-            node = next;
-            map->length--;
+            return NULL;
         }
+        block->size = block_size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->cursor = (byte *)block + MAP_ARENA_HEADER_SIZE;
+        arena->left = block_size;
     }
-    free(map->buckets);
-    free(map);
+    void *ptr = arena->cursor;
+    arena->cursor += size;
+    arena->left -= size;
+    return ptr;
 }
 
-int map_add(Map *map, const void *key, const void *value)
+/* Arena memory is only given back all at once. */
+static void map_arena_free(void *context, void *ptr, size_t size)
 {
-    size_t hash = map->type.key_hash(key);
-    size_t index = hash % map->buckets_count;
+    return;
+}
 
-    MapNode *node = &map->buckets[index];
+void map_arena_init(MapArena *arena, size_t block_size)
+{
+    arena->blocks = NULL;
+    arena->cursor = NULL;
+    arena->left = 0;
+    arena->block_size = block_size == 0 ? MAP_ARENA_DEFAULT_BLOCK_SIZE : block_size;
+}
 
-    if (node->key == NULL && node->value == NULL)
+void map_arena_destroy(MapArena *arena)
+{
+    struct MapArenaBlock *block = arena->blocks;
+    while (block != NULL)
     {
-        /* First time accessing this bucket. */
-        node->key = (byte *)malloc(map->type.key_size);
-        if (node->key == NULL)
-        {
-            return -1;
-        }
+        struct MapArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    map_arena_init(arena, arena->block_size);
+}
 
-        node->value = (byte *)malloc(map->type.value_size);
-        if (node->value == NULL)
-        {
-            free(node->key);
-            return -1;
-        }
+MapAllocator map_arena_allocator(MapArena *arena)
+{
+    MapAllocator allocator;
+    allocator.alloc = map_arena_alloc;
+    allocator.free = map_arena_free;
+    allocator.context = arena;
+    return allocator;
+}
 
-        memcpy(node->key, key, map->type.key_size);
-        memcpy(node->value, value, map->type.value_size);
+/*
+    Open addressing storage (MAP_STORAGE_FLAT).
 
-        map->length++;
-        return 0;
-    }
+    ctrl holds one byte per slot, either MAP_CTRL_EMPTY, MAP_CTRL_DELETED or the low 7 bits of the hash (h2).
+    The first MAP_GROUP_WIDTH bytes are mirrored after the last slot so a group can be read at any position without wrapping.
+    Slots hold the full hash, then the key and the value (at key_offset and value_offset), the upper bits of the hash (h1) pick the group a probe starts at.
+*/
+
+#define MAP_CTRL_EMPTY ((byte)0x80)
+#define MAP_CTRL_DELETED ((byte)0xFE)
+#define MAP_MAX_ALIGN 16
+/* Open addressing degrades fast when nearly full, never fill more than 7/8 of the slots. */
+#define MAP_FLAT_MAX_LOAD_FACTOR 0.875
+
+typedef uint32_t MapGroupMask;
+
+static size_t map_round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+/* Largest power of two dividing size, which is at least the alignment any type of that size needs. */
+static size_t map_size_align(size_t size)
+{
+    size_t align = size & (~size + 1);
+    if (align == 0 || align > MAP_MAX_ALIGN)
+        return align == 0 ? 1 : MAP_MAX_ALIGN;
+    return align;
+}
 
-    while (node->next != NULL)
+static unsigned map_ctz(MapGroupMask mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctz(mask);
+#else
+    unsigned n = 0;
+    while ((mask & 1) == 0)
     {
-        if (map->type.key_cmp(node->key, key) == 0)
-        {
-            /* Key already contained, update value */
-            map->type.value_free(node->value);
-            memcpy(node->value, value, map->type.value_size);
-            return 1;
-        }
-        node = node->next;
+        mask >>= 1;
+        n++;
     }
-    /* Add node. */
-    MapNode *new_node = (MapNode *)malloc(sizeof(MapNode));
-    if (new_node == NULL)
+    return n;
+#endif
+}
+
+/* Hash as stored in entries from a key_hash result, MAP_HASH_USED marks the entry as occupied so a zero hash means an empty bucket. */
+static size_t map_finish_hash(const Map *map, size_t hash)
+{
+    if (map->type.storage != MAP_STORAGE_CHAINED || (map->type.flags & MAP_FLAG_POW2))
+        hash = map_mix_hash(hash);
+    return hash | MAP_HASH_USED;
+}
+
+static size_t map_hash_key(const Map *map, const void *key)
+{
+    return map_finish_hash(map, map_type_hash(&map->type, key));
+}
+
+/* Masking only works on power of two tables, everything else pays for the division. */
+static size_t map_index(const Map *map, size_t hash, size_t buckets_count)
+{
+    if (map->type.flags & MAP_FLAG_POW2)
+        return hash & (buckets_count - 1);
+    return hash % buckets_count;
+}
+
+static size_t map_round_pow2(size_t n)
+{
+    size_t pow2 = 1;
+    while (pow2 < n)
+        pow2 *= 2;
+    return pow2;
+}
+
+/*
+    Group scans return a bit mask with bit i set when control byte i of the group matches.
+    The instruction set is picked at compile time, AVX2 also widens MAP_GROUP_WIDTH to 32 (see map.h).
+    Define MAP_NO_SIMD to force the portable version.
+*/
+#if defined(MAP_SIMD_AVX2)
+
+static MapGroupMask map_group_match(const byte *group, byte h2)
+{
+    __m256i ctrl = _mm256_loadu_si256((const __m256i *)group);
+    return (MapGroupMask)_mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)h2)));
+}
+
+static MapGroupMask map_group_match_free(const byte *group)
+{
+    return (MapGroupMask)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)group));
+}
+
+#elif defined(MAP_SIMD_SSE2)
+
+static MapGroupMask map_group_match(const byte *group, byte h2)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (MapGroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+}
+
+static MapGroupMask map_group_match_free(const byte *group)
+{
+    return (MapGroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+
+#elif defined(MAP_SIMD_NEON)
+
+/* NEON has no movemask, weight each lane by its bit and add the halves up. */
+static MapGroupMask map_neon_movemask(uint8x16_t lanes)
+{
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(lanes, vld1q_u8(weights));
+    return (MapGroupMask)vaddv_u8(vget_low_u8(bits)) | ((MapGroupMask)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+static MapGroupMask map_group_match(const byte *group, byte h2)
+{
+    return map_neon_movemask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(h2)));
+}
+
+static MapGroupMask map_group_match_free(const byte *group)
+{
+    return map_neon_movemask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(group)), vdupq_n_s8(0)));
+}
+
+#elif defined(MAP_SIMD_SWAR)
+
+/* Portable version working on 8 control bytes per 64 bit word, only used on little endian targets. */
+#define MAP_SWAR_LSB 0x0101010101010101ULL
+#define MAP_SWAR_MSB 0x8080808080808080ULL
+
+/* Gathers the high bit of every byte into the low 8 bits. */
+static MapGroupMask map_swar_compact(uint64_t high_bits)
+{
+    return (MapGroupMask)(((high_bits >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+static MapGroupMask map_group_match(const byte *group, byte h2)
+{
+    uint64_t words[2];
+    MapGroupMask mask = 0;
+    unsigned i;
+    memcpy(words, group, sizeof(words));
+    for (i = 0; i < 2; i++)
     {
-        return -1;
+        /* Zero bytes are matches, bytes after a match can show up as false positives which key_cmp filters out. */
+        uint64_t x = words[i] ^ (MAP_SWAR_LSB * h2);
+        mask |= map_swar_compact((x - MAP_SWAR_LSB) & ~x & MAP_SWAR_MSB) << (8 * i);
     }
+    return mask;
+}
 
-    new_node->key = (byte *)malloc(map->type.key_size);
-    if (new_node->key == NULL)
+static MapGroupMask map_group_match_free(const byte *group)
+{
+    uint64_t words[2];
+    memcpy(words, group, sizeof(words));
+    return map_swar_compact(words[0] & MAP_SWAR_MSB) | (map_swar_compact(words[1] & MAP_SWAR_MSB) << 8);
+}
+
+/* Exact, empty is the only control byte with the high bit set and bit 6 clear. */
+static MapGroupMask map_group_match_empty(const byte *group)
+{
+    uint64_t words[2];
+    memcpy(words, group, sizeof(words));
+    return map_swar_compact(words[0] & ~(words[0] << 1) & MAP_SWAR_MSB) |
+           (map_swar_compact(words[1] & ~(words[1] << 1) & MAP_SWAR_MSB) << 8);
+}
+
+#else
+
+static MapGroupMask map_group_match(const byte *group, byte h2)
+{
+    MapGroupMask mask = 0;
+    unsigned i;
+    for (i = 0; i < MAP_GROUP_WIDTH; i++)
     {
-        free(new_node);
-        return -1;
+        if (group[i] == h2)
+            mask |= (MapGroupMask)1 << i;
     }
+    return mask;
+}
 
-    new_node->value = (byte *)malloc(map->type.value_size);
-    if (new_node->value == NULL)
+/* Empty and deleted are the only control bytes with the high bit set. */
+static MapGroupMask map_group_match_free(const byte *group)
+{
+    MapGroupMask mask = 0;
+    unsigned i;
+    for (i = 0; i < MAP_GROUP_WIDTH; i++)
     {
-        free(new_node->key);
-        free(new_node);
-        return -1;
+        if (group[i] & 0x80)
+            mask |= (MapGroupMask)1 << i;
     }
+    return mask;
+}
 
-    memcpy(new_node->key, key, map->type.key_size);
-    memcpy(new_node->value, value, map->type.value_size);
-    new_node->next = NULL;
+#endif
 
-    node->next = new_node;
-    map->length++;
-    return 0;
+#if !defined(MAP_SIMD_SWAR)
+/* MAP_CTRL_EMPTY can never be a hash fragment, so matching it exactly finds empty slots. */
+static MapGroupMask map_group_match_empty(const byte *group)
+{
+    return map_group_match(group, MAP_CTRL_EMPTY);
 }
+#endif
 
-void *map_get(Map *map, const void *key)
+static void map_snapshots_touch(Map *map, size_t index);
+static void map_snapshots_detach(Map *map);
+
+/* Open snapshots copy the chunk holding bucket or slot index before the map writes to it. */
+#define MAP_SNAPSHOT_TOUCH(map, index)               \
+    do                                               \
+    {                                                \
+        if ((map)->snapshots != NULL)                \
+            map_snapshots_touch((map), (index));     \
+    } while (0)
+
+static void map_flat_set_ctrl(Map *map, size_t index, byte ctrl)
 {
-    size_t hash = map->type.key_hash(key);
-    size_t index = hash % map->buckets_count;
+    MAP_SNAPSHOT_TOUCH(map, index);
+    map->ctrl[index] = ctrl;
+    if (index < MAP_GROUP_WIDTH)
+        map->ctrl[map->buckets_count + index] = ctrl;
+}
 
-    MapNode *node = &map->buckets[index];
-    while (node != NULL)
-    {
-        if (node->key == NULL && node->value == NULL)
-        {
-            return NULL;
-        }
-        int cmp = map->type.key_cmp(node->key, key);
-        if (cmp == 0)
-        {
-            return node->value;
-        }
-        node = node->next;
-    }
+static byte *map_flat_slot(const Map *map, size_t index)
+{
+    return map->slots + index * map->entry_size;
+}
 
-    return NULL;
+/* Every slot starts with the full hash of its key. */
+#define MAP_SLOT_HASH(slot) (*(size_t *)(slot))
+
+/* Dense maps only keep the position of the entry in their slots. */
+static size_t map_flat_slot_size(const Map *map)
+{
+    return map->type.storage == MAP_STORAGE_DENSE ? sizeof(size_t) : map->entry_size;
 }
 
-int map_remove(Map *map, const void *key)
+static size_t map_flat_block_size(const Map *map, size_t capacity)
 {
-    size_t hash = map->type.key_hash(key);
-    size_t index = hash % map->buckets_count;
+    return map_round_up(capacity + MAP_GROUP_WIDTH, MAP_MAX_ALIGN) + capacity * map_flat_slot_size(map);
+}
 
-    MapNode *node = &map->buckets[index];
-    MapNode *prev = NULL;
-    while (node != NULL)
+/* Allocates an empty table, capacity must be a power of two no smaller than MAP_GROUP_WIDTH. */
+static int map_flat_alloc(Map *map, size_t capacity)
+{
+    size_t ctrl_size = map_round_up(capacity + MAP_GROUP_WIDTH, MAP_MAX_ALIGN);
+    byte *block = (byte *)map_mem_alloc(&map->type.allocator, map_flat_block_size(map, capacity));
+    if (block == NULL)
     {
-        if (node->key && (map->type.key_cmp(node->key, key) == 0))
-        {
-            /* Found key, remove node. */
-            map->type.key_free(node->key);
-            map->type.value_free(node->value);
-            free(node->key);
-            free(node->value);
-            if (prev != NULL)
-			{
-                /* This node is not a bucket so free it. */
-				prev->next = node->next;
-				free(node);
-			}
-			else
-			{
-                /* This node is a bucket so don't free the node. */
-				node->key = NULL;
-				node->value = NULL;
-                /* Promote the next node to the bucket */
-                MapNode *next = node->next;
-                if (next != NULL)
-				{
-                    /* There is a next node so promote it and free the heap data. */
-					*node = *next;
-					free(next);
-				}
-			}
-            map->length--;
-            return 0;
-        }
-        prev = node;
-        node = node->next;
+        return -1;
     }
-    return -1;
+    memset(block, MAP_CTRL_EMPTY, capacity + MAP_GROUP_WIDTH);
+    map->ctrl = block;
+    map->slots = block + ctrl_size;
+    map->buckets_count = capacity;
+    map->tombstones = 0;
+    return 0;
 }
 
-double map_load_factor(const Map *map)
+static size_t map_flat_capacity(size_t buckets_count)
 {
-    return (double)map->length / (double)map->buckets_count;
+    return buckets_count < MAP_GROUP_WIDTH ? MAP_GROUP_WIDTH : map_round_pow2(buckets_count);
 }
 
-size_t map_count_collisions(const Map *map)
+static byte *map_flat_find(const Map *map, size_t hash, const void *key)
 {
-    size_t collisions = 0, i;
-    for (i = 0; i < map->buckets_count; i++)
+    size_t mask = map->buckets_count - 1, pos = (hash >> 7) & mask, step = 0, probes = 0;
+    byte h2 = (byte)(hash & 0x7F);
+    while (1)
     {
-        MapNode *node = map->buckets[i].next;
-        if (node != NULL)
+        const byte *group = map->ctrl + pos;
+        MapGroupMask match = map_group_match(group, h2);
+        probes++;
+        while (match != 0)
         {
-            collisions++;
-            while (node->next != NULL)
+            byte *slot = map_flat_slot(map, (pos + map_ctz(match)) & mask);
+            if (MAP_SLOT_HASH(slot) == hash && map->type.key_cmp(slot + map->key_offset, key) == 0)
             {
-                collisions++;
-                node = node->next;
+                MAP_STAT_PROBE(map, probes);
+                return slot;
             }
+            match &= match - 1;
+        }
+        if (map_group_match_empty(group) != 0)
+        {
+            MAP_STAT_PROBE(map, probes);
+            return NULL;
         }
+        step += MAP_GROUP_WIDTH;
+        pos = (pos + step) & mask;
     }
-    return collisions;
 }
 
-void map_optimize(Map **inp)
+/* First empty or deleted slot on the probe sequence of hash. */
+static size_t map_flat_find_free(const Map *map, size_t hash)
 {
-    Map *map = *inp;
-    size_t new_buckets_count = (size_t)((double)map->length / 0.75), i;
-    Map *new_map = map_new(map->type, new_buckets_count);
-
-    for (i = 0; i < map->buckets_count; i++)
+    size_t mask = map->buckets_count - 1, pos = (hash >> 7) & mask, step = 0;
+    while (1)
     {
-        MapNode *node = &map->buckets[i];
-        if (node->key == NULL && node->value == NULL)
-        {
-            continue;
-        }
-        while (node != NULL)
+        MapGroupMask match = map_group_match_free(map->ctrl + pos);
+        if (match != 0)
         {
-            map_add(new_map, node->key, node->value);
-
-            MapNode *next = node->next;
-            node = next;
+            return (pos + map_ctz(match)) & mask;
         }
+        step += MAP_GROUP_WIDTH;
+        pos = (pos + step) & mask;
     }
-    map->type.key_free = NULL;
-    map->type.value_free = NULL;
-    map_free(map);
-    *inp = new_map;
+}
+
+/* Moves every entry into a fresh table of capacity slots, dropping tombstones on the way. */
+static int map_flat_rehash(Map *map, size_t capacity)
+{
+    byte *old_ctrl = map->ctrl, *old_slots = map->slots;
+    size_t old_capacity = map->buckets_count, i;
+    MAP_STAT_CLOCK(start);
+    map_snapshots_detach(map);
+    if (map_flat_alloc(map, capacity) != 0)
+    {
+        map->ctrl = old_ctrl;
+        map->slots = old_slots;
+        map->buckets_count = old_capacity;
+        return -1;
+    }
+    for (i = 0; i < old_capacity; i++)
+    {
+        if (old_ctrl[i] & 0x80)
+            continue;
+        byte *slot = old_slots + i * map->entry_size;
+        size_t hash = MAP_SLOT_HASH(slot);
+        size_t index = map_flat_find_free(map, hash);
+        map_flat_set_ctrl(map, index, (byte)(hash & 0x7F));
+        memcpy(map_flat_slot(map, index), slot, map->entry_size);
+    }
+    map_mem_free(&map->type.allocator, old_ctrl, map_flat_block_size(map, old_capacity));
+    map->generation++;
+    MAP_STAT(map, resizes);
+    MAP_STAT_RESIZE_TIME(map, start);
+    return 0;
+}
+
+static double map_flat_max_load(const Map *map)
+{
+    return map->type.max_load_factor < MAP_FLAT_MAX_LOAD_FACTOR ? map->type.max_load_factor : MAP_FLAT_MAX_LOAD_FACTOR;
+}
+
+/* Value of key, added with a zeroed value if it was missing. */
+static byte *map_flat_insert(Map *map, size_t hash, const void *key, int *inserted)
+{
+    byte *slot = map_flat_find(map, hash, key);
+    if (slot != NULL)
+    {
+        MAP_SNAPSHOT_TOUCH(map, (size_t)(slot - map->slots) / map->entry_size);
+        return slot + map->value_offset;
+    }
+
+    double max_load = map_flat_max_load(map);
+    if ((double)(map->length + map->tombstones + 1) > max_load * (double)map->buckets_count)
+    {
+        /* Mostly tombstones means a same size rehash is enough to make room. */
+        size_t capacity = (double)(map->length + 1) > max_load * (double)map->buckets_count / 2 ? map->buckets_count * 2 : map->buckets_count;
+        if (map_flat_rehash(map, capacity) != 0 && map->length + map->tombstones + 1 >= map->buckets_count)
+        {
+            return NULL;
+        }
+    }
+
+    size_t index = map_flat_find_free(map, hash);
+    if (map->ctrl[index] == MAP_CTRL_DELETED)
+        map->tombstones--;
+    map_flat_set_ctrl(map, index, (byte)(hash & 0x7F));
+    slot = map_flat_slot(map, index);
+    MAP_SLOT_HASH(slot) = hash;
+    memcpy(slot + map->key_offset, key, map->type.key_size);
+    memset(slot + map->value_offset, 0, map->type.value_size);
+    map->length++;
+    MAP_STAT(map, inserts);
+    *inserted = 1;
+    return slot + map->value_offset;
+}
+
+static int map_flat_remove(Map *map, size_t hash, const void *key)
+{
+    byte *slot = map_flat_find(map, hash, key);
+    if (slot == NULL)
+    {
+        return -1;
+    }
+    map->type.key_free(slot + map->key_offset);
+    map->type.value_free(slot + map->value_offset);
+    map_flat_set_ctrl(map, (size_t)(slot - map->slots) / map->entry_size, MAP_CTRL_DELETED);
+    map->tombstones++;
+    map->length--;
+    MAP_STAT(map, removes);
+    return 0;
+}
+
+static size_t map_flat_remove_if(Map *map, int (*pred)(const void *key, void *value, void *context), void *context)
+{
+    size_t i, removed = 0;
+    for (i = 0; i < map->buckets_count; i++)
+    {
+        if (map->ctrl[i] & 0x80)
+            continue;
+        byte *slot = map_flat_slot(map, i);
+        if (!pred(slot + map->key_offset, slot + map->value_offset, context))
+            continue;
+        map->type.key_free(slot + map->key_offset);
+        map->type.value_free(slot + map->value_offset);
+        map_flat_set_ctrl(map, i, MAP_CTRL_DELETED);
+        map->tombstones++;
+        map->length--;
+        removed++;
+    }
+    if (map->length == 0)
+    {
+        /* Nothing left to probe past, drop the tombstones too. Snapshots still probe past the ones in chunks they share. */
+        map_snapshots_detach(map);
+        memset(map->ctrl, MAP_CTRL_EMPTY, map->buckets_count + MAP_GROUP_WIDTH);
+        map->tombstones = 0;
+    }
+    return removed;
+}
+
+static void map_flat_clear(Map *map)
+{
+    size_t i, count = map_trivial(map) ? 0 : map->buckets_count;
+    for (i = 0; i < count; i++)
+    {
+        if (map->ctrl[i] & 0x80)
+            continue;
+        byte *slot = map_flat_slot(map, i);
+        map->type.key_free(slot + map->key_offset);
+        map->type.value_free(slot + map->value_offset);
+    }
+    memset(map->ctrl, MAP_CTRL_EMPTY, map->buckets_count + MAP_GROUP_WIDTH);
+    map->length = 0;
+    map->tombstones = 0;
+}
+
+/* Entries that could not be placed in the group their hash starts at. */
+static size_t map_flat_count_collisions(const Map *map)
+{
+    size_t collisions = 0, mask = map->buckets_count - 1, i;
+    for (i = 0; i < map->buckets_count; i++)
+    {
+        if (map->ctrl[i] & 0x80)
+            continue;
+        size_t home = (MAP_SLOT_HASH(map_flat_slot(map, i)) >> 7) & mask;
+        if (((i - home) & mask) >= MAP_GROUP_WIDTH)
+            collisions++;
+    }
+    return collisions;
+}
+
+/*
+    Dense storage (MAP_STORAGE_DENSE).
+
+    entries holds length entries one after the other, laid out like flat slots: the full hash, then the key and the value.
+    ctrl is probed exactly like in flat maps, but each slot only holds the position of its entry in entries.
+    Iterating walks the entries without touching the index, removing moves the last entry into the hole so no gaps are left.
+*/
+
+#define MAP_DENSE_POSITION(map, index) (((size_t *)(map)->slots)[index])
+#define MAP_DENSE_NONE ((size_t)-1)
+#define MAP_DENSE_FIRST_ENTRIES 8
+
+static byte *map_dense_entry(const Map *map, size_t position)
+{
+    return map->entries + position * map->entry_size;
+}
+
+/* Index slot of key, or MAP_DENSE_NONE. */
+static size_t map_dense_find(const Map *map, size_t hash, const void *key)
+{
+    size_t mask = map->buckets_count - 1, pos = (hash >> 7) & mask, step = 0, probes = 0;
+    byte h2 = (byte)(hash & 0x7F);
+    while (1)
+    {
+        const byte *group = map->ctrl + pos;
+        MapGroupMask match = map_group_match(group, h2);
+        probes++;
+        while (match != 0)
+        {
+            size_t index = (pos + map_ctz(match)) & mask;
+            byte *entry = map_dense_entry(map, MAP_DENSE_POSITION(map, index));
+            if (MAP_SLOT_HASH(entry) == hash && map->type.key_cmp(entry + map->key_offset, key) == 0)
+            {
+                MAP_STAT_PROBE(map, probes);
+                return index;
+            }
+            match &= match - 1;
+        }
+        if (map_group_match_empty(group) != 0)
+        {
+            MAP_STAT_PROBE(map, probes);
+            return MAP_DENSE_NONE;
+        }
+        step += MAP_GROUP_WIDTH;
+        pos = (pos + step) & mask;
+    }
+}
+
+/* Index slot pointing at position, the entry there must be in the map. Compares positions, so key_cmp is never called. */
+static size_t map_dense_slot_of(const Map *map, size_t hash, size_t position)
+{
+    size_t mask = map->buckets_count - 1, pos = (hash >> 7) & mask, step = 0;
+    byte h2 = (byte)(hash & 0x7F);
+    while (1)
+    {
+        MapGroupMask match = map_group_match(map->ctrl + pos, h2);
+        while (match != 0)
+        {
+            size_t index = (pos + map_ctz(match)) & mask;
+            if (MAP_DENSE_POSITION(map, index) == position)
+                return index;
+            match &= match - 1;
+        }
+        step += MAP_GROUP_WIDTH;
+        pos = (pos + step) & mask;
+    }
+}
+
+/* Rebuilds the index with capacity slots from the cached hashes of the entries. */
+static int map_dense_reindex(Map *map, size_t capacity)
+{
+    byte *old_ctrl = map->ctrl, *old_slots = map->slots;
+    size_t old_capacity = map->buckets_count, old_tombstones = map->tombstones, i;
+    MAP_STAT_CLOCK(start);
+    if (map_flat_alloc(map, capacity) != 0)
+    {
+        map->ctrl = old_ctrl;
+        map->slots = old_slots;
+        map->buckets_count = old_capacity;
+        map->tombstones = old_tombstones;
+        return -1;
+    }
+    for (i = 0; i < map->length; i++)
+    {
+        size_t hash = MAP_SLOT_HASH(map_dense_entry(map, i));
+        size_t index = map_flat_find_free(map, hash);
+        map_flat_set_ctrl(map, index, (byte)(hash & 0x7F));
+        MAP_DENSE_POSITION(map, index) = i;
+    }
+    map_mem_free(&map->type.allocator, old_ctrl, map_flat_block_size(map, old_capacity));
+    map->generation++;
+    MAP_STAT(map, resizes);
+    MAP_STAT_RESIZE_TIME(map, start);
+    return 0;
+}
+
+/* Moves the entries into an array with room for capacity of them, capacity must be at least length. */
+static int map_dense_resize_entries(Map *map, size_t capacity)
+{
+    byte *entries = NULL;
+    if (capacity == map->entries_capacity)
+    {
+        return 0;
+    }
+    if (capacity > 0)
+    {
+        entries = (byte *)map_mem_alloc(&map->type.allocator, capacity * map->entry_size);
+        if (entries == NULL)
+        {
+            return -1;
+        }
+        if (map->entries != NULL)
+        {
+            memcpy(entries, map->entries, map->length * map->entry_size);
+        }
+    }
+    map_mem_free(&map->type.allocator, map->entries, map->entries_capacity * map->entry_size);
+    map->entries = entries;
+    map->entries_capacity = capacity;
+    return 0;
+}
+
+static int map_dense_grow(Map *map)
+{
+    return map_dense_resize_entries(map, map->entries_capacity == 0 ? MAP_DENSE_FIRST_ENTRIES : map->entries_capacity * 2);
+}
+
+/* Value of key, added with a zeroed value if it was missing. */
+static byte *map_dense_insert(Map *map, size_t hash, const void *key, int *inserted)
+{
+    size_t index = map_dense_find(map, hash, key);
+    if (index != MAP_DENSE_NONE)
+    {
+        return map_dense_entry(map, MAP_DENSE_POSITION(map, index)) + map->value_offset;
+    }
+
+    if (map->length == map->entries_capacity && map_dense_grow(map) != 0)
+    {
+        return NULL;
+    }
+    double max_load = map_flat_max_load(map);
+    if ((double)(map->length + map->tombstones + 1) > max_load * (double)map->buckets_count)
+    {
+        size_t capacity = (double)(map->length + 1) > max_load * (double)map->buckets_count / 2 ? map->buckets_count * 2 : map->buckets_count;
+        if (map_dense_reindex(map, capacity) != 0 && map->length + map->tombstones + 1 >= map->buckets_count)
+        {
+            return NULL;
+        }
+    }
+
+    index = map_flat_find_free(map, hash);
+    if (map->ctrl[index] == MAP_CTRL_DELETED)
+        map->tombstones--;
+    map_flat_set_ctrl(map, index, (byte)(hash & 0x7F));
+    MAP_DENSE_POSITION(map, index) = map->length;
+    byte *entry = map_dense_entry(map, map->length);
+    MAP_SLOT_HASH(entry) = hash;
+    memcpy(entry + map->key_offset, key, map->type.key_size);
+    memset(entry + map->value_offset, 0, map->type.value_size);
+    map->length++;
+    MAP_STAT(map, inserts);
+    *inserted = 1;
+    return entry + map->value_offset;
+}
+
+static int map_dense_remove(Map *map, size_t hash, const void *key)
+{
+    size_t index = map_dense_find(map, hash, key);
+    if (index == MAP_DENSE_NONE)
+    {
+        return -1;
+    }
+    size_t position = MAP_DENSE_POSITION(map, index), last = map->length - 1;
+    byte *entry = map_dense_entry(map, position);
+    map->type.key_free(entry + map->key_offset);
+    map->type.value_free(entry + map->value_offset);
+    map_flat_set_ctrl(map, index, MAP_CTRL_DELETED);
+    map->tombstones++;
+    if (position != last)
+    {
+        /* The last entry fills the hole, only its index slot has to learn the new position. */
+        byte *moved = map_dense_entry(map, last);
+        MAP_DENSE_POSITION(map, map_dense_slot_of(map, MAP_SLOT_HASH(moved), last)) = position;
+        memcpy(entry, moved, map->entry_size);
+    }
+    map->length--;
+    MAP_STAT(map, removes);
+    return 0;
+}
+
+/* Walks entries in order, a removed one is replaced by the last entry, which is then looked at in its new place. */
+static size_t map_dense_remove_if(Map *map, int (*pred)(const void *key, void *value, void *context), void *context)
+{
+    size_t position = 0, removed = 0;
+    while (position < map->length)
+    {
+        byte *entry = map_dense_entry(map, position);
+        if (!pred(entry + map->key_offset, entry + map->value_offset, context))
+        {
+            position++;
+            continue;
+        }
+        size_t last = map->length - 1;
+        map->type.key_free(entry + map->key_offset);
+        map->type.value_free(entry + map->value_offset);
+        map_flat_set_ctrl(map, map_dense_slot_of(map, MAP_SLOT_HASH(entry), position), MAP_CTRL_DELETED);
+        map->tombstones++;
+        if (position != last)
+        {
+            byte *moved = map_dense_entry(map, last);
+            MAP_DENSE_POSITION(map, map_dense_slot_of(map, MAP_SLOT_HASH(moved), last)) = position;
+            memcpy(entry, moved, map->entry_size);
+        }
+        map->length--;
+        removed++;
+    }
+    if (map->length == 0)
+    {
+        memset(map->ctrl, MAP_CTRL_EMPTY, map->buckets_count + MAP_GROUP_WIDTH);
+        map->tombstones = 0;
+    }
+    return removed;
+}
+
+static void map_dense_clear(Map *map)
+{
+    size_t i, count = map_trivial(map) ? 0 : map->length;
+    for (i = 0; i < count; i++)
+    {
+        byte *entry = map_dense_entry(map, i);
+        map->type.key_free(entry + map->key_offset);
+        map->type.value_free(entry + map->value_offset);
+    }
+    memset(map->ctrl, MAP_CTRL_EMPTY, map->buckets_count + MAP_GROUP_WIDTH);
+    map->length = 0;
+    map->tombstones = 0;
+}
+
+/* Entries whose index slot is outside the group their hash starts at. */
+static size_t map_dense_count_collisions(const Map *map)
+{
+    size_t collisions = 0, mask = map->buckets_count - 1, i;
+    for (i = 0; i < map->buckets_count; i++)
+    {
+        if (map->ctrl[i] & 0x80)
+            continue;
+        size_t home = (MAP_SLOT_HASH(map_dense_entry(map, MAP_DENSE_POSITION(map, i))) >> 7) & mask;
+        if (((i - home) & mask) >= MAP_GROUP_WIDTH)
+            collisions++;
+    }
+    return collisions;
+}
+
+/*
+    Small maps (MAP_FLAG_SMALL).
+
+    Until the map outgrows MAP_SMALL_CAPACITY entries there is no table, small_hashes and small_entries point behind the Map in its own allocation.
+    Entries are laid out for the storage they will move to and kept without gaps, a lookup compares the cached hashes of the first length of them.
+*/
+
+#define MAP_SMALL_NONE ((size_t)-1)
+#define MAP_SMALL_HASHES_OFFSET map_round_up(sizeof(Map), MAP_MAX_ALIGN)
+#define MAP_SMALL_ENTRIES_OFFSET map_round_up(MAP_SMALL_HASHES_OFFSET + MAP_SMALL_CAPACITY * sizeof(size_t), MAP_MAX_ALIGN)
+
+/* Bytes allocated for the Map itself, small maps keep the size after growing so map_free passes the same one. */
+static size_t map_struct_size(const Map *map)
+{
+    if (map->type.flags & MAP_FLAG_SMALL)
+        return MAP_SMALL_ENTRIES_OFFSET + MAP_SMALL_CAPACITY * map->entry_size;
+    return sizeof(Map);
+}
+
+static byte *map_small_entry(const Map *map, size_t i)
+{
+    return map->small_entries + i * map->entry_size;
+}
+
+/* Hashes are compared before keys, so key_cmp only runs on real matches. */
+static size_t map_small_find(const Map *map, size_t hash, const void *key)
+{
+    size_t i;
+    MAP_STAT_PROBE(map, 1);
+    for (i = 0; i < map->length; i++)
+    {
+        if (map->small_hashes[i] == hash && map->type.key_cmp(map_small_entry(map, i) + map->key_offset, key) == 0)
+            return i;
+    }
+    return MAP_SMALL_NONE;
+}
+
+static int map_small_remove(Map *map, size_t hash, const void *key)
+{
+    size_t i = map_small_find(map, hash, key), last = map->length - 1;
+    if (i == MAP_SMALL_NONE)
+    {
+        return -1;
+    }
+    byte *entry = map_small_entry(map, i);
+    map->type.key_free(entry + map->key_offset);
+    map->type.value_free(entry + map->value_offset);
+    if (i != last)
+    {
+        memcpy(entry, map_small_entry(map, last), map->entry_size);
+        map->small_hashes[i] = map->small_hashes[last];
+        map->generation++;
+    }
+    map->length--;
+    MAP_STAT(map, removes);
+    return 0;
+}
+
+static size_t map_small_remove_if(Map *map, int (*pred)(const void *key, void *value, void *context), void *context)
+{
+    size_t i = 0, removed = 0;
+    while (i < map->length)
+    {
+        byte *entry = map_small_entry(map, i);
+        size_t last = map->length - 1;
+        if (!pred(entry + map->key_offset, entry + map->value_offset, context))
+        {
+            i++;
+            continue;
+        }
+        map->type.key_free(entry + map->key_offset);
+        map->type.value_free(entry + map->value_offset);
+        if (i != last)
+        {
+            memcpy(entry, map_small_entry(map, last), map->entry_size);
+            map->small_hashes[i] = map->small_hashes[last];
+            map->generation++;
+        }
+        map->length--;
+        removed++;
+    }
+    return removed;
+}
+
+static void map_small_clear(Map *map)
+{
+    size_t i, count = map_trivial(map) ? 0 : map->length;
+    for (i = 0; i < count; i++)
+    {
+        byte *entry = map_small_entry(map, i);
+        map->type.key_free(entry + map->key_offset);
+        map->type.value_free(entry + map->value_offset);
+    }
+    map->length = 0;
+}
+
+/* Chained nodes start with the MapNode header, flat slots and dense entries with the hash. */
+static void map_layout(Map *map)
+{
+    size_t header = map->type.storage != MAP_STORAGE_CHAINED ? sizeof(size_t) : sizeof(MapNode);
+    size_t key_align = map_size_align(map->type.key_size), value_align = map_size_align(map->type.value_size);
+    size_t entry_align = key_align > value_align ? key_align : value_align;
+    if (entry_align < sizeof(size_t))
+        entry_align = sizeof(size_t);
+    map->key_offset = map_round_up(header, key_align);
+    map->value_offset = map_round_up(map->key_offset + map->type.key_size, value_align);
+    map->entry_size = map_round_up(map->value_offset + map->type.value_size, entry_align);
+}
+
+/* Allocates the empty table of the map's storage for buckets_count buckets. */
+static int map_table_alloc(Map *map)
+{
+    if (map->type.storage != MAP_STORAGE_CHAINED)
+    {
+        return map_flat_alloc(map, map_flat_capacity(map->buckets_count));
+    }
+    map->buckets = (byte *)map_mem_calloc(&map->type.allocator, map->buckets_count, map->entry_size);
+    return map->buckets == NULL ? -1 : 0;
+}
+
+Map *map_new(MapTypeData type, size_t buckets_count)
+{
+    Map layout;
+    if (type.key_hash == NULL)
+    {
+        type.key_hash = map_default_hash;
+    }
+    if (type.key_cmp == NULL)
+    {
+        type.key_cmp = map_default_cmp;
+    }
+    if (type.key_free == NULL)
+    {
+        type.key_free = map_default_free;
+    }
+    if (type.value_free == NULL)
+    {
+        type.value_free = map_default_free;
+    }
+    if (type.max_load_factor <= 0)
+    {
+        type.max_load_factor = MAP_DEFAULT_MAX_LOAD_FACTOR;
+    }
+    if (type.key_hash_seeded != NULL && type.seed == 0)
+    {
+        type.seed = map_random_seed();
+    }
+    if (buckets_count == 0)
+    {
+        buckets_count = 1;
+    }
+    if (type.flags & MAP_FLAG_POW2)
+    {
+        buckets_count = map_round_pow2(buckets_count);
+    }
+    if (type.storage == MAP_STORAGE_DENSE)
+    {
+        /* Dense entries already are one array scanned in order. */
+        type.flags &= ~MAP_FLAG_SMALL;
+    }
+    layout.type = type;
+    map_layout(&layout);
+    Map *map = (Map *)map_mem_alloc(&type.allocator, map_struct_size(&layout));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+
+    map->type = type;
+    map->length = 0;
+    map->buckets_count = buckets_count;
+    map->old_buckets_count = 0;
+    map->old_buckets = NULL;
+    map->migrate_index = 0;
+    map->buckets = NULL;
+    map->ctrl = NULL;
+    map->slots = NULL;
+    map->tombstones = 0;
+    memset(&map->pool, 0, sizeof(map->pool));
+    map->stats = NULL;
+    map->mapped = NULL;
+    map->mapped_size = 0;
+    map->entries = NULL;
+    map->entries_capacity = 0;
+    map->small_hashes = NULL;
+    map->small_entries = NULL;
+    map_arena_init(&map->strings, MAP_STR_ARENA_BLOCK_SIZE);
+    map->generation = 0;
+    map->snapshots = NULL;
+    map_layout(map);
+#ifdef MAP_STATS
+    map->stats = (MapStats *)map_mem_calloc(&type.allocator, 1, sizeof(MapStats));
+    if (map->stats == NULL)
+    {
+        map_mem_free(&type.allocator, map, map_struct_size(map));
+        return NULL;
+    }
+#endif
+
+    if (type.flags & MAP_FLAG_SMALL)
+    {
+        /* The table waits until the entries no longer fit behind the Map. */
+        map->small_hashes = (size_t *)((byte *)map + MAP_SMALL_HASHES_OFFSET);
+        map->small_entries = (byte *)map + MAP_SMALL_ENTRIES_OFFSET;
+        return map;
+    }
+
+    if (map_table_alloc(map) != 0)
+    {
+        map_mem_free(&type.allocator, map->stats, sizeof(MapStats));
+        map_mem_free(&type.allocator, map, map_struct_size(map));
+        return NULL;
+    }
+
+    return map;
+}
+
+/* Nodes of a chained table are entry_size apart, the key and value follow the header. */
+#define MAP_NODE_AT(map, table, i) ((MapNode *)((table) + (i) * (map)->entry_size))
+#define MAP_NODE_KEY(map, node) ((byte *)(node) + (map)->key_offset)
+#define MAP_NODE_VALUE(map, node) ((byte *)(node) + (map)->value_offset)
+
+/* Frees every entry of a table, but not the table itself. */
+static void map_free_table(Map *map, byte *buckets, size_t buckets_count)
+{
+    size_t i;
+    for (i = 0; i < buckets_count; i++)
+    {
+        MapNode *bucket = MAP_NODE_AT(map, buckets, i);
+        MapNode *node = bucket->next;
+        while (node != NULL)
+        {
+            MapNode *next = node->next;
+            map->type.key_free(MAP_NODE_KEY(map, node));
+            map->type.value_free(MAP_NODE_VALUE(map, node));
+            map_node_release(map, node);
+            node = next;
+            map->length--;
+        }
+        if (bucket->hash != 0)
+        {
+            map->type.key_free(MAP_NODE_KEY(map, bucket));
+            map->type.value_free(MAP_NODE_VALUE(map, bucket));
+            map->length--;
+        }
+        bucket->hash = 0;
+        bucket->next = NULL;
+    }
+}
+
+/* Chained nodes of a bucket go first, so a removed head can be refilled from a node that was already kept. */
+static size_t map_remove_if_table(Map *map, byte *buckets, size_t buckets_count, int (*pred)(const void *key, void *value, void *context), void *context)
+{
+    size_t i, removed = 0;
+    for (i = 0; i < buckets_count; i++)
+    {
+        MapNode *bucket = MAP_NODE_AT(map, buckets, i);
+        if (bucket->hash == 0)
+            continue;
+        MapNode *prev = bucket, *node = bucket->next;
+        while (node != NULL)
+        {
+            MapNode *next = node->next;
+            if (pred(MAP_NODE_KEY(map, node), MAP_NODE_VALUE(map, node), context))
+            {
+                MAP_SNAPSHOT_TOUCH(map, i);
+                map->type.key_free(MAP_NODE_KEY(map, node));
+                map->type.value_free(MAP_NODE_VALUE(map, node));
+                prev->next = next;
+                map_node_release(map, node);
+                removed++;
+            }
+            else
+            {
+                prev = node;
+            }
+            node = next;
+        }
+        if (pred(MAP_NODE_KEY(map, bucket), MAP_NODE_VALUE(map, bucket), context))
+        {
+            MAP_SNAPSHOT_TOUCH(map, i);
+            map->type.key_free(MAP_NODE_KEY(map, bucket));
+            map->type.value_free(MAP_NODE_VALUE(map, bucket));
+            MapNode *next = bucket->next;
+            if (next != NULL)
+            {
+                memcpy(bucket, next, map->entry_size);
+                map_node_release(map, next);
+            }
+            else
+            {
+                bucket->hash = 0;
+            }
+            removed++;
+        }
+    }
+    map->length -= removed;
+    return removed;
+}
+
+static void map_file_unload(void *data, size_t size)
+{
+#ifdef MAP_HAVE_MMAP
+    munmap(data, size);
+#else
+    free(data);
+#endif
+}
+
+void map_free(Map *map)
+{
+    MapAllocator allocator = map->type.allocator;
+    map_snapshots_detach(map);
+    map_arena_destroy(&map->strings);
+    if (map->mapped != NULL)
+    {
+        map_file_unload(map->mapped, map->mapped_size);
+        map_mem_free(&allocator, map->stats, sizeof(MapStats));
+        map_mem_free(&allocator, map, map_struct_size(map));
+        return;
+    }
+    if (map->small_hashes != NULL)
+    {
+        map_small_clear(map);
+        map_pool_free(map);
+        map_mem_free(&allocator, map->stats, sizeof(MapStats));
+        map_mem_free(&allocator, map, map_struct_size(map));
+        return;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        map_flat_clear(map);
+        map_mem_free(&allocator, map->ctrl, map_flat_block_size(map, map->buckets_count));
+        map_mem_free(&allocator, map->stats, sizeof(MapStats));
+        map_mem_free(&allocator, map, map_struct_size(map));
+        return;
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        map_dense_clear(map);
+        map_mem_free(&allocator, map->entries, map->entries_capacity * map->entry_size);
+        map_mem_free(&allocator, map->ctrl, map_flat_block_size(map, map->buckets_count));
+        map_mem_free(&allocator, map->stats, sizeof(MapStats));
+        map_mem_free(&allocator, map, map_struct_size(map));
+        return;
+    }
+    /* Nothing to call for each entry, so the nodes go away slab by slab without walking the chains. */
+    if (!map_trivial(map))
+    {
+        map_free_table(map, map->buckets, map->buckets_count);
+        map_free_table(map, map->old_buckets, map->old_buckets_count);
+    }
+    map_pool_free(map);
+    map_mem_free(&allocator, map->old_buckets, map->old_buckets_count * map->entry_size);
+    map_mem_free(&allocator, map->buckets, map->buckets_count * map->entry_size);
+    map_mem_free(&allocator, map->stats, sizeof(MapStats));
+    map_mem_free(&allocator, map, map_struct_size(map));
+}
+
+/* Bucket idx while walking both tables, indices past buckets_count refer to the old table during growth. */
+#define MAP_BUCKET_AT(map, idx) ((idx) < (map)->buckets_count ? MAP_NODE_AT(map, (map)->buckets, (idx)) : MAP_NODE_AT(map, (map)->old_buckets, (idx) - (map)->buckets_count))
+
+/* Bucket the hash currently lives in, the old table is used until its bucket has been migrated. */
+static MapNode *map_bucket(const Map *map, size_t hash)
+{
+    if (map->old_buckets != NULL)
+    {
+        size_t old_index = map_index(map, hash, map->old_buckets_count);
+        if (old_index >= map->migrate_index)
+        {
+            return MAP_NODE_AT(map, map->old_buckets, old_index);
+        }
+    }
+    return MAP_NODE_AT(map, map->buckets, map_index(map, hash, map->buckets_count));
+}
+
+/*
+    Puts an entry into the new table. A bucket head is copied into the target bucket or into carrier,
+    a chained node is linked as is, or copied into the target bucket and freed when that bucket is empty.
+*/
+static void map_place(Map *map, MapNode *entry, MapNode *carrier)
+{
+    MapNode *bucket = MAP_NODE_AT(map, map->buckets, map_index(map, entry->hash, map->buckets_count));
+    if (bucket->hash == 0)
+    {
+        memcpy(bucket, entry, map->entry_size);
+        bucket->next = NULL;
+        if (carrier != NULL)
+            map_node_release(map, carrier);
+        return;
+    }
+    if (carrier != entry)
+        memcpy(carrier, entry, map->entry_size);
+    carrier->next = bucket->next;
+    bucket->next = carrier;
+}
+
+/* Moves one old bucket into the new table, only allocates when the old head lands in an occupied bucket. */
+static int map_migrate_bucket(Map *map, size_t index)
+{
+    MapNode *head = MAP_NODE_AT(map, map->old_buckets, index);
+    MapNode *node, *carrier = NULL;
+    if (head->hash == 0)
+    {
+        return 0;
+    }
+
+    /* The cached hash is reused, keys are never hashed again while growing. */
+    MapNode *target = MAP_NODE_AT(map, map->buckets, map_index(map, head->hash, map->buckets_count));
+    if (target->hash != 0)
+    {
+        carrier = map_node_alloc(map);
+        if (carrier == NULL)
+        {
+            return -1;
+        }
+    }
+    node = head->next;
+    map_place(map, head, carrier);
+
+    while (node != NULL)
+    {
+        MapNode *next = node->next;
+        map_place(map, node, node);
+        node = next;
+    }
+    head->hash = 0;
+    head->next = NULL;
+    return 0;
+}
+
+/* Migrates up to steps old buckets, frees the old table once it is empty. */
+static int map_resize_step(Map *map, size_t steps)
+{
+    int result = 0;
+    if (map->old_buckets == NULL)
+    {
+        return 0;
+    }
+    MAP_STAT_CLOCK(start);
+    while (map->old_buckets != NULL && steps-- > 0)
+    {
+        if (map_migrate_bucket(map, map->migrate_index) != 0)
+        {
+            result = -1;
+            break;
+        }
+        if (++map->migrate_index == map->old_buckets_count)
+        {
+            map_mem_free(&map->type.allocator, map->old_buckets, map->old_buckets_count * map->entry_size);
+            map->old_buckets = NULL;
+            map->old_buckets_count = 0;
+            map->migrate_index = 0;
+        }
+    }
+    MAP_STAT_RESIZE_TIME(map, start);
+    return result;
+}
+
+/* Starts moving the map into a table of buckets_count buckets, finishes a previous resize first. */
+static int map_start_resize(Map *map, size_t buckets_count)
+{
+    byte *buckets;
+    if (map_resize_step(map, (size_t)-1) != 0)
+    {
+        return -1;
+    }
+    /* Heads move to other buckets from here on, snapshots take their copy of the old table now. */
+    map_snapshots_detach(map);
+    buckets = (byte *)map_mem_calloc(&map->type.allocator, buckets_count, map->entry_size);
+    if (buckets == NULL)
+    {
+        return -1;
+    }
+    map->old_buckets = map->buckets;
+    map->old_buckets_count = map->buckets_count;
+    map->migrate_index = 0;
+    map->buckets = buckets;
+    map->buckets_count = buckets_count;
+    map->generation++;
+    MAP_STAT(map, resizes);
+    return 0;
+}
+
+static byte *map_insert_hash(Map *map, size_t hash, const void *key, int *inserted);
+
+/* Frees the table a failed promotion allocated, the entries it holds are still owned by the small array. */
+static void map_small_drop_table(Map *map)
+{
+    if (map->type.storage != MAP_STORAGE_CHAINED)
+    {
+        map_mem_free(&map->type.allocator, map->ctrl, map_flat_block_size(map, map->buckets_count));
+        map->ctrl = NULL;
+        map->slots = NULL;
+        return;
+    }
+    /* Nodes already taken stay in the pool until map_free. */
+    map_mem_free(&map->type.allocator, map->old_buckets, map->old_buckets_count * map->entry_size);
+    map_mem_free(&map->type.allocator, map->buckets, map->buckets_count * map->entry_size);
+    map->old_buckets = NULL;
+    map->old_buckets_count = 0;
+    map->migrate_index = 0;
+    map->buckets = NULL;
+}
+
+/* Moves the small entries into a table of the map's storage, placed by their cached hashes without calling key_hash. */
+static int map_small_promote(Map *map)
+{
+    size_t *hashes = map->small_hashes, length = map->length, buckets_count = map->buckets_count, i;
+    byte *entries = map->small_entries;
+    uint64_t inserts = map->stats != NULL ? map->stats->inserts : 0;
+    MAP_STAT_CLOCK(start);
+    if (map->buckets_count < 2 * MAP_SMALL_CAPACITY)
+    {
+        map->buckets_count = (map->type.flags & MAP_FLAG_POW2) ? map_round_pow2(2 * MAP_SMALL_CAPACITY) : 2 * MAP_SMALL_CAPACITY;
+    }
+    if (map_table_alloc(map) != 0)
+    {
+        map->buckets_count = buckets_count;
+        return -1;
+    }
+    map->small_hashes = NULL;
+    map->small_entries = NULL;
+    map->length = 0;
+    for (i = 0; i < length; i++)
+    {
+        int inserted;
+        byte *entry = entries + i * map->entry_size;
+        byte *value = map_insert_hash(map, hashes[i], entry + map->key_offset, &inserted);
+        if (value == NULL)
+        {
+            map_small_drop_table(map);
+            map->small_hashes = hashes;
+            map->small_entries = entries;
+            map->length = length;
+            map->buckets_count = buckets_count;
+            return -1;
+        }
+        memcpy(value, entry + map->value_offset, map->type.value_size);
+    }
+    /* Moving entries is growth, not inserts. */
+    if (map->stats != NULL)
+    {
+        map->stats->inserts = inserts;
+    }
+    map->generation++;
+    MAP_STAT(map, resizes);
+    MAP_STAT_RESIZE_TIME(map, start);
+    return 0;
+}
+
+/* Finds the key or adds it with a zeroed value in a single probe, map_add and map_get_or_insert are built on it. NULL if adding failed. */
+static byte *map_insert_hash(Map *map, size_t hash, const void *key, int *inserted)
+{
+    *inserted = 0;
+    if (map->mapped != NULL)
+    {
+        return NULL;
+    }
+    if (map->small_hashes != NULL)
+    {
+        size_t i = map_small_find(map, hash, key);
+        if (i != MAP_SMALL_NONE)
+        {
+            return map_small_entry(map, i) + map->value_offset;
+        }
+        if (map->length < MAP_SMALL_CAPACITY)
+        {
+            byte *entry = map_small_entry(map, map->length);
+            map->small_hashes[map->length] = hash;
+            memcpy(entry + map->key_offset, key, map->type.key_size);
+            memset(entry + map->value_offset, 0, map->type.value_size);
+            map->length++;
+            MAP_STAT(map, inserts);
+            *inserted = 1;
+            return entry + map->value_offset;
+        }
+        if (map_small_promote(map) != 0)
+        {
+            return NULL;
+        }
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        return map_flat_insert(map, hash, key, inserted);
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        return map_dense_insert(map, hash, key, inserted);
+    }
+    map_resize_step(map, MAP_RESIZE_STEP);
+    if (map->old_buckets == NULL && (double)(map->length + 1) > map->type.max_load_factor * (double)map->buckets_count)
+    {
+        /* Growth failing is not fatal, the chains just get longer. */
+        map_start_resize(map, map->buckets_count * 2);
+    }
+
+    size_t probes = 0;
+    MapNode *node = map_bucket(map, hash);
+    MAP_SNAPSHOT_TOUCH(map, map_index(map, hash, map->buckets_count));
+
+    if (node->hash == 0)
+    {
+        /* First time accessing this bucket. */
+        memcpy(MAP_NODE_KEY(map, node), key, map->type.key_size);
+        memset(MAP_NODE_VALUE(map, node), 0, map->type.value_size);
+        node->hash = hash;
+        map->length++;
+        MAP_STAT_PROBE(map, probes);
+        MAP_STAT(map, inserts);
+        *inserted = 1;
+        return MAP_NODE_VALUE(map, node);
+    }
+
+    while (1)
+    {
+        probes++;
+        if (node->hash == hash && map->type.key_cmp(MAP_NODE_KEY(map, node), key) == 0)
+        {
+            MAP_STAT_PROBE(map, probes);
+            return MAP_NODE_VALUE(map, node);
+        }
+        if (node->next == NULL)
+        {
+            break;
+        }
+        node = node->next;
+    }
+    MAP_STAT_PROBE(map, probes);
+    /* Add node, the key and value live in the same allocation. */
+    MapNode *new_node = map_node_alloc(map);
+    if (new_node == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(MAP_NODE_KEY(map, new_node), key, map->type.key_size);
+    memset(MAP_NODE_VALUE(map, new_node), 0, map->type.value_size);
+    new_node->hash = hash;
+    new_node->next = NULL;
+
+    node->next = new_node;
+    map->length++;
+    MAP_STAT(map, inserts);
+    *inserted = 1;
+    return MAP_NODE_VALUE(map, new_node);
+}
+
+/* map_add with the key already hashed by map_hash_key. */
+static int map_add_hash(Map *map, size_t hash, const void *key, const void *value)
+{
+    int inserted;
+    byte *slot = map_insert_hash(map, hash, key, &inserted);
+    if (slot == NULL)
+    {
+        return -1;
+    }
+    if (!inserted)
+    {
+        /* Key already contained, update value */
+        map->type.value_free(slot);
+        MAP_STAT(map, updates);
+    }
+    memcpy(slot, value, map->type.value_size);
+    return inserted ? 0 : 1;
+}
+
+int map_add(Map *map, const void *key, const void *value)
+{
+    return map_add_hash(map, map_hash_key(map, key), key, value);
+}
+
+void *map_get_or_insert(Map *map, const void *key, int *inserted)
+{
+    int added;
+    byte *value = map_insert_hash(map, map_hash_key(map, key), key, &added);
+    MAP_STAT(map, lookups);
+    if (value != NULL && !added)
+    {
+        MAP_STAT(map, hits);
+    }
+    else
+    {
+        MAP_STAT(map, misses);
+    }
+    if (inserted != NULL)
+    {
+        *inserted = added;
+    }
+    return value;
+}
+
+int map_upsert_with(Map *map, const void *key, void (*fn)(void *value, int inserted, void *context), void *context)
+{
+    int inserted;
+    void *value = map_get_or_insert(map, key, &inserted);
+    if (value == NULL)
+    {
+        return -1;
+    }
+    fn(value, inserted, context);
+    return inserted ? 0 : 1;
+}
+
+/* map_get with the key already hashed by map_hash_key. */
+static void *map_get_hash(Map *map, size_t hash, const void *key)
+{
+    MAP_STAT(map, lookups);
+    if (map->small_hashes != NULL)
+    {
+        size_t i = map_small_find(map, hash, key);
+        if (i == MAP_SMALL_NONE)
+        {
+            MAP_STAT(map, misses);
+            return NULL;
+        }
+        MAP_STAT(map, hits);
+        return map_small_entry(map, i) + map->value_offset;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        byte *slot = map_flat_find(map, hash, key);
+        if (slot == NULL)
+        {
+            MAP_STAT(map, misses);
+            return NULL;
+        }
+        MAP_STAT(map, hits);
+        /* The value can be written through the pointer. */
+        MAP_SNAPSHOT_TOUCH(map, (size_t)(slot - map->slots) / map->entry_size);
+        return slot + map->value_offset;
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        size_t index = map_dense_find(map, hash, key);
+        if (index == MAP_DENSE_NONE)
+        {
+            MAP_STAT(map, misses);
+            return NULL;
+        }
+        MAP_STAT(map, hits);
+        return map_dense_entry(map, MAP_DENSE_POSITION(map, index)) + map->value_offset;
+    }
+    /* Lookups never migrate buckets, migrating moves bucket heads and would invalidate pointers handed out earlier. */
+    size_t probes = 0;
+
+    MapNode *node = map_bucket(map, hash);
+    if (node->hash == 0)
+    {
+        MAP_STAT_PROBE(map, probes);
+        MAP_STAT(map, misses);
+        return NULL;
+    }
+    while (node != NULL)
+    {
+        probes++;
+        /* Only keys with the same full hash are worth comparing. */
+        if (node->hash == hash && map->type.key_cmp(MAP_NODE_KEY(map, node), key) == 0)
+        {
+            MAP_STAT_PROBE(map, probes);
+            MAP_STAT(map, hits);
+            MAP_SNAPSHOT_TOUCH(map, map_index(map, hash, map->buckets_count));
+            return MAP_NODE_VALUE(map, node);
+        }
+        node = node->next;
+    }
+
+    MAP_STAT_PROBE(map, probes);
+    MAP_STAT(map, misses);
+    return NULL;
+}
+
+void *map_get(Map *map, const void *key)
+{
+    return map_get_hash(map, map_hash_key(map, key), key);
+}
+
+/* Where a lookup for hash starts, the first thing worth prefetching. */
+static const void *map_probe_start(const Map *map, size_t hash)
+{
+    if (map->small_hashes != NULL)
+    {
+        return map->small_hashes;
+    }
+    if (map->type.storage != MAP_STORAGE_CHAINED)
+    {
+        return map->ctrl + ((hash >> 7) & (map->buckets_count - 1));
+    }
+    return map_bucket(map, hash);
+}
+
+size_t map_get_batch(Map *map, const void *keys, size_t n, void **out_values)
+{
+    size_t hashes[MAP_BATCH_GROUP], found = 0, i, j;
+    const byte *key = (const byte *)keys;
+    for (i = 0; i < n; i += MAP_BATCH_GROUP)
+    {
+        size_t count = n - i < MAP_BATCH_GROUP ? n - i : MAP_BATCH_GROUP;
+        /* Hash the whole group and start loading every bucket before touching any of them. */
+        for (j = 0; j < count; j++)
+        {
+            hashes[j] = map_hash_key(map, key + (i + j) * map->type.key_size);
+            const void *start = map_probe_start(map, hashes[j]);
+            MAP_PREFETCH(start);
+            if (map->type.storage == MAP_STORAGE_FLAT && map->small_hashes == NULL)
+                MAP_PREFETCH(map_flat_slot(map, (size_t)((const byte *)start - map->ctrl)));
+        }
+        /* By now the first buckets have arrived, chains that go on get their second node loading. */
+        if (map->type.storage == MAP_STORAGE_CHAINED && map->small_hashes == NULL)
+        {
+            for (j = 0; j < count; j++)
+            {
+                const MapNode *node = (const MapNode *)map_probe_start(map, hashes[j]);
+                if (node->hash != hashes[j] && node->next != NULL)
+                    MAP_PREFETCH(node->next);
+            }
+        }
+        for (j = 0; j < count; j++)
+        {
+            out_values[i + j] = map_get_hash(map, hashes[j], key + (i + j) * map->type.key_size);
+            if (out_values[i + j] != NULL)
+                found++;
+        }
+    }
+    return found;
+}
+
+int map_add_batch(Map *map, const void *keys, const void *values, size_t n)
+{
+    size_t hashes[MAP_BATCH_GROUP], i, j;
+    const byte *key = (const byte *)keys, *value = (const byte *)values;
+    int added = 0;
+    for (i = 0; i < n; i += MAP_BATCH_GROUP)
+    {
+        size_t count = n - i < MAP_BATCH_GROUP ? n - i : MAP_BATCH_GROUP;
+        /* A resize inside the group only makes some prefetches useless, the adds themselves look the bucket up again. */
+        for (j = 0; j < count; j++)
+        {
+            hashes[j] = map_hash_key(map, key + (i + j) * map->type.key_size);
+            MAP_PREFETCH(map_probe_start(map, hashes[j]));
+        }
+        for (j = 0; j < count; j++)
+        {
+            int result = map_add_hash(map, hashes[j], key + (i + j) * map->type.key_size, value + (i + j) * map->type.value_size);
+            if (result < 0)
+                return -1;
+            if (result == 0)
+                added++;
+        }
+    }
+    return added;
+}
+
+/* map_remove with the key already hashed by map_hash_key. */
+static int map_remove_hash(Map *map, size_t hash, const void *key)
+{
+    if (map->mapped != NULL)
+    {
+        return -1;
+    }
+    if (map->small_hashes != NULL)
+    {
+        return map_small_remove(map, hash, key);
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        return map_flat_remove(map, hash, key);
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        return map_dense_remove(map, hash, key);
+    }
+    map_resize_step(map, MAP_RESIZE_STEP);
+    size_t probes = 0;
+
+    MapNode *node = map_bucket(map, hash);
+    MapNode *prev = NULL;
+    if (node->hash == 0)
+    {
+        MAP_STAT_PROBE(map, probes);
+        return -1;
+    }
+    while (node != NULL)
+    {
+        probes++;
+        if (node->hash == hash && (map->type.key_cmp(MAP_NODE_KEY(map, node), key) == 0))
+        {
+            /* Found key, remove node. */
+            MAP_SNAPSHOT_TOUCH(map, map_index(map, hash, map->buckets_count));
+            map->type.key_free(MAP_NODE_KEY(map, node));
+            map->type.value_free(MAP_NODE_VALUE(map, node));
+            if (prev != NULL)
+			{
+                /* This node is not a bucket so free it. */
+				prev->next = node->next;
+				map_node_release(map, node);
+			}
+			else
+			{
+                /* This node is a bucket so don't free the node. */
+				node->hash = 0;
+                /* Promote the next node to the bucket */
+                MapNode *next = node->next;
+                if (next != NULL)
+				{
+                    /* There is a next node so copy it into the bucket and free it. */
+					memcpy(node, next, map->entry_size);
+					map_node_release(map, next);
+				}
+			}
+            map->length--;
+            MAP_STAT_PROBE(map, probes);
+            MAP_STAT(map, removes);
+            return 0;
+        }
+        prev = node;
+        node = node->next;
+    }
+    MAP_STAT_PROBE(map, probes);
+    return -1;
+}
+
+int map_remove(Map *map, const void *key)
+{
+    return map_remove_hash(map, map_hash_key(map, key), key);
+}
+
+size_t map_remove_if(Map *map, int (*pred)(const void *key, void *value, void *context), void *context)
+{
+    size_t removed;
+    if (map->mapped != NULL)
+    {
+        return 0;
+    }
+    if (map->small_hashes != NULL)
+    {
+        removed = map_small_remove_if(map, pred, context);
+    }
+    else if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        removed = map_flat_remove_if(map, pred, context);
+    }
+    else if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        removed = map_dense_remove_if(map, pred, context);
+    }
+    else
+    {
+        /* Buckets of old_buckets below migrate_index are already empty. */
+        removed = map_remove_if_table(map, map->buckets, map->buckets_count, pred, context) +
+                  map_remove_if_table(map, map->old_buckets, map->old_buckets_count, pred, context);
+    }
+    MAP_STAT_ADD(map, removes, removed);
+    return removed;
+}
+
+size_t map_hash(const Map *map, const void *key)
+{
+    return map_type_hash(&map->type, key);
+}
+
+int map_add_hashed(Map *map, size_t hash, const void *key, const void *value)
+{
+    return map_add_hash(map, map_finish_hash(map, hash), key, value);
+}
+
+void *map_get_hashed(Map *map, size_t hash, const void *key)
+{
+    return map_get_hash(map, map_finish_hash(map, hash), key);
+}
+
+int map_remove_hashed(Map *map, size_t hash, const void *key)
+{
+    return map_remove_hash(map, map_finish_hash(map, hash), key);
+}
+
+/*
+    String keys.
+
+    A stored MapStr keeps short strings whole and the first MAP_STR_INLINE bytes of long ones, so comparing with it only follows bytes for long strings that agree on the length and prefix.
+    Probes from map_str point at the caller's bytes instead, filling the prefix of a short one would be a store every lookup has to wait on.
+    Long keys added through map_str_add point into map->strings, which is only reset as a whole.
+*/
+
+MapStr map_str(const char *str, size_t length)
+{
+    MapStr key;
+    key.bytes = str;
+    key.length = (uint32_t)length;
+    if (length >= MAP_STR_INLINE)
+    {
+        memcpy(key.inline_bytes, str, MAP_STR_INLINE);
+    }
+    return key;
+}
+
+const char *map_str_chars(const MapStr *key)
+{
+    return key->bytes != NULL ? key->bytes : key->inline_bytes;
+}
+
+size_t map_str_hash(const void *key)
+{
+    const MapStr *str = (const MapStr *)key;
+    return map_hash_bytes(map_str_chars(str), str->length);
+}
+
+size_t map_str_seeded_hash(const void *key, uint64_t seed)
+{
+    const MapStr *str = (const MapStr *)key;
+    return map_seeded_hash_bytes(map_str_chars(str), str->length, seed);
+}
+
+int map_str_cmp(const void *a, const void *b)
+{
+    const MapStr *x = (const MapStr *)a;
+    const MapStr *y = (const MapStr *)b;
+    if (x->length != y->length)
+    {
+        return x->length < y->length ? -1 : 1;
+    }
+    if (x->length < MAP_STR_INLINE)
+    {
+        return memcmp(map_str_chars(x), map_str_chars(y), x->length);
+    }
+    int result = memcmp(x->inline_bytes, y->inline_bytes, MAP_STR_INLINE);
+    if (result != 0)
+    {
+        return result;
+    }
+    return memcmp(x->bytes + MAP_STR_INLINE, y->bytes + MAP_STR_INLINE, x->length - MAP_STR_INLINE);
+}
+
+/* NUL terminated copy of str in the map's string arena. */
+static char *map_str_copy(Map *map, const char *str, size_t length)
+{
+    char *copy = (char *)map_arena_alloc(&map->strings, length + 1);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* map_insert_hash for a string, a new key stops borrowing the caller's bytes. */
+static byte *map_str_insert(Map *map, const char *str, size_t length, int *inserted)
+{
+    MapStr key = map_str(str, length);
+    size_t hash = map_hash_key(map, &key);
+    byte *value = map_insert_hash(map, hash, &key, inserted);
+    if (value == NULL || !*inserted)
+    {
+        return value;
+    }
+    MapStr *stored = (MapStr *)(value - map->value_offset + map->key_offset);
+    if (length < MAP_STR_INLINE)
+    {
+        memset(stored->inline_bytes, 0, MAP_STR_INLINE);
+        memcpy(stored->inline_bytes, str, length);
+        stored->bytes = NULL;
+        return value;
+    }
+    char *copy = map_str_copy(map, str, length);
+    if (copy == NULL)
+    {
+        map_remove_hash(map, hash, &key);
+        *inserted = 0;
+        return NULL;
+    }
+    stored->bytes = copy;
+    return value;
+}
+
+int map_str_add(Map *map, const char *key, size_t length, const void *value)
+{
+    int inserted;
+    byte *slot = map_str_insert(map, key, length, &inserted);
+    if (slot == NULL)
+    {
+        return -1;
+    }
+    if (!inserted)
+    {
+        map->type.value_free(slot);
+        MAP_STAT(map, updates);
+    }
+    memcpy(slot, value, map->type.value_size);
+    return inserted ? 0 : 1;
+}
+
+void *map_str_get(Map *map, const char *key, size_t length)
+{
+    MapStr probe = map_str(key, length);
+    return map_get_hash(map, map_hash_key(map, &probe), &probe);
+}
+
+int map_str_remove(Map *map, const char *key, size_t length)
+{
+    MapStr probe = map_str(key, length);
+    return map_remove_hash(map, map_hash_key(map, &probe), &probe);
+}
+
+int map_interner_init(MapInterner *interner)
+{
+    interner->ids = map_new(MAP_STR_TYPE(size_t), MAP_DEFAULT_BUCKETS_COUNT);
+    interner->strings = NULL;
+    interner->count = 0;
+    interner->capacity = 0;
+    return interner->ids == NULL ? -1 : 0;
+}
+
+void map_interner_destroy(MapInterner *interner)
+{
+    if (interner->ids != NULL)
+    {
+        map_free(interner->ids);
+    }
+    free((void *)interner->strings);
+    interner->ids = NULL;
+    interner->strings = NULL;
+    interner->count = 0;
+    interner->capacity = 0;
+}
+
+size_t map_intern(MapInterner *interner, const char *str, size_t length)
+{
+    Map *map = interner->ids;
+    int inserted;
+    if (interner->count == interner->capacity)
+    {
+        /* Grown up front, a string is never left in the map without its id. */
+        size_t capacity = interner->capacity == 0 ? MAP_DEFAULT_BUCKETS_COUNT : interner->capacity * 2;
+        const char **strings = (const char **)realloc((void *)interner->strings, capacity * sizeof(const char *));
+        if (strings == NULL)
+        {
+            return MAP_INTERN_NONE;
+        }
+        interner->strings = strings;
+        interner->capacity = capacity;
+    }
+    size_t *id = (size_t *)map_str_insert(map, str, length, &inserted);
+    if (id == NULL)
+    {
+        return MAP_INTERN_NONE;
+    }
+    if (!inserted)
+    {
+        return *id;
+    }
+    /* Short keys live in the entry, which moves, so they get an arena copy too. */
+    const MapStr *key = (const MapStr *)((byte *)id - map->value_offset + map->key_offset);
+    const char *stable = key->bytes != NULL ? key->bytes : map_str_copy(map, str, length);
+    if (stable == NULL)
+    {
+        map_str_remove(map, str, length);
+        return MAP_INTERN_NONE;
+    }
+    *id = interner->count;
+    interner->strings[interner->count++] = stable;
+    return *id;
+}
+
+size_t map_interner_find(const MapInterner *interner, const char *str, size_t length)
+{
+    const size_t *id = (const size_t *)map_str_get(interner->ids, str, length);
+    return id == NULL ? MAP_INTERN_NONE : *id;
+}
+
+const char *map_interned(const MapInterner *interner, size_t id)
+{
+    return id < interner->count ? interner->strings[id] : NULL;
+}
+
+/*
+    Multimaps store a MapSpan per key, its values array is malloc'd so the span can free itself as the map's value_free.
+    Values need value_free of their own, which the map does not know about, so multimap calls free them before handing spans to the map.
+*/
+
+static void map_multi_span_free(void *value)
+{
+    free(((MapSpan *)value)->values);
+}
+
+static void map_multi_free_values(const MapMulti *multi, MapSpan *span)
+{
+    size_t i, count = multi->value_free == map_default_free ? 0 : span->count;
+    for (i = 0; i < count; i++)
+    {
+        multi->value_free((byte *)span->values + i * multi->value_size);
+    }
+    span->count = 0;
+}
+
+int map_multi_init(MapMulti *multi, MapTypeData type, size_t buckets_count)
+{
+    multi->value_size = type.value_size;
+    multi->value_free = type.value_free == NULL ? map_default_free : type.value_free;
+    type.value_size = sizeof(MapSpan);
+    type.value_free = map_multi_span_free;
+    multi->map = map_new(type, buckets_count);
+    return multi->map == NULL ? -1 : 0;
+}
+
+void map_multi_clear(MapMulti *multi)
+{
+    size_t i = 0;
+    MapNode *node = NULL;
+    while (map_iter_next(multi->map, &i, &node))
+    {
+        map_multi_free_values(multi, (MapSpan *)map_iter_value(multi->map, node));
+    }
+    map_clear(multi->map);
+}
+
+void map_multi_destroy(MapMulti *multi)
+{
+    if (multi->map == NULL)
+    {
+        return;
+    }
+    map_multi_clear(multi);
+    map_free(multi->map);
+    multi->map = NULL;
+}
+
+int map_multi_add(MapMulti *multi, const void *key, const void *value)
+{
+    Map *map = multi->map;
+    int inserted;
+    size_t hash = map_hash_key(map, key);
+    MapSpan *span = (MapSpan *)map_insert_hash(map, hash, key, &inserted);
+    if (span == NULL)
+    {
+        return -1;
+    }
+    if (span->count == span->capacity)
+    {
+        size_t capacity = span->capacity == 0 ? MAP_MULTI_FIRST_VALUES : span->capacity * 2;
+        void *values = realloc(span->values, capacity * multi->value_size);
+        if (values == NULL)
+        {
+            if (inserted)
+            {
+                map_remove_hash(map, hash, key);
+            }
+            return -1;
+        }
+        span->values = values;
+        span->capacity = capacity;
+    }
+    memcpy((byte *)span->values + span->count * multi->value_size, value, multi->value_size);
+    span->count++;
+    if (!inserted)
+    {
+        MAP_STAT(map, updates);
+    }
+    return inserted ? 0 : 1;
+}
+
+MapSpan map_get_all(const MapMulti *multi, const void *key)
+{
+    MapSpan none = {NULL, 0, 0};
+    const MapSpan *span = (const MapSpan *)map_get(multi->map, key);
+    return span == NULL ? none : *span;
+}
+
+int map_multi_remove(MapMulti *multi, const void *key)
+{
+    size_t hash = map_hash_key(multi->map, key);
+    MapSpan *span = (MapSpan *)map_get_hash(multi->map, hash, key);
+    if (span == NULL)
+    {
+        return -1;
+    }
+    map_multi_free_values(multi, span);
+    return map_remove_hash(multi->map, hash, key);
+}
+
+uint64_t map_counter_add(Map *map, const void *key, uint64_t delta)
+{
+    int inserted;
+    uint64_t *count = (uint64_t *)map_insert_hash(map, map_hash_key(map, key), key, &inserted);
+    if (count == NULL)
+    {
+        return 0;
+    }
+    *count += delta;
+    return *count;
+}
+
+int map_counter_add_atomic(Map *map, const void *key, uint64_t delta)
+{
+    uint64_t *count = (uint64_t *)map_get(map, key);
+    if (count == NULL)
+    {
+        return -1;
+    }
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_fetch_add(count, delta, __ATOMIC_RELAXED);
+#else
+    *count += delta;
+#endif
+    return 0;
+}
+
+uint64_t map_counter_get(Map *map, const void *key)
+{
+    const uint64_t *count = (const uint64_t *)map_get(map, key);
+    return count == NULL ? 0 : *count;
+}
+
+int map_insert_key(Map *map, const void *key)
+{
+    int inserted;
+    if (map_insert_hash(map, map_hash_key(map, key), key, &inserted) == NULL)
+    {
+        return -1;
+    }
+    return inserted ? 0 : 1;
+}
+
+int map_contains(Map *map, const void *key)
+{
+    return map_get(map, key) != NULL;
+}
+
+int map_add_take(Map *map, const void *key, void *buffer)
+{
+    return map_add(map, key, &buffer);
+}
+
+void *map_remove_take(Map *map, const void *key)
+{
+    void **slot = (void **)map_get(map, key);
+    void *buffer;
+    if (slot == NULL || map->mapped != NULL)
+    {
+        return NULL;
+    }
+    buffer = *slot;
+    /* value_free sees NULL and leaves the buffer to the caller. */
+    *slot = NULL;
+    map_remove(map, key);
+    return buffer;
+}
+
+/* Hash cached with the entry of a key the map handed out, from map_iter_key or to a map_remove_if predicate. */
+static size_t map_cached_hash(const Map *map, const void *key)
+{
+    const byte *entry = (const byte *)key - map->key_offset;
+    if (map->small_hashes != NULL)
+    {
+        return map->small_hashes[(size_t)(entry - map->small_entries) / map->entry_size];
+    }
+    if (map->type.storage != MAP_STORAGE_CHAINED)
+    {
+        return *(const size_t *)entry;
+    }
+    return ((const MapNode *)entry)->hash;
+}
+
+/* Both maps store the same hash for every key, so a hash cached in one can be looked up in the other. */
+static int map_same_hashes(const Map *a, const Map *b)
+{
+    int a_mixes = a->type.storage != MAP_STORAGE_CHAINED || (a->type.flags & MAP_FLAG_POW2);
+    int b_mixes = b->type.storage != MAP_STORAGE_CHAINED || (b->type.flags & MAP_FLAG_POW2);
+    if (a_mixes != b_mixes || a->type.key_hash_seeded != b->type.key_hash_seeded)
+    {
+        return 0;
+    }
+    return a->type.key_hash_seeded != NULL ? a->type.seed == b->type.seed : a->type.key_hash == b->type.key_hash;
+}
+
+int map_union(Map *dst, const Map *src)
+{
+    int same = map_same_hashes(dst, src);
+    size_t index = 0;
+    MapNode *node = NULL;
+    if (dst == src)
+    {
+        return 0;
+    }
+    while (map_iter_next(src, &index, &node))
+    {
+        int inserted;
+        const byte *key = (const byte *)map_iter_key(src, node);
+        byte *value = map_insert_hash(dst, same ? map_cached_hash(src, key) : map_hash_key(dst, key), key, &inserted);
+        if (value == NULL)
+        {
+            return -1;
+        }
+        if (inserted)
+        {
+            memcpy(value, key - src->key_offset + src->value_offset, dst->type.value_size);
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    const Map *map;
+    Map *other;
+    int same;
+    int keep;
+} MapSetFilter;
+
+/* map_remove_if predicate, drops keys whose presence in other differs from keep. */
+static int map_set_filter(const void *key, void *value, void *context)
+{
+    const MapSetFilter *filter = (const MapSetFilter *)context;
+    size_t hash = filter->same ? map_cached_hash(filter->map, key) : map_hash_key(filter->other, key);
+    return (map_get_hash(filter->other, hash, key) != NULL) != filter->keep;
+}
+
+static size_t map_filter_by(Map *map, Map *other, int keep)
+{
+    MapSetFilter filter;
+    filter.map = map;
+    filter.other = other;
+    filter.same = map_same_hashes(map, other);
+    filter.keep = keep;
+    return map_remove_if(map, map_set_filter, &filter);
+}
+
+size_t map_intersect(Map *map, Map *other)
+{
+    return map == other ? 0 : map_filter_by(map, other, 1);
+}
+
+size_t map_difference(Map *map, Map *other)
+{
+    size_t length = map->length;
+    if (map != other)
+    {
+        return map_filter_by(map, other, 0);
+    }
+    if (map->mapped != NULL)
+    {
+        return 0;
+    }
+    map_clear(map);
+    return length;
+}
+
+int map_cursor_split(Map *map, MapCursor *cursors, size_t k)
+{
+    size_t slots, i;
+    if (map->mapped == NULL && map_resize_step(map, (size_t)-1) != 0)
+    {
+        return -1;
+    }
+    /* Small maps fill their entries in order, a range up to the capacity also covers entries added later. */
+    slots = map->small_hashes != NULL ? MAP_SMALL_CAPACITY : map->buckets_count;
+    for (i = 0; i < k; i++)
+    {
+        cursors[i].index = slots / k * i + (i < slots % k ? i : slots % k);
+        cursors[i].end = slots / k * (i + 1) + (i + 1 < slots % k ? i + 1 : slots % k);
+        cursors[i].skip = 0;
+        cursors[i].generation = map->generation;
+        cursors[i].stale = 0;
+    }
+    return 0;
+}
+
+/* Whole chains go into a batch, a chain that does not fit waits for the next one unless it is the first, then skip remembers how far it got. */
+static size_t map_scan_chained(const Map *map, MapCursor *cursor, MapNode **out, size_t max)
+{
+    size_t count = 0;
+    for (; cursor->index < cursor->end && count < max; cursor->index++, cursor->skip = 0)
+    {
+        MapNode *node = MAP_NODE_AT(map, map->buckets, cursor->index);
+        size_t start = count, i = 0;
+        if (node->hash == 0)
+            continue;
+        for (; node != NULL; node = node->next, i++)
+        {
+            if (i < cursor->skip)
+                continue;
+            if (count == max)
+                break;
+            out[count++] = node;
+        }
+        if (node == NULL)
+            continue;
+        if (start > 0)
+            return start;
+        cursor->skip = i;
+        return count;
+    }
+    return count;
+}
+
+size_t map_scan(const Map *map, MapCursor *cursor, MapNode **out, size_t max)
+{
+    size_t count = 0;
+    if (cursor->stale || cursor->generation != map->generation)
+    {
+        cursor->stale = 1;
+        return 0;
+    }
+    if (map->small_hashes != NULL)
+    {
+        for (; cursor->index < cursor->end && cursor->index < map->length && count < max; cursor->index++)
+            out[count++] = (MapNode *)map_small_entry(map, cursor->index);
+        return count;
+    }
+    if (map->type.storage == MAP_STORAGE_CHAINED)
+    {
+        return map_scan_chained(map, cursor, out, max);
+    }
+    /* Dense maps are scanned by index slot too, removals move entries but not the slots pointing at them. */
+    for (; cursor->index < cursor->end && count < max; cursor->index++)
+    {
+        if (map->ctrl[cursor->index] & 0x80)
+            continue;
+        out[count++] = (MapNode *)(map->type.storage == MAP_STORAGE_FLAT ? map_flat_slot(map, cursor->index) : map_dense_entry(map, MAP_DENSE_POSITION(map, cursor->index)));
+    }
+    return count;
+}
+
+/*
+    A snapshot of a chained or flat map reads chunk c from chunks[c] once its map wrote to it, and from the map's own table before that.
+    Flat chunks hold MAP_SNAPSHOT_CHUNK control bytes padded to MAP_MAX_ALIGN, then the slots. Chained chunks hold the bucket heads, their chains are copied into arena too.
+    shape is the Map as it was, only its type, layout, length and buckets_count are used, so lookups hash keys and pick buckets with the same functions as the map.
+*/
+struct MapSnapshot
+{
+    Map *map;
+    struct MapSnapshot *next;
+    Map *copy;
+    Map shape;
+    byte **chunks;
+    size_t chunks_count;
+    int complete;
+    MapArena arena;
+};
+
+#define MAP_SNAPSHOT_CTRL_SIZE map_round_up(MAP_SNAPSHOT_CHUNK, MAP_MAX_ALIGN)
+
+static int map_snapshot_copy_chunk(MapSnapshot *snapshot, size_t c)
+{
+    const Map *map = snapshot->map;
+    size_t first = c * MAP_SNAPSHOT_CHUNK, count = map->buckets_count - first, i;
+    byte *chunk;
+    if (count > MAP_SNAPSHOT_CHUNK)
+    {
+        count = MAP_SNAPSHOT_CHUNK;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        chunk = (byte *)map_arena_alloc(&snapshot->arena, MAP_SNAPSHOT_CTRL_SIZE + count * map->entry_size);
+        if (chunk == NULL)
+        {
+            return -1;
+        }
+        memcpy(chunk, map->ctrl + first, count);
+        memcpy(chunk + MAP_SNAPSHOT_CTRL_SIZE, map_flat_slot(map, first), count * map->entry_size);
+        snapshot->chunks[c] = chunk;
+        return 0;
+    }
+    chunk = (byte *)map_arena_alloc(&snapshot->arena, count * map->entry_size);
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+    memcpy(chunk, MAP_NODE_AT(map, map->buckets, first), count * map->entry_size);
+    for (i = 0; i < count; i++)
+    {
+        MapNode *prev = MAP_NODE_AT(map, chunk, i), *node;
+        if (prev->hash == 0)
+        {
+            prev->next = NULL;
+            continue;
+        }
+        for (node = prev->next; node != NULL; node = node->next)
+        {
+            MapNode *node_copy = (MapNode *)map_arena_alloc(&snapshot->arena, map->entry_size);
+            if (node_copy == NULL)
+            {
+                prev->next = NULL;
+                return -1;
+            }
+            memcpy(node_copy, node, map->entry_size);
+            prev->next = node_copy;
+            prev = node_copy;
+        }
+    }
+    snapshot->chunks[c] = chunk;
+    return 0;
+}
+
+static void map_snapshots_touch(Map *map, size_t index)
+{
+    MapSnapshot *snapshot;
+    for (snapshot = map->snapshots; snapshot != NULL; snapshot = snapshot->next)
+    {
+        size_t c = index / MAP_SNAPSHOT_CHUNK;
+        if (snapshot->chunks[c] == NULL && map_snapshot_copy_chunk(snapshot, c) != 0)
+        {
+            snapshot->complete = 0;
+        }
+    }
+}
+
+/* Copies every chunk not copied yet, the snapshots stop sharing anything with the map. */
+static void map_snapshots_detach(Map *map)
+{
+    while (map->snapshots != NULL)
+    {
+        MapSnapshot *snapshot = map->snapshots;
+        size_t c;
+        for (c = 0; c < snapshot->chunks_count; c++)
+        {
+            if (snapshot->chunks[c] == NULL && map_snapshot_copy_chunk(snapshot, c) != 0)
+            {
+                snapshot->complete = 0;
+            }
+        }
+        map->snapshots = snapshot->next;
+        snapshot->map = NULL;
+        snapshot->next = NULL;
+    }
+}
+
+/* Chunks a detached snapshot failed to copy read as empty. */
+static byte map_snapshot_ctrl(const MapSnapshot *snapshot, size_t index)
+{
+    const byte *chunk = snapshot->chunks[index / MAP_SNAPSHOT_CHUNK];
+    if (chunk != NULL)
+    {
+        return chunk[index % MAP_SNAPSHOT_CHUNK];
+    }
+    return snapshot->map != NULL ? snapshot->map->ctrl[index] : MAP_CTRL_EMPTY;
+}
+
+static const byte *map_snapshot_slot(const MapSnapshot *snapshot, size_t index)
+{
+    const byte *chunk = snapshot->chunks[index / MAP_SNAPSHOT_CHUNK];
+    if (chunk != NULL)
+    {
+        return chunk + MAP_SNAPSHOT_CTRL_SIZE + (index % MAP_SNAPSHOT_CHUNK) * snapshot->shape.entry_size;
+    }
+    return map_flat_slot(snapshot->map, index);
+}
+
+static const MapNode *map_snapshot_bucket(const MapSnapshot *snapshot, size_t index)
+{
+    const byte *chunk = snapshot->chunks[index / MAP_SNAPSHOT_CHUNK];
+    if (chunk != NULL)
+    {
+        return MAP_NODE_AT(&snapshot->shape, chunk, index % MAP_SNAPSHOT_CHUNK);
+    }
+    return snapshot->map != NULL ? MAP_NODE_AT(snapshot->map, snapshot->map->buckets, index) : NULL;
+}
+
+/* Same type, layout and hashes as map, so entries keep their cached hash. */
+static Map *map_snapshot_copy_map(const Map *map)
+{
+    MapTypeData type = map->type;
+    size_t index = 0;
+    MapNode *node = NULL;
+    type.key_free = NULL;
+    type.value_free = NULL;
+    Map *copy = map_new(type, map->buckets_count);
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+    while (map_iter_next(map, &index, &node))
+    {
+        int inserted;
+        const byte *key = (const byte *)map_iter_key(map, node);
+        byte *value = map_insert_hash(copy, map_cached_hash(map, key), key, &inserted);
+        if (value == NULL)
+        {
+            map_free(copy);
+            return NULL;
+        }
+        memcpy(value, key - map->key_offset + map->value_offset, map->type.value_size);
+    }
+    return copy;
+}
+
+MapSnapshot *map_snapshot(Map *map)
+{
+    MapSnapshot *snapshot = (MapSnapshot *)calloc(1, sizeof(MapSnapshot));
+    if (snapshot == NULL)
+    {
+        return NULL;
+    }
+    snapshot->complete = 1;
+    map_arena_init(&snapshot->arena, 0);
+    if (map->small_hashes != NULL || map->type.storage == MAP_STORAGE_DENSE)
+    {
+        /* Removals move dense and small entries around, these are copied now instead. */
+        snapshot->copy = map_snapshot_copy_map(map);
+        if (snapshot->copy == NULL)
+        {
+            free(snapshot);
+            return NULL;
+        }
+        return snapshot;
+    }
+    if (map->mapped == NULL && map_resize_step(map, (size_t)-1) != 0)
+    {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->chunks_count = (map->buckets_count + MAP_SNAPSHOT_CHUNK - 1) / MAP_SNAPSHOT_CHUNK;
+    snapshot->chunks = (byte **)calloc(snapshot->chunks_count, sizeof(byte *));
+    if (snapshot->chunks == NULL)
+    {
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->shape = *map;
+    snapshot->map = map;
+    snapshot->next = map->snapshots;
+    map->snapshots = snapshot;
+    return snapshot;
+}
+
+const void *map_snapshot_get(const MapSnapshot *snapshot, const void *key)
+{
+    const Map *shape = &snapshot->shape;
+    if (snapshot->copy != NULL)
+    {
+        return map_get_hash(snapshot->copy, map_hash_key(snapshot->copy, key), key);
+    }
+    size_t hash = map_hash_key(shape, key);
+    if (shape->type.storage == MAP_STORAGE_FLAT)
+    {
+        /* Same probe sequence as map_flat_find, a byte at a time since a group can span two chunks. */
+        size_t mask = shape->buckets_count - 1, pos = (hash >> 7) & mask, step = 0, i;
+        byte h2 = (byte)(hash & 0x7F);
+        while (1)
+        {
+            int empty = 0;
+            for (i = 0; i < MAP_GROUP_WIDTH; i++)
+            {
+                size_t index = (pos + i) & mask;
+                byte ctrl = map_snapshot_ctrl(snapshot, index);
+                if (ctrl == h2)
+                {
+                    const byte *slot = map_snapshot_slot(snapshot, index);
+                    if (*(const size_t *)slot == hash && shape->type.key_cmp(slot + shape->key_offset, key) == 0)
+                        return slot + shape->value_offset;
+                }
+                empty |= ctrl == MAP_CTRL_EMPTY;
+            }
+            if (empty)
+            {
+                return NULL;
+            }
+            step += MAP_GROUP_WIDTH;
+            pos = (pos + step) & mask;
+        }
+    }
+    const MapNode *node = map_snapshot_bucket(snapshot, map_index(shape, hash, shape->buckets_count));
+    if (node == NULL || node->hash == 0)
+    {
+        return NULL;
+    }
+    for (; node != NULL; node = node->next)
+    {
+        if (node->hash == hash && shape->type.key_cmp((const byte *)node + shape->key_offset, key) == 0)
+            return (const byte *)node + shape->value_offset;
+    }
+    return NULL;
+}
+
+/* depth counts the entries of bucket index already returned, a flat slot is a chain of one. Nodes are found from the head every time, the map may have changed the chain since. */
+int map_snapshot_next(const MapSnapshot *snapshot, MapSnapshotIter *iter, const void **key, const void **value)
+{
+    const Map *shape = &snapshot->shape;
+    if (snapshot->copy != NULL)
+    {
+        if (!map_iter_next(snapshot->copy, &iter->index, &iter->node))
+            return 0;
+        *key = map_iter_key(snapshot->copy, iter->node);
+        *value = map_iter_value(snapshot->copy, iter->node);
+        return 1;
+    }
+    for (; iter->index < shape->buckets_count; iter->index++, iter->depth = 0)
+    {
+        const byte *entry = NULL;
+        if (shape->type.storage == MAP_STORAGE_FLAT)
+        {
+            if (iter->depth == 0 && (map_snapshot_ctrl(snapshot, iter->index) & 0x80) == 0)
+                entry = map_snapshot_slot(snapshot, iter->index);
+        }
+        else
+        {
+            const MapNode *node = map_snapshot_bucket(snapshot, iter->index);
+            size_t depth;
+            if (node != NULL && node->hash == 0)
+                node = NULL;
+            for (depth = 0; node != NULL && depth < iter->depth; depth++)
+                node = node->next;
+            entry = (const byte *)node;
+        }
+        if (entry != NULL)
+        {
+            iter->depth++;
+            *key = entry + shape->key_offset;
+            *value = entry + shape->value_offset;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t map_snapshot_length(const MapSnapshot *snapshot)
+{
+    return snapshot->copy != NULL ? snapshot->copy->length : snapshot->shape.length;
+}
+
+int map_snapshot_complete(const MapSnapshot *snapshot)
+{
+    return snapshot->complete;
+}
+
+void map_snapshot_free(MapSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+    {
+        return;
+    }
+    if (snapshot->map != NULL)
+    {
+        MapSnapshot **link = &snapshot->map->snapshots;
+        while (*link != snapshot)
+            link = &(*link)->next;
+        *link = snapshot->next;
+    }
+    if (snapshot->copy != NULL)
+    {
+        map_free(snapshot->copy);
+    }
+    map_arena_destroy(&snapshot->arena);
+    free(snapshot->chunks);
+    free(snapshot);
+}
+
+double map_load_factor(const Map *map)
+{
+    return (double)map->length / (double)map->buckets_count;
+}
+
+static size_t map_count_table_collisions(const Map *map, byte *buckets, size_t buckets_count)
+{
+    size_t collisions = 0, i;
+    for (i = 0; i < buckets_count; i++)
+    {
+        MapNode *node = MAP_NODE_AT(map, buckets, i)->next;
+        if (node != NULL)
+        {
+            collisions++;
+            while (node->next != NULL)
+            {
+                collisions++;
+                node = node->next;
+            }
+        }
+    }
+    return collisions;
+}
+
+size_t map_count_collisions(const Map *map)
+{
+    if (map->small_hashes != NULL)
+    {
+        return 0;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        return map_flat_count_collisions(map);
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE)
+    {
+        return map_dense_count_collisions(map);
+    }
+    return map_count_table_collisions(map, map->buckets, map->buckets_count) +
+           map_count_table_collisions(map, map->old_buckets, map->old_buckets_count);
+}
+
+void map_optimize(Map **inp)
+{
+    Map *map = *inp;
+    double load_factor = map->type.max_load_factor < 0.75 ? map->type.max_load_factor : 0.75;
+    /* One extra bucket so rebuilding does not immediately start growing again. */
+    size_t new_buckets_count = (size_t)((double)map->length / load_factor) + 1, i = 0;
+    MapNode *node = NULL;
+    /* Chains are relinked and slots moved by their cached hashes in place, only mapped maps and maps that may go back to their small array get rebuilt. */
+    if (map->mapped == NULL && !(map->type.flags & MAP_FLAG_SMALL) && map_shrink_to_fit(map) == 0)
+    {
+        return;
+    }
+    MAP_STAT_CLOCK(start);
+    Map *new_map = map_new(map->type, new_buckets_count);
+    if (new_map == NULL)
+    {
+        return;
+    }
+
+    while (map_iter_next(map, &i, &node))
+    {
+        int inserted;
+        const byte *key = (const byte *)map_iter_key(map, node);
+        byte *value = map_insert_hash(new_map, map_cached_hash(map, key), key, &inserted);
+        if (value == NULL)
+        {
+            /* Keep the old map whole, the copies still belong to it. */
+            new_map->type.key_free = map_default_free;
+            new_map->type.value_free = map_default_free;
+            map_free(new_map);
+            return;
+        }
+        memcpy(value, map_iter_value(map, node), map->type.value_size);
+    }
+    /* The counters belong to the map, not to the table, rebuilding only counts as a resize. */
+    MapStats *stats = new_map->stats;
+    new_map->stats = map->stats;
+    map->stats = stats;
+    /* Copied MapStr keys still point into the old map's strings. */
+    MapArena strings = new_map->strings;
+    new_map->strings = map->strings;
+    map->strings = strings;
+    /* Cursors of the old map must not match the new table. */
+    new_map->generation = map->generation + 1;
+    MAP_STAT(new_map, resizes);
+    MAP_STAT_RESIZE_TIME(new_map, start);
+    map->type.key_free = map_default_free;
+    map->type.value_free = map_default_free;
+    map_free(map);
+    *inp = new_map;
+}
+
+/* Moves every node of a chained map into a table of buckets_count buckets now instead of step by step. */
+static int map_chained_rehash(Map *map, size_t buckets_count)
+{
+    if (buckets_count == map->buckets_count)
+    {
+        return map_resize_step(map, (size_t)-1);
+    }
+    if (map_start_resize(map, buckets_count) != 0)
+    {
+        return -1;
+    }
+    return map_resize_step(map, (size_t)-1);
+}
+
+int map_reserve(Map *map, size_t n)
+{
+    if (map->mapped != NULL)
+    {
+        return -1;
+    }
+    if (map->small_hashes != NULL)
+    {
+        if (n <= MAP_SMALL_CAPACITY)
+        {
+            return 0;
+        }
+        if (map_small_promote(map) != 0)
+        {
+            return -1;
+        }
+    }
+    if (map->type.storage == MAP_STORAGE_CHAINED)
+    {
+        /* Growth starts when length + 1 exceeds max_load_factor * buckets_count. */
+        size_t buckets_count = (size_t)((double)n / map->type.max_load_factor) + 1;
+        if (map->type.flags & MAP_FLAG_POW2)
+        {
+            buckets_count = map_round_pow2(buckets_count);
+        }
+        return buckets_count > map->buckets_count ? map_chained_rehash(map, buckets_count) : 0;
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE && n > map->entries_capacity && map_dense_resize_entries(map, n) != 0)
+    {
+        return -1;
+    }
+    size_t capacity = map_flat_capacity((size_t)((double)n / map_flat_max_load(map)) + 1);
+    if (capacity <= map->buckets_count)
+    {
+        return 0;
+    }
+    return map->type.storage == MAP_STORAGE_FLAT ? map_flat_rehash(map, capacity) : map_dense_reindex(map, capacity);
+}
+
+int map_shrink_to_fit(Map *map)
+{
+    if (map->mapped != NULL)
+    {
+        return -1;
+    }
+    if (map->small_hashes != NULL)
+    {
+        return 0;
+    }
+    if (map->type.storage == MAP_STORAGE_CHAINED)
+    {
+        double load_factor = map->type.max_load_factor < 0.75 ? map->type.max_load_factor : 0.75;
+        size_t buckets_count = (size_t)((double)map->length / load_factor) + 1;
+        if (map->type.flags & MAP_FLAG_POW2)
+        {
+            buckets_count = map_round_pow2(buckets_count);
+        }
+        if (map_chained_rehash(map, buckets_count) != 0)
+        {
+            return -1;
+        }
+        if (map->length == 0)
+        {
+            map_pool_free(map);
+        }
+        else
+        {
+            map_slabs_free(map, map->pool.spare_slabs);
+            map->pool.spare_slabs = NULL;
+        }
+        return 0;
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE && map_dense_resize_entries(map, map->length) != 0)
+    {
+        return -1;
+    }
+    size_t capacity = map_flat_capacity((size_t)((double)map->length / map_flat_max_load(map)) + 1);
+    if (capacity == map->buckets_count && map->tombstones == 0)
+    {
+        return 0;
+    }
+    return map->type.storage == MAP_STORAGE_FLAT ? map_flat_rehash(map, capacity) : map_dense_reindex(map, capacity);
+}
+
+static size_t map_slabs_size(const Map *map, const struct MapSlab *slab)
+{
+    size_t size = 0;
+    for (; slab != NULL; slab = slab->next)
+    {
+        size += MAP_SLAB_HEADER_SIZE + slab->count * map->entry_size;
+    }
+    return size;
+}
+
+size_t map_memory_usage(const Map *map, MapMemoryUsage *out)
+{
+    MapMemoryUsage usage;
+    const struct MapArenaBlock *block;
+    memset(&usage, 0, sizeof(usage));
+    if (map->mapped != NULL)
+    {
+        usage.table = map->mapped_size;
+    }
+    else if (map->type.storage == MAP_STORAGE_CHAINED)
+    {
+        /* A small map has no table yet, its entries are part of the Map. */
+        usage.table = (map->buckets != NULL ? map->buckets_count * map->entry_size : 0) + map->old_buckets_count * map->entry_size;
+        usage.nodes = map_slabs_size(map, map->pool.slabs) + map_slabs_size(map, map->pool.spare_slabs);
+    }
+    else
+    {
+        usage.table = map->ctrl != NULL ? map_flat_block_size(map, map->buckets_count) : 0;
+        usage.nodes = map->entries_capacity * map->entry_size;
+    }
+    for (block = map->strings.blocks; block != NULL; block = block->next)
+    {
+        usage.strings += MAP_ARENA_HEADER_SIZE + block->size;
+    }
+    usage.payload = map->length * (map->type.key_size + map->type.value_size);
+    usage.total = map_struct_size(map) + (map->stats != NULL ? sizeof(MapStats) : 0) + usage.table + usage.nodes + usage.strings;
+    if (out != NULL)
+    {
+        *out = usage;
+    }
+    return usage.total;
+}
+
+/*
+    Parallel build of chained maps.
+
+    Entries are radix partitioned by destination bucket, partition p owns buckets [p * part_size, (p + 1) * part_size), so every thread only writes its own buckets.
+    Each input slice is counted per partition, scattered into order with the prefix sums, then every partition fills its bucket heads and sets the
+    colliding entries aside. Those get nodes from a single slab allocated between the phases, a thread only uses the nodes of its own range.
+*/
+
+#define MAP_PARALLEL_MIN_ENTRIES 16384
+
+typedef struct
+{
+    Map *map;
+    const byte *keys;
+    const byte *values;
+    MapNode **nodes;
+    size_t *hashes;
+    size_t *order;
+    size_t *counts;
+    size_t *part_start;
+    size_t *overflow;
+    size_t *used;
+    byte *node_block;
+    size_t *node_first;
+    size_t n;
+    size_t threads;
+    size_t part_size;
+} MapBuild;
+
+typedef struct
+{
+    MapBuild *build;
+    size_t id;
+} MapBuildTask;
+
+/* Entries either come from arrays or from the nodes of the map being optimized. */
+static const byte *map_build_key(const MapBuild *build, size_t i)
+{
+    if (build->nodes != NULL)
+        return MAP_NODE_KEY(build->map, build->nodes[i]);
+    return build->keys + i * build->map->type.key_size;
+}
+
+static const byte *map_build_value(const MapBuild *build, size_t i)
+{
+    if (build->nodes != NULL)
+        return MAP_NODE_VALUE(build->map, build->nodes[i]);
+    return build->values + i * build->map->type.value_size;
+}
+
+static size_t map_build_partition(const MapBuild *build, size_t hash)
+{
+    return map_index(build->map, hash, build->map->buckets_count) / build->part_size;
+}
+
+/* Hashes the slice of the thread and counts its entries per partition. */
+static void *map_build_count(void *arg)
+{
+    MapBuildTask *task = (MapBuildTask *)arg;
+    MapBuild *build = task->build;
+    size_t i, first = task->id * build->n / build->threads, last = (task->id + 1) * build->n / build->threads;
+    size_t *counts = build->counts + task->id * build->threads;
+    for (i = first; i < last; i++)
+    {
+        if (build->nodes == NULL)
+            build->hashes[i] = map_hash_key(build->map, map_build_key(build, i));
+        counts[map_build_partition(build, build->hashes[i])]++;
+    }
+    return NULL;
+}
+
+/* Slices are scattered in input order, so entries of a partition stay in input order and later duplicates win. */
+static void *map_build_scatter(void *arg)
+{
+    MapBuildTask *task = (MapBuildTask *)arg;
+    MapBuild *build = task->build;
+    size_t i, first = task->id * build->n / build->threads, last = (task->id + 1) * build->n / build->threads;
+    size_t *offsets = build->counts + task->id * build->threads;
+    for (i = first; i < last; i++)
+    {
+        build->order[offsets[map_build_partition(build, build->hashes[i])]++] = i;
+    }
+    return NULL;
+}
+
+/* Fills empty bucket heads and updates duplicates of them, entries that collide are moved to the front of the partition. */
+static void *map_build_heads(void *arg)
+{
+    MapBuildTask *task = (MapBuildTask *)arg;
+    MapBuild *build = task->build;
+    Map *map = build->map;
+    size_t *order = build->order + build->part_start[task->id], count = build->part_start[task->id + 1] - build->part_start[task->id];
+    size_t j, overflow = 0, placed = 0;
+    for (j = 0; j < count; j++)
+    {
+        size_t i = order[j], hash = build->hashes[i];
+        MapNode *bucket = MAP_NODE_AT(map, map->buckets, map_index(map, hash, map->buckets_count));
+        if (bucket->hash == 0)
+        {
+            memcpy(MAP_NODE_KEY(map, bucket), map_build_key(build, i), map->type.key_size);
+            memcpy(MAP_NODE_VALUE(map, bucket), map_build_value(build, i), map->type.value_size);
+            bucket->hash = hash;
+            bucket->next = NULL;
+            placed++;
+        }
+        else if (bucket->hash == hash && map->type.key_cmp(MAP_NODE_KEY(map, bucket), map_build_key(build, i)) == 0)
+        {
+            map->type.value_free(MAP_NODE_VALUE(map, bucket));
+            memcpy(MAP_NODE_VALUE(map, bucket), map_build_value(build, i), map->type.value_size);
+        }
+        else
+            order[overflow++] = i;
+    }
+    build->overflow[task->id] = overflow;
+    build->used[task->id] = placed;
+    return NULL;
+}
+
+/* Links the entries set aside by map_build_heads into nodes of the partition's range of the slab. */
+static void *map_build_chains(void *arg)
+{
+    MapBuildTask *task = (MapBuildTask *)arg;
+    MapBuild *build = task->build;
+    Map *map = build->map;
+    size_t *order = build->order + build->part_start[task->id];
+    size_t j, next_node = build->node_first[task->id];
+    for (j = 0; j < build->overflow[task->id]; j++)
+    {
+        size_t i = order[j], hash = build->hashes[i];
+        const byte *key = map_build_key(build, i);
+        MapNode *node = MAP_NODE_AT(map, map->buckets, map_index(map, hash, map->buckets_count));
+        while (1)
+        {
+            if (node->hash == hash && map->type.key_cmp(MAP_NODE_KEY(map, node), key) == 0)
+            {
+                map->type.value_free(MAP_NODE_VALUE(map, node));
+                memcpy(MAP_NODE_VALUE(map, node), map_build_value(build, i), map->type.value_size);
+                break;
+            }
+            if (node->next == NULL)
+            {
+                MapNode *new_node = MAP_NODE_AT(map, build->node_block, next_node++);
+                memcpy(MAP_NODE_KEY(map, new_node), key, map->type.key_size);
+                memcpy(MAP_NODE_VALUE(map, new_node), map_build_value(build, i), map->type.value_size);
+                new_node->hash = hash;
+                new_node->next = NULL;
+                node->next = new_node;
+                break;
+            }
+            node = node->next;
+        }
+    }
+    /* From here on overflow counts the nodes actually used, duplicates left the rest of the range unused. */
+    build->overflow[task->id] = next_node - build->node_first[task->id];
+    build->used[task->id] += build->overflow[task->id];
+    return NULL;
+}
+
+/* Runs fn once per thread, on the calling thread when threads are unavailable or fail to start. */
+static void map_build_run(MapBuild *build, void *(*fn)(void *))
+{
+    MapBuildTask tasks[MAP_BUILD_MAX_THREADS];
+    size_t t;
+#ifdef MAP_THREADS
+    pthread_t threads[MAP_BUILD_MAX_THREADS];
+    int started[MAP_BUILD_MAX_THREADS];
+#endif
+    for (t = 0; t < build->threads; t++)
+    {
+        tasks[t].build = build;
+        tasks[t].id = t;
+#ifdef MAP_THREADS
+        started[t] = t > 0 && pthread_create(&threads[t], NULL, fn, &tasks[t]) == 0;
+        if (!started[t] && t > 0)
+            fn(&tasks[t]);
+#else
+        if (t > 0)
+            fn(&tasks[t]);
+#endif
+    }
+    fn(&tasks[0]);
+#ifdef MAP_THREADS
+    for (t = 1; t < build->threads; t++)
+    {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+#endif
+}
+
+static size_t map_build_threads(size_t threads, size_t n, size_t buckets_count)
+{
+    if (threads == 0)
+    {
+#if defined(MAP_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+#else
+        threads = 1;
+#endif
+    }
+    /* Threads only pay off with enough entries each. */
+    if (threads > n / MAP_PARALLEL_MIN_ENTRIES)
+        threads = n / MAP_PARALLEL_MIN_ENTRIES;
+    if (threads > MAP_BUILD_MAX_THREADS)
+        threads = MAP_BUILD_MAX_THREADS;
+    if (threads > buckets_count)
+        threads = buckets_count;
+    return threads == 0 ? 1 : threads;
+}
+
+/* Fills the empty chained map with n entries, leaving it empty on failure. */
+static int map_build(MapBuild *build, size_t threads)
+{
+    Map *map = build->map;
+    size_t t, p, total = 0;
+    int result = -1;
+    build->threads = map_build_threads(threads, build->n, map->buckets_count);
+    build->part_size = (map->buckets_count + build->threads - 1) / build->threads;
+    /* Calloc is fine for scratch memory, only the map itself goes through its allocator. */
+    build->order = (size_t *)malloc(build->n * sizeof(size_t));
+    build->counts = (size_t *)calloc(build->threads * build->threads, sizeof(size_t));
+    build->part_start = (size_t *)calloc(build->threads + 1, sizeof(size_t));
+    build->overflow = (size_t *)calloc(build->threads, sizeof(size_t));
+    build->used = (size_t *)calloc(build->threads, sizeof(size_t));
+    build->node_first = (size_t *)calloc(build->threads + 1, sizeof(size_t));
+    if (build->order == NULL || build->counts == NULL || build->part_start == NULL || build->overflow == NULL || build->used == NULL || build->node_first == NULL)
+    {
+        goto done;
+    }
+
+    map_build_run(build, map_build_count);
+    /* counts[t][p] becomes where thread t scatters its first entry of partition p. */
+    for (p = 0; p < build->threads; p++)
+    {
+        build->part_start[p] = total;
+        for (t = 0; t < build->threads; t++)
+        {
+            size_t count = build->counts[t * build->threads + p];
+            build->counts[t * build->threads + p] = total;
+            total += count;
+        }
+    }
+    build->part_start[build->threads] = total;
+    map_build_run(build, map_build_scatter);
+    map_build_run(build, map_build_heads);
+
+    total = 0;
+    for (p = 0; p < build->threads; p++)
+    {
+        build->node_first[p] = total;
+        total += build->overflow[p];
+    }
+    build->node_first[build->threads] = total;
+    struct MapSlab *slab = NULL;
+    if (total > 0)
+    {
+        slab = (struct MapSlab *)map_mem_alloc(&map->type.allocator, MAP_SLAB_HEADER_SIZE + total * map->entry_size);
+        if (slab == NULL)
+        {
+            /* Only bucket heads have been written and the caller still owns what they hold, forget them. */
+            memset(map->buckets, 0, map->buckets_count * map->entry_size);
+            goto done;
+        }
+        slab->count = total;
+        slab->next = map->pool.slabs;
+        map->pool.slabs = slab;
+        build->node_block = (byte *)slab + MAP_SLAB_HEADER_SIZE;
+    }
+    map_build_run(build, map_build_chains);
+
+    for (p = 0; p < build->threads; p++)
+    {
+        size_t unused;
+        map->length += build->used[p];
+        /* Nodes duplicates did not need go to the free list. */
+        for (unused = build->node_first[p] + build->overflow[p]; unused < build->node_first[p + 1]; unused++)
+        {
+            map_node_release(map, MAP_NODE_AT(map, build->node_block, unused));
+        }
+    }
+#ifdef MAP_STATS
+    map->stats->inserts += map->length;
+#endif
+    result = 0;
+done:
+    free(build->order);
+    free(build->counts);
+    free(build->part_start);
+    free(build->overflow);
+    free(build->used);
+    free(build->node_first);
+    return result;
+}
+
+static size_t map_build_buckets_count(const MapTypeData *type, size_t n)
+{
+    double max_load_factor = type->max_load_factor > 0 ? type->max_load_factor : MAP_DEFAULT_MAX_LOAD_FACTOR;
+    double load_factor = max_load_factor < 0.75 ? max_load_factor : 0.75;
+    return (size_t)((double)n / load_factor) + 1;
+}
+
+Map *map_build_from_arrays(MapTypeData type, const void *keys, const void *values, size_t n, size_t threads)
+{
+    MapBuild build;
+    Map *map = map_new(type, map_build_buckets_count(&type, n));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    if (map->small_hashes != NULL && n > MAP_SMALL_CAPACITY && map_small_promote(map) != 0)
+    {
+        map_free(map);
+        return NULL;
+    }
+    if (map->type.storage != MAP_STORAGE_CHAINED || map->small_hashes != NULL)
+    {
+        /* Probe sequences cross any split of the slots, flat and dense maps are filled on the calling thread. */
+        if (map_add_batch(map, keys, values, n) < 0)
+        {
+            map_free(map);
+            return NULL;
+        }
+        return map;
+    }
+    memset(&build, 0, sizeof(build));
+    build.map = map;
+    build.keys = (const byte *)keys;
+    build.values = (const byte *)values;
+    build.n = n;
+    build.hashes = (size_t *)malloc((n == 0 ? 1 : n) * sizeof(size_t));
+    if (build.hashes == NULL || map_build(&build, threads) != 0)
+    {
+        free(build.hashes);
+        map_free(map);
+        return NULL;
+    }
+    free(build.hashes);
+    return map;
+}
+
+void map_optimize_parallel(Map **inp, size_t threads)
+{
+    Map *map = *inp;
+    MapBuild build;
+    size_t i = 0, n = 0;
+    MapNode *node = NULL;
+    if (map->type.storage != MAP_STORAGE_CHAINED || map->small_hashes != NULL)
+    {
+        map_optimize(inp);
+        return;
+    }
+    MAP_STAT_CLOCK(start);
+    Map *new_map = map_new(map->type, map_build_buckets_count(&map->type, map->length));
+    if (new_map == NULL)
+    {
+        return;
+    }
+    if (new_map->small_hashes != NULL && map_small_promote(new_map) != 0)
+    {
+        map_free(new_map);
+        return;
+    }
+    memset(&build, 0, sizeof(build));
+    build.map = new_map;
+    build.n = map->length;
+    build.nodes = (MapNode **)malloc((map->length == 0 ? 1 : map->length) * sizeof(MapNode *));
+    build.hashes = (size_t *)malloc((map->length == 0 ? 1 : map->length) * sizeof(size_t));
+    if (build.nodes == NULL || build.hashes == NULL)
+    {
+        free(build.nodes);
+        free(build.hashes);
+        map_free(new_map);
+        return;
+    }
+    /* Cached hashes are reused, keys are not hashed again. */
+    while (map_iter_next(map, &i, &node))
+    {
+        build.nodes[n] = node;
+        build.hashes[n] = node->hash;
+        n++;
+    }
+    /* No duplicates to free while moving, the new map takes over the keys and values. */
+    MapTypeData type = new_map->type;
+    new_map->type.value_free = map_default_free;
+    int result = map_build(&build, threads);
+    new_map->type = type;
+    free(build.nodes);
+    free(build.hashes);
+    if (result != 0)
+    {
+        map_free(new_map);
+        return;
+    }
+    MapStats *stats = new_map->stats;
+    new_map->stats = map->stats;
+    map->stats = stats;
+    /* Copied MapStr keys still point into the old map's strings. */
+    MapArena strings = new_map->strings;
+    new_map->strings = map->strings;
+    map->strings = strings;
+    /* Cursors of the old map must not match the new table. */
+    new_map->generation = map->generation + 1;
+    MAP_STAT(new_map, resizes);
+    MAP_STAT_RESIZE_TIME(new_map, start);
+    map->type.key_free = map_default_free;
+    map->type.value_free = map_default_free;
+    map_free(map);
+    *inp = new_map;
+}
+
+/*
+    Saved maps are a MapFileHeader padded to MAP_FILE_HEADER_SIZE, followed by the block map_flat_alloc would allocate:
+    capacity + MAP_GROUP_WIDTH control bytes padded to MAP_MAX_ALIGN, then capacity slots of entry_size bytes.
+*/
+
+#define MAP_FILE_MAGIC "CMAPFLT1"
+#define MAP_FILE_VERSION 1
+#define MAP_FILE_HEADER_SIZE 128
+#define MAP_FILE_ENDIAN 0x01020304u
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t group_width;
+    uint32_t size_t_size;
+    uint32_t endian;
+    uint64_t key_size;
+    uint64_t value_size;
+    uint64_t entry_size;
+    uint64_t key_offset;
+    uint64_t value_offset;
+    uint64_t capacity;
+    uint64_t length;
+    uint64_t seed;
+} MapFileHeader;
+
+static int map_flat_write(const Map *map, const char *path)
+{
+    MapFileHeader header;
+    byte padding[MAP_FILE_HEADER_SIZE];
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memset(padding, 0, sizeof(padding));
+    memcpy(header.magic, MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = MAP_FILE_VERSION;
+    header.group_width = MAP_GROUP_WIDTH;
+    header.size_t_size = sizeof(size_t);
+    header.endian = MAP_FILE_ENDIAN;
+    header.key_size = map->type.key_size;
+    header.value_size = map->type.value_size;
+    header.entry_size = map->entry_size;
+    header.key_offset = map->key_offset;
+    header.value_offset = map->value_offset;
+    header.capacity = map->buckets_count;
+    header.length = map->length;
+    header.seed = map->type.seed;
+
+    size_t ctrl_count = map->buckets_count + MAP_GROUP_WIDTH, ctrl_size = map_round_up(ctrl_count, MAP_MAX_ALIGN), i;
+    byte *entry = (byte *)calloc(1, map->entry_size);
+    int result = entry != NULL &&
+                 fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(padding, MAP_FILE_HEADER_SIZE - sizeof(header), 1, file) == 1 &&
+                 fwrite(map->ctrl, ctrl_count, 1, file) == 1 &&
+                 (ctrl_size == ctrl_count || fwrite(padding, ctrl_size - ctrl_count, 1, file) == 1);
+    /* Only the fields of full slots are written, padding and empty or deleted slots go out as zeros
+       so the same map always saves to the same bytes and old heap contents stay out of the file. */
+    for (i = 0; result && i < map->buckets_count; i++)
+    {
+        if ((map->ctrl[i] & 0x80) == 0)
+        {
+            const byte *slot = map_flat_slot(map, i);
+            memcpy(entry, slot, sizeof(size_t));
+            memcpy(entry + map->key_offset, slot + map->key_offset, map->type.key_size);
+            memcpy(entry + map->value_offset, slot + map->value_offset, map->type.value_size);
+            result = fwrite(entry, map->entry_size, 1, file) == 1;
+            /* Back to zeros for the slots that follow. */
+            memset(entry, 0, map->entry_size);
+        }
+        else
+            result = fwrite(entry, map->entry_size, 1, file) == 1;
+    }
+    free(entry);
+    return fclose(file) == 0 && result ? 0 : -1;
+}
+
+int map_save(const Map *map, const char *path)
+{
+    if (map->type.storage == MAP_STORAGE_FLAT && map->small_hashes == NULL)
+    {
+        return map_flat_write(map, path);
+    }
+    /* The copy only borrows the keys and values for writing them out. */
+    MapTypeData type = map->type;
+    type.storage = MAP_STORAGE_FLAT;
+    type.flags &= ~MAP_FLAG_SMALL;
+    type.key_free = map_default_free;
+    type.value_free = map_default_free;
+    Map *flat = map_new(type, (size_t)((double)map->length / MAP_FLAT_MAX_LOAD_FACTOR) + 1);
+    size_t i = 0;
+    MapNode *node = NULL;
+    int result = 0;
+    if (flat == NULL)
+    {
+        return -1;
+    }
+    while (result == 0 && map_iter_next(map, &i, &node))
+    {
+        if (map_add(flat, map_iter_key(map, node), map_iter_value(map, node)) < 0)
+            result = -1;
+    }
+    if (result == 0)
+        result = map_flat_write(flat, path);
+    map_free(flat);
+    return result;
+}
+
+/* Reads the whole file, mapped where possible. */
+static void *map_file_load(const char *path, size_t *size)
+{
+#ifdef MAP_HAVE_MMAP
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < MAP_FILE_HEADER_SIZE)
+    {
+        close(fd);
+        return NULL;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    /* The mapping stays valid after closing the descriptor. */
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return data;
+#else
+    FILE *file = fopen(path, "rb");
+    void *data = NULL;
+    long length;
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= MAP_FILE_HEADER_SIZE && fseek(file, 0, SEEK_SET) == 0)
+    {
+        data = malloc((size_t)length);
+        if (data != NULL && fread(data, (size_t)length, 1, file) != 1)
+        {
+            free(data);
+            data = NULL;
+        }
+        *size = (size_t)length;
+    }
+    fclose(file);
+    return data;
+#endif
+}
+
+Map *map_open_mmap(const char *path, MapTypeData type)
+{
+    size_t size = 0;
+    void *data = map_file_load(path, &size);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    Map *map = (Map *)map_mem_alloc(&type.allocator, sizeof(Map));
+    if (map == NULL)
+    {
+        map_file_unload(data, size);
+        return NULL;
+    }
+    const MapFileHeader *header = (const MapFileHeader *)data;
+    if (type.key_hash == NULL)
+        type.key_hash = map_default_hash;
+    if (type.key_cmp == NULL)
+        type.key_cmp = map_default_cmp;
+    type.key_free = map_default_free;
+    type.value_free = map_default_free;
+    if (type.max_load_factor <= 0)
+        type.max_load_factor = MAP_DEFAULT_MAX_LOAD_FACTOR;
+    type.storage = MAP_STORAGE_FLAT;
+    type.flags &= ~MAP_FLAG_SMALL;
+    /* Seeded slots were hashed with the seed of the map that was saved. */
+    if (type.key_hash_seeded != NULL)
+        type.seed = header->seed;
+
+    memset(map, 0, sizeof(Map));
+    map->type = type;
+    map->mapped = data;
+    map->mapped_size = size;
+    map_layout(map);
+    map->buckets_count = (size_t)header->capacity;
+    map->length = (size_t)header->length;
+    map->ctrl = (byte *)data + MAP_FILE_HEADER_SIZE;
+    map->slots = map->ctrl + map_round_up(map->buckets_count + MAP_GROUP_WIDTH, MAP_MAX_ALIGN);
+
+    /* The table is only usable by a build that lays it out and probes it the same way. */
+    int valid = memcmp(header->magic, MAP_FILE_MAGIC, sizeof(header->magic)) == 0 && header->version == MAP_FILE_VERSION &&
+                header->group_width == MAP_GROUP_WIDTH && header->size_t_size == sizeof(size_t) && header->endian == MAP_FILE_ENDIAN &&
+                header->key_size == type.key_size && header->value_size == type.value_size && header->entry_size == map->entry_size &&
+                header->key_offset == map->key_offset && header->value_offset == map->value_offset &&
+                map->buckets_count >= MAP_GROUP_WIDTH && (map->buckets_count & (map->buckets_count - 1)) == 0 &&
+                size >= MAP_FILE_HEADER_SIZE + map_flat_block_size(map, map->buckets_count);
+#ifdef MAP_STATS
+    map->stats = valid ? (MapStats *)map_mem_calloc(&type.allocator, 1, sizeof(MapStats)) : NULL;
+    valid = valid && map->stats != NULL;
+#endif
+    if (valid)
+    {
+        /* A different key_hash would silently miss every key, the first entry tells. */
+        size_t i;
+        for (i = 0; i < map->buckets_count; i++)
+        {
+            if ((map->ctrl[i] & 0x80) == 0)
+            {
+                byte *slot = map_flat_slot(map, i);
+                valid = map_hash_key(map, slot + map->key_offset) == MAP_SLOT_HASH(slot);
+                break;
+            }
+        }
+    }
+    if (!valid)
+    {
+        map_free(map);
+        return NULL;
+    }
+    return map;
+}
+
+int map_stats(const Map *map, MapStats *out)
+{
+    if (map->stats == NULL)
+    {
+        memset(out, 0, sizeof(MapStats));
+        return -1;
+    }
+    *out = *map->stats;
+    return 0;
+}
+
+void map_stats_reset(Map *map)
+{
+    if (map->stats != NULL)
+    {
+        memset(map->stats, 0, sizeof(MapStats));
+    }
+}
+
+/* Chained maps iterate real nodes, flat and dense maps hand out slot and entry pointers disguised as nodes. */
+int map_iter_next(const Map *map, size_t *idx, MapNode **node)
+{
+    if (map == NULL)
+    {
+        return 0;
+    }
+    if (map->small_hashes != NULL || map->type.storage == MAP_STORAGE_DENSE)
+    {
+        /* Entries have no gaps, idx is the position. */
+        size_t i = *node == NULL ? *idx : *idx + 1;
+        *idx = i;
+        *node = i >= map->length ? NULL : (MapNode *)(map->small_hashes != NULL ? map_small_entry(map, i) : map_dense_entry(map, i));
+        return *node != NULL;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT)
+    {
+        size_t i = *node == NULL ? *idx : *idx + 1;
+        for (; i < map->buckets_count; i++)
+        {
+            if ((map->ctrl[i] & 0x80) == 0)
+            {
+                *idx = i;
+                *node = (MapNode *)map_flat_slot(map, i);
+                return 1;
+            }
+        }
+        *idx = i;
+        *node = NULL;
+        return 0;
+    }
+
+    if (*node != NULL && (*node)->next != NULL)
+    {
+        *node = (*node)->next;
+        return 1;
+    }
+    size_t i = *node == NULL ? *idx : *idx + 1;
+    for (; i < map->buckets_count + map->old_buckets_count; i++)
+    {
+        MapNode *bucket = MAP_BUCKET_AT(map, i);
+        if (bucket->hash != 0)
+        {
+            *idx = i;
+            *node = bucket;
+            return 1;
+        }
+    }
+    *idx = i;
+    *node = NULL;
+    return 0;
+}
+
+/* Both layouts keep the key and value at fixed offsets from the node or slot. */
+void *map_iter_key(const Map *map, const MapNode *node)
+{
+    return (byte *)node + map->key_offset;
+}
+
+void *map_iter_value(const Map *map, const MapNode *node)
+{
+    return (byte *)node + map->value_offset;
 }
 
 size_t map_default_hash_str(const void *key)
@@ -319,40 +3842,205 @@ size_t map_default_hash_str(const void *key)
     return hash_value;
 }
 
+/*
+    64 bit string hash, wyhash (final version 4, public domain) by Wang Yi.
+    Reads 16 to 48 bytes per step and finishes with a 128 bit multiply.
+*/
+static const uint64_t map_wy_secret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+static void map_wy_mum(uint64_t *a, uint64_t *b)
+{
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t map_wy_mix(uint64_t a, uint64_t b)
+{
+    map_wy_mum(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t map_wy_r8(const byte *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t map_wy_r4(const byte *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t map_wyhash(const void *data, size_t len, uint64_t seed)
+{
+    const byte *p = (const byte *)data;
+    const uint64_t *secret = map_wy_secret;
+    uint64_t a, b;
+    seed ^= map_wy_mix(seed ^ secret[0], secret[1]);
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (map_wy_r4(p) << 32) | map_wy_r4(p + ((len >> 3) << 2));
+            b = (map_wy_r4(p + len - 4) << 32) | map_wy_r4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i >= 48)
+        {
+            uint64_t see1 = seed, see2 = seed;
+            do
+            {
+                seed = map_wy_mix(map_wy_r8(p) ^ secret[1], map_wy_r8(p + 8) ^ seed);
+                see1 = map_wy_mix(map_wy_r8(p + 16) ^ secret[2], map_wy_r8(p + 24) ^ see1);
+                see2 = map_wy_mix(map_wy_r8(p + 32) ^ secret[3], map_wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = map_wy_mix(map_wy_r8(p) ^ secret[1], map_wy_r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = map_wy_r8(p + i - 16);
+        b = map_wy_r8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    map_wy_mum(&a, &b);
+    return map_wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+size_t map_hash_bytes(const void *data, size_t len)
+{
+    return (size_t)map_wyhash(data, len, 0);
+}
+
+size_t map_fast_hash_str(const void *key)
+{
+    const char *str = *(const char **)key;
+    return (size_t)map_wyhash(str, strlen(str), 0);
+}
+
+size_t map_seeded_hash_bytes(const void *data, size_t len, uint64_t seed)
+{
+    return (size_t)map_wyhash(data, len, seed);
+}
+
+size_t map_seeded_hash_str(const void *key, uint64_t seed)
+{
+    const char *str = *(const char **)key;
+    return (size_t)map_wyhash(str, strlen(str), seed);
+}
+
+/*
+    Seeds are a process secret mixed with a counter. The secret comes from /dev/urandom once, falling back on the clock and
+    addresses, which ASLR makes hard to guess, where there is none.
+*/
+
+static uint64_t map_seed_secret;
+static uint64_t map_seed_counter;
+#ifdef MAP_THREADS
+static pthread_once_t map_seed_once = PTHREAD_ONCE_INIT;
+#endif
+
+static void map_seed_init(void)
+{
+    uint64_t secret = 0;
+#ifdef MAP_HAVE_MMAP
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0)
+    {
+        if (read(fd, &secret, sizeof(secret)) != (ssize_t)sizeof(secret))
+            secret = 0;
+        close(fd);
+    }
+#endif
+    secret ^= map_wy_mix((uint64_t)time(NULL) ^ (uint64_t)clock(), (uint64_t)(uintptr_t)&secret ^ ((uint64_t)(uintptr_t)&map_seed_secret << 16));
+    map_seed_secret = secret | 1;
+}
+
+uint64_t map_random_seed(void)
+{
+    uint64_t counter;
+#ifdef MAP_THREADS
+    pthread_once(&map_seed_once, map_seed_init);
+#else
+    if (map_seed_secret == 0)
+        map_seed_init();
+#endif
+#if defined(__GNUC__) || defined(__clang__)
+    counter = __atomic_fetch_add(&map_seed_counter, 1, __ATOMIC_RELAXED);
+#else
+    counter = map_seed_counter++;
+#endif
+    uint64_t seed = map_wy_mix(map_seed_secret ^ map_wy_secret[2], counter ^ map_wy_secret[3]);
+    return seed == 0 ? 1 : seed;
+}
+
 int map_default_cmp_str(const void *a, const void *b)
 {
     return strcmp(*(char **)a, *(char **)b);
 }
 /* Rolled out for my sanity */
 void map_clear(Map* map) {
-    size_t i;
-    for (i = 0; i < map->buckets_count; i++) {
-        MapNode* node = map->buckets[i].next; 
-        MapNode* bucket = &map->buckets[i]; 
-        while (node != NULL) {
-            MapNode* next = node->next;
-            if (map->type.key_free)
-                map->type.key_free(node->key);
-            if (map->type.value_free)
-                map->type.value_free(node->value);
-            free(node->key);
-            node->key = NULL;
-            free(node->value);
-            node->value = NULL;
-            free(node);
-            node = next;
-            map->length--;
-        }
-        bucket->next = NULL; 
-        if (map->type.key_free)
-            map->type.key_free(bucket->key);
-        if (map->type.value_free)
-            map->type.value_free(bucket->value);
-        if (bucket->key != NULL)
-            free(bucket->key);
-        if (bucket->value != NULL)
-            free(bucket->value);
-        bucket->key = NULL;
-        bucket->value = NULL;
+    if (map->mapped != NULL) {
+        return;
+    }
+    map_snapshots_detach(map);
+    map_arena_destroy(&map->strings);
+    if (map->small_hashes != NULL) {
+        map_small_clear(map);
+        return;
+    }
+    if (map->type.storage == MAP_STORAGE_FLAT) {
+        map_flat_clear(map);
+        return;
+    }
+    if (map->type.storage == MAP_STORAGE_DENSE) {
+        map_dense_clear(map);
+        return;
+    }
+    if (map_trivial(map)) {
+        /* Nothing to free per entry, reset the heads in one go and bump through the same slabs again. */
+        memset(map->buckets, 0, map->buckets_count * map->entry_size);
+        map_pool_reset(map);
+        map->length = 0;
+    } else {
+        map_free_table(map, map->buckets, map->buckets_count);
+        map_free_table(map, map->old_buckets, map->old_buckets_count);
+    }
+    if (map->old_buckets != NULL) {
+        map_mem_free(&map->type.allocator, map->old_buckets, map->old_buckets_count * map->entry_size);
+        map->old_buckets = NULL;
+        map->old_buckets_count = 0;
+        map->migrate_index = 0;
     }
 }
\ No newline at end of file
@@ -9,6 +9,19 @@ extern "C"
 #include <stdint.h>
 #include <stddef.h>
 
+    /**
+     * @brief Where a map gets its memory from: the Map itself, bucket arrays, slabs of nodes and flat tables.
+     *
+     * @details Leave alloc NULL to use malloc and free. free may be NULL for allocators that release everything at once, like MapArena.
+     * size is the size that was passed to alloc for the same pointer.
+     */
+    typedef struct
+    {
+        void *(*alloc)(void *context, size_t size);
+        void (*free)(void *context, void *ptr, size_t size);
+        void *context;
+    } MapAllocator;
+
     /**
      * @brief When using key_free and value_free, the user should not free the void* they are given.
      * They should instead cast the void* to the correct type and free the value they are pointing to.
@@ -18,6 +31,19 @@ extern "C"
      * @details You can set any of these to NULL if you do not want to free the key or value or want to use the default cmp or hash.
      *
      * @warning The default hash and cmp functions are not suitable for all types. The default hash hashes the memory address of the key, and the default cmp compares the memory addresses of the keys.
+     *
+     * @note max_load_factor can be left as 0 to use MAP_DEFAULT_MAX_LOAD_FACTOR. Once map_add pushes the load factor past it the map starts growing.
+     *
+     * @note storage picks the layout used by map_new, 0 is MAP_STORAGE_CHAINED.
+     *
+     * @note allocator is copied into the map, a zeroed allocator uses malloc and free.
+     *
+     * @note flags is a combination of MAP_FLAG_* values, 0 for none.
+     *
+     * @note key_hash_seeded, when set, is used instead of key_hash and gets the map's seed with every key, see MAP_TYPE_SEEDED.
+     * Leave seed 0 for a random one per map, map_new stores the seed it picked in map->type.seed. Maps copied from another one, like map_optimize results, keep its seed.
+     *
+     * @note value_size 0 makes a set, entries hold only the key and its hash, see MAP_SET_TYPE.
      */
     typedef struct
     {
@@ -27,27 +53,293 @@ extern "C"
         int (*key_cmp)(const void *, const void *);
         void (*key_free)(void *);
         void (*value_free)(void *);
+        double max_load_factor;
+        int storage;
+        MapAllocator allocator;
+        unsigned flags;
+        size_t (*key_hash_seeded)(const void *, uint64_t seed);
+        uint64_t seed;
     } MapTypeData;
 
+/**
+ * @brief Round bucket counts of chained maps up to powers of two and index buckets with a mask instead of a division.
+ *
+ * @details key_hash output is run through a multiply-xorshift finalizer first, so identity hashes of ints or pointers still spread over the low bits the mask keeps.
+ * Flat and dense maps always work this way.
+ */
+#define MAP_FLAG_POW2 0x1u
+
+/**
+ * @brief Keep the first MAP_SMALL_CAPACITY entries inside the Map's own allocation and find them with a linear scan over their cached hashes.
+ *
+ * @details No table is allocated until the map outgrows the array, the entries then move into the storage picked in MapTypeData without hashing their keys again.
+ * Suits the many maps that only ever hold a handful of entries. Ignored by MAP_STORAGE_DENSE, whose entries are already one array.
+ */
+#define MAP_FLAG_SMALL 0x2u
+
+/**
+ * @brief Entries a MAP_FLAG_SMALL map holds before it allocates a table.
+ *
+ */
+#ifndef MAP_SMALL_CAPACITY
+#define MAP_SMALL_CAPACITY 8
+#endif
+
     typedef uint8_t byte;
 
+    /**
+     * @brief Layouts a map can use, set MapTypeData.storage before calling map_new.
+     *
+     * @details MAP_STORAGE_CHAINED keeps a bucket array of MapNode chains, the first entry of every bucket is stored in the array itself.
+     * MAP_STORAGE_FLAT is open addressing: hashes, keys and values are stored inline in one flat array next to a control byte per slot holding 7 bits of the hash.
+     * A lookup scans a group of MAP_GROUP_WIDTH control bytes at a time and only calls key_cmp on slots whose control byte matches, so it usually touches one or two cache lines.
+     * MAP_STORAGE_DENSE probes the same control bytes, but its slots only hold positions into an array of length entries with no gaps.
+     * Iterating is then a linear scan of length entries no matter how many keys were removed, see MAP_DENSE_FOR_EACH. map_remove moves the last entry into the hole it leaves.
+     *
+     * @warning Entries are stored inline, so pointers returned by map_get are invalidated by the next map_add or map_remove. MAP_STORAGE_FLAT and MAP_STORAGE_DENSE also grow in one pass instead of incrementally.
+     */
+    enum MapStorage
+    {
+        MAP_STORAGE_CHAINED = 0,
+        MAP_STORAGE_FLAT = 1,
+        MAP_STORAGE_DENSE = 2
+    };
+
+/*
+    Instruction set used to scan control bytes of flat maps, picked at compile time since AVX2 also changes the group width and so the table layout.
+    Define MAP_NO_SIMD to use the portable version everywhere.
+*/
+#if !defined(MAP_NO_SIMD) && defined(__AVX2__)
+#define MAP_SIMD_AVX2
+#define MAP_GROUP_WIDTH 32
+#elif !defined(MAP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define MAP_SIMD_SSE2
+#define MAP_GROUP_WIDTH 16
+#elif !defined(MAP_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#define MAP_SIMD_NEON
+#define MAP_GROUP_WIDTH 16
+#elif !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define MAP_SIMD_SWAR
+#define MAP_GROUP_WIDTH 16
+#else
+#define MAP_GROUP_WIDTH 16
+#endif
+
+    /**
+     * @brief Header of an entry in a chained map. The key is stored at Map.key_offset and the value at Map.value_offset from the start of the node, in the same allocation.
+     *
+     * @details Bucket heads are stored the same way inside Map.buckets.
+     *
+     * @details hash caches the key's hash with MAP_HASH_USED set, so lookups compare hashes before calling key_cmp and growing never calls key_hash. It is 0 for an empty bucket.
+     */
     typedef struct MapNode
     {
-        byte *key;
-        byte *value;
         struct MapNode *next;
+        size_t hash;
     } MapNode;
 
+#define MAP_HASH_USED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+    /**
+     * @brief Multiply-xorshift finalizer flat, dense and MAP_FLAG_POW2 maps run key_hash output through, identity and pointer hashes leave the low bits nearly constant so it spreads them over the whole word.
+     *
+     * @param hash
+     * @return size_t
+     */
+    static inline size_t map_mix_hash(size_t hash)
+    {
+        uint64_t h = (uint64_t)hash;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return (size_t)h;
+    }
+
+    /**
+     * @brief Hash of key for maps of type, with key_hash_seeded and the seed when the type has one.
+     *
+     * @param type
+     * @param key
+     * @return size_t
+     */
+    static inline size_t map_type_hash(const MapTypeData *type, const void *key)
+    {
+        return type->key_hash_seeded != NULL ? type->key_hash_seeded(key, type->seed) : type->key_hash(key);
+    }
+
+    struct MapSlab;
+
+    /**
+     * @brief Chained maps take their nodes from slabs of MAP_POOL_FIRST_SLAB up to MAP_POOL_MAX_SLAB nodes, removed nodes go on free_nodes for reuse.
+     *
+     * @details When key_free and value_free are both map_default_free, map_free releases the nodes slab by slab without walking the chains.
+     * map_clear then moves every slab to spare_slabs instead, they are handed out again before new ones are allocated.
+     */
+    typedef struct
+    {
+        struct MapSlab *slabs;
+        MapNode *free_nodes;
+        byte *bump;
+        size_t bump_left;
+        struct MapSlab *spare_slabs;
+    } MapNodePool;
+
+#define MAP_POOL_FIRST_SLAB 16
+#define MAP_POOL_MAX_SLAB 4096
+
+#define MAP_STATS_HISTOGRAM_SIZE 16
+
+    /**
+     * @brief Counters kept by a map when map.c is compiled with MAP_STATS, read them with map_stats.
+     *
+     * @details A probe is the number of nodes a chained map walked, or the number of groups of MAP_GROUP_WIDTH slots a flat map scanned, for one map_add, map_get or map_remove.
+     * probe_histogram[0] counts probes of 0 and probe_histogram[i] probes from 2^(i-1) to 2^i - 1, the last slot also collects anything longer.
+     *
+     * @details resize_ns is the time spent growing, migrating, rehashing and optimizing.
+     */
+    typedef struct
+    {
+        uint64_t lookups;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t updates;
+        uint64_t removes;
+        uint64_t resizes;
+        uint64_t resize_ns;
+        uint64_t probe_total;
+        uint64_t probe_max;
+        uint64_t probe_histogram[MAP_STATS_HISTOGRAM_SIZE];
+    } MapStats;
+
+    /**
+     * @brief Bytes a map holds, see map_memory_usage.
+     *
+     * @details table is the bucket heads of a chained map, including a table still being migrated, or the control bytes and slots of flat and dense maps.
+     * nodes is the node slabs of a chained map and the entries array of a dense map. strings is the arena of copied MapStr keys.
+     * total adds the Map itself and its MapStats. payload is length * (key_size + value_size), the part of table and nodes that holds keys and values.
+     */
+    typedef struct
+    {
+        size_t total;
+        size_t table;
+        size_t nodes;
+        size_t strings;
+        size_t payload;
+    } MapMemoryUsage;
+
+    struct MapArenaBlock;
+
+    /**
+     * @brief Bump allocator for maps that live and die together, see map_arena_allocator.
+     *
+     */
+    typedef struct
+    {
+        struct MapArenaBlock *blocks;
+        byte *cursor;
+        size_t left;
+        size_t block_size;
+    } MapArena;
+
+#define MAP_ARENA_DEFAULT_BLOCK_SIZE 65536
+
+    /**
+     * @brief While the map is growing old_buckets holds the previous table. Buckets in old_buckets below migrate_index have already been moved into buckets.
+     *
+     * @details Growth is incremental, every map_add and map_remove moves MAP_RESIZE_STEP buckets from old_buckets to buckets, so no single call pays for rehashing the whole table.
+     * map_get only reads, it looks in old_buckets for buckets that have not been moved yet.
+     *
+     * @details buckets holds buckets_count nodes that are entry_size bytes apart.
+     *
+     * @details Flat maps leave buckets NULL and use ctrl and slots instead, buckets_count is then the number of slots.
+     *
+     * @details stats is NULL unless map.c is compiled with MAP_STATS, so the layout is the same either way.
+     *
+     * @details mapped is the file a map from map_open_mmap reads its ctrl and slots from, NULL for every other map.
+     *
+     * @details Dense maps keep their entries in entries, which has room for entries_capacity of them. Each one is entry_size bytes: the hash, then the key and value at key_offset and value_offset.
+     * Their slots hold a size_t position into entries instead of an entry.
+     *
+     * @details While a MAP_FLAG_SMALL map has not outgrown MAP_SMALL_CAPACITY entries, small_hashes and small_entries point behind the Map in the same allocation and no table exists.
+     * The first length entries are used, laid out like entries of the storage the map will grow into. Both are NULL for every other map.
+     *
+     * @details strings holds the bytes of MapStr keys copied by map_str_add, they are only given back by map_clear and map_free.
+     *
+     * @details generation is bumped whenever entries move to other slots or buckets, by a rehash or by a small map filling a hole, so a MapCursor can tell its position no longer means anything.
+     *
+     * @details snapshots lists the open snapshots that still share this map's table, see map_snapshot.
+     */
     typedef struct
     {
         MapTypeData type;
         size_t length;
         size_t buckets_count;
-        MapNode *buckets;
+        byte *buckets;
+        size_t old_buckets_count;
+        byte *old_buckets;
+        size_t migrate_index;
+        byte *ctrl;
+        byte *slots;
+        size_t entry_size;
+        size_t key_offset;
+        size_t value_offset;
+        size_t tombstones;
+        MapNodePool pool;
+        MapStats *stats;
+        void *mapped;
+        size_t mapped_size;
+        byte *entries;
+        size_t entries_capacity;
+        size_t *small_hashes;
+        byte *small_entries;
+        MapArena strings;
+        uint64_t generation;
+        struct MapSnapshot *snapshots;
     } Map;
 
 #define MAP_DEFAULT_BUCKETS_COUNT 16
 
+/**
+ * @brief Buckets or slots a snapshot copies at once, the first time its map changes one of them.
+ *
+ */
+#ifndef MAP_SNAPSHOT_CHUNK
+#define MAP_SNAPSHOT_CHUNK 64
+#endif
+
+    /**
+     * @brief Read-only view of a map as it was when map_snapshot was called, see there.
+     *
+     */
+    typedef struct MapSnapshot MapSnapshot;
+
+#define MAP_DEFAULT_MAX_LOAD_FACTOR 0.75
+
+/**
+ * @brief Number of old buckets migrated per operation while the map is growing.
+ *
+ */
+#define MAP_RESIZE_STEP 8
+
+/**
+ * @brief Keys map_get_batch and map_add_batch hash and prefetch together before resolving them.
+ *
+ */
+#ifndef MAP_BATCH_GROUP
+#define MAP_BATCH_GROUP 16
+#endif
+
+/**
+ * @brief Most threads map_build_from_arrays and map_optimize_parallel start. Define MAP_NO_THREADS to build without pthreads.
+ *
+ */
+#ifndef MAP_BUILD_MAX_THREADS
+#define MAP_BUILD_MAX_THREADS 64
+#endif
+
 #define MAP_TYPE(_key_type, _value_type, _key_hash, _key_cmp, _key_free, _value_free) \
     (MapTypeData)                                                                     \
     {                                                                                 \
@@ -59,10 +351,132 @@ extern "C"
         .value_free = _value_free                                                     \
     }
 
-#define STR_MAP_TYPE MAP_TYPE(char *, int, map_default_hash_str, map_default_cmp_str, NULL, NULL)
+/**
+ * @brief MAP_TYPE for a keyed hash, _key_hash_seeded(const void *key, uint64_t seed) gets the map's random seed with every key.
+ *
+ * @details Use it for keys that come from outside, an attacker who does not know the seed can not pick keys that all land in the same bucket.
+ */
+#define MAP_TYPE_SEEDED(_key_type, _value_type, _key_hash_seeded, _key_cmp, _key_free, _value_free) \
+    (MapTypeData)                                                                                  \
+    {                                                                                              \
+        .key_size = sizeof(_key_type),                                                             \
+        .value_size = sizeof(_value_type),                                                         \
+        .key_cmp = _key_cmp,                                                                       \
+        .key_free = _key_free,                                                                     \
+        .value_free = _value_free,                                                                 \
+        .key_hash_seeded = _key_hash_seeded                                                        \
+    }
+
+#define STR_MAP_TYPE MAP_TYPE(char *, int, map_fast_hash_str, map_default_cmp_str, NULL, NULL)
+
+/**
+ * @brief STR_MAP_TYPE hashed with map_seeded_hash_str, for strings from untrusted input.
+ *
+ */
+#define SEEDED_STR_MAP_TYPE MAP_TYPE_SEEDED(char *, int, map_seeded_hash_str, map_default_cmp_str, NULL, NULL)
 
 #define MAP_TYPE_DEFAULT(key_type, value_type) MAP_TYPE(key_type, value_type, map_default_hash, map_default_cmp, map_default_free, map_default_free)
 
+/**
+ * @brief Bytes of a string a MapStr keeps in the key, shorter strings are stored whole with their terminator.
+ *
+ */
+#define MAP_STR_INLINE 12
+
+    /**
+     * @brief Key of a string map, see MAP_STR_TYPE and map_str.
+     *
+     * @details Keys in a map keep strings shorter than MAP_STR_INLINE whole in inline_bytes with bytes NULL. Longer ones keep their first MAP_STR_INLINE bytes there and bytes points to the whole string.
+     * Keys compare length, then inline_bytes, and only follow bytes for long strings that agree on both. The hash is the one the map caches in every entry, it is not stored again.
+     *
+     * @details Keys from map_str always point at the caller's string, inline_bytes is only filled for long ones.
+     */
+    typedef struct
+    {
+        const char *bytes;
+        uint32_t length;
+        char inline_bytes[MAP_STR_INLINE];
+    } MapStr;
+
+/**
+ * @brief Type of a map from strings to value_type, add, get and remove with map_str_add, map_str_get and map_str_remove.
+ *
+ * @details The map copies long keys into its strings arena, so the caller's strings only have to live for the call. Removed keys keep their bytes until map_clear or map_free.
+ * Keys are hashed with map_str_seeded_hash and a random seed per map, set key_hash to map_str_hash and key_hash_seeded to NULL for the same hashes in every map.
+ *
+ * @warning map_add stores a MapStr from map_str as it is, still pointing at the caller's bytes. Long keys in a saved map point at memory of the process that saved it.
+ */
+#define MAP_STR_TYPE(value_type) MAP_TYPE_SEEDED(MapStr, value_type, map_str_seeded_hash, map_str_cmp, NULL, NULL)
+
+    /**
+     * @brief Stores every distinct string once and numbers them in the order they were first seen, see map_intern.
+     *
+     * @details ids is a MAP_STR_TYPE(size_t) map, strings[id] is the copy of the string with that id.
+     */
+    typedef struct
+    {
+        Map *ids;
+        const char **strings;
+        size_t count;
+        size_t capacity;
+    } MapInterner;
+
+#define MAP_INTERN_NONE ((size_t)-1)
+
+    /**
+     * @brief The values of one multimap key, one after the other, see map_get_all.
+     *
+     * @details values has room for capacity of them, count are used.
+     */
+    typedef struct
+    {
+        void *values;
+        size_t count;
+        size_t capacity;
+    } MapSpan;
+
+    /**
+     * @brief Map from each key to all the values added for it, see map_multi_add.
+     *
+     * @details map has MapSpan values, iterate it with MAP_FOR_EACH(multi.map, key_type, key, MapSpan, span). value_size and value_free describe one value.
+     * Every key's values are kept in one array that doubles as it fills, so a group is one contiguous read.
+     */
+    typedef struct
+    {
+        Map *map;
+        size_t value_size;
+        void (*value_free)(void *);
+    } MapMulti;
+
+#define MAP_MULTI_FIRST_VALUES 4
+
+/**
+ * @brief Type of a counting map from key_type to uint64_t, see map_counter_add.
+ *
+ */
+#define MAP_COUNTER_TYPE(key_type, key_hash, key_cmp) MAP_TYPE(key_type, uint64_t, key_hash, key_cmp, NULL, NULL)
+
+/**
+ * @brief Type of a set of _key_type, a map with value_size 0 whose entries store no value, see map_insert_key and map_contains.
+ *
+ */
+#define MAP_SET_TYPE(_key_type, _key_hash, _key_cmp, _key_free) \
+    (MapTypeData)                                                \
+    {                                                            \
+        .key_size = sizeof(_key_type),                           \
+        .value_size = 0,                                         \
+        .key_hash = _key_hash,                                   \
+        .key_cmp = _key_cmp,                                     \
+        .key_free = _key_free                                    \
+    }
+
+/**
+ * @brief Type of a map from key_type to buffers malloc'd by the caller, see map_add_take.
+ *
+ * @details Values are void *, so entries stay small however large the buffers are and growing only moves the pointers. map_get returns a void ** to the pointer.
+ */
+#define MAP_BOXED_TYPE(_key_type, _key_hash, _key_cmp, _key_free) MAP_TYPE(_key_type, void *, _key_hash, _key_cmp, _key_free, map_deref_free)
+
 #define MAP(key_type, value_type)                   \
     map_new(MAP_TYPE_DEFAULT(key_type, value_type), \
             MAP_DEFAULT_BUCKETS_COUNT)
@@ -93,14 +507,15 @@ extern "C"
  *      printf("Key: %s, Value: %d\n", *key, *value);
  *  }
  */
-#define MAP_FOR_EACH(map, key_type, key, value_type, value)                                                 \
-    for (size_t __idx = 0; map && (__idx < map->buckets_count); __idx++)                                    \
-        for (MapNode *__map_node = &map->buckets[__idx]; __map_node != NULL; __map_node = __map_node->next) \
-            for (key_type *key = (key_type *)__map_node->key; key != NULL; key = NULL)                      \
-                for (value_type *value = (value_type *)__map_node->value; value != NULL; value = NULL)
+#define MAP_FOR_EACH(map, key_type, key, value_type, value)                                                  \
+    for (MapIter __map_it = {0, NULL}; map_iter_next(map, &__map_it.index, &__map_it.node);)                 \
+        for (key_type *key = (key_type *)map_iter_key(map, __map_it.node); key != NULL; key = NULL)          \
+            for (value_type *value = (value_type *)map_iter_value(map, __map_it.node); value != NULL; value = NULL)
 
 /**
- * @brief Example:
+ * @brief map_node_ptr is an opaque cursor, with MAP_STORAGE_FLAT it does not point to a real MapNode so only read entries through key and value.
+ *
+ * @details Example:
  * char** key;
  *  int* value;
  *  MapNode* node;
@@ -111,11 +526,57 @@ extern "C"
  *  }
  *
  */
-#define MAP_FOR_EACH_ANSI(map, __idx, map_node_ptr, key_type, key, value_type, value)                      \
-    for (__idx = 0; map && (__idx < map->buckets_count); __idx++)                                          \
-        for (map_node_ptr = &map->buckets[__idx]; map_node_ptr != NULL; map_node_ptr = map_node_ptr->next) \
-            for (key = (key_type *)map_node_ptr->key; key != NULL; key = NULL)                             \
-                for (value = (value_type *)map_node_ptr->value; value != NULL; value = NULL)
+#define MAP_FOR_EACH_ANSI(map, __idx, map_node_ptr, key_type, key, value_type, value)                  \
+    for (__idx = 0, map_node_ptr = NULL; map_iter_next(map, &__idx, &map_node_ptr);)                   \
+        for (key = (key_type *)map_iter_key(map, map_node_ptr); key != NULL; key = NULL)               \
+            for (value = (value_type *)map_iter_value(map, map_node_ptr); value != NULL; value = NULL)
+
+/**
+ * @brief MAP_FOR_EACH for MAP_STORAGE_DENSE maps, walks the entries array directly without calling map_iter_next.
+ *
+ * @warning Only for dense maps. Removing the current key moves the last entry into its place, which this loop then skips.
+ *
+ * @details Entries are visited in the order they were added, until a removal moves the last one forward.
+ */
+#define MAP_DENSE_FOR_EACH(map, key_type, key, value_type, value)                                                                  \
+    for (size_t __map_i = 0; __map_i < (map)->length; __map_i++)                                                                   \
+        for (key_type *key = (key_type *)((map)->entries + __map_i * (map)->entry_size + (map)->key_offset); key != NULL; key = NULL) \
+            for (value_type *value = (value_type *)((map)->entries + __map_i * (map)->entry_size + (map)->value_offset); value != NULL; value = NULL)
+
+/**
+ * @brief MAP_FOR_EACH_ANSI for MAP_STORAGE_DENSE maps, map_node_ptr is set to the start of each entry.
+ *
+ * @warning Only for dense maps.
+ */
+#define MAP_DENSE_FOR_EACH_ANSI(map, __idx, map_node_ptr, key_type, key, value_type, value)                           \
+    for (__idx = 0; __idx < (map)->length && (map_node_ptr = (MapNode *)((map)->entries + __idx * (map)->entry_size)) != NULL; __idx++) \
+        for (key = (key_type *)((byte *)map_node_ptr + (map)->key_offset); key != NULL; key = NULL)                     \
+            for (value = (value_type *)((byte *)map_node_ptr + (map)->value_offset); value != NULL; value = NULL)
+
+    /**
+     * @brief Position of an iteration, see map_iter_next.
+     *
+     */
+    typedef struct
+    {
+        size_t index;
+        MapNode *node;
+    } MapIter;
+
+    /**
+     * @brief Resumable scan over a range of a map's buckets or slots, see map_cursor_split and map_scan.
+     *
+     * @details index is the next bucket or slot to scan and end the first one past the range. skip counts the nodes of bucket index already returned, it is only set when a chain alone did not fit in a batch.
+     * stale is set once the map moved its entries since the cursor was made, see Map.generation.
+     */
+    typedef struct
+    {
+        size_t index;
+        size_t end;
+        size_t skip;
+        uint64_t generation;
+        int stale;
+    } MapCursor;
 
     /**
      * @brief Create a new map.
@@ -142,6 +603,35 @@ extern "C"
      */
     int map_add(Map *map, const void *key, const void *value);
 
+    /**
+     * @brief Find a key, adding it with a zeroed value if it is missing, in a single probe.
+     *
+     * @param map
+     * @param key Valid memory address to key, copied in like map_add if it is added.
+     * @param inserted Set to 1 if the key was added and 0 if it was already in the map, may be NULL.
+     * @return void* to the value to read or write in place, NULL on failure.
+     *
+     * @details Replaces map_get followed by map_add on a miss, which hashes the key twice and copies a whole value in.
+     *
+     * @warning Like map_get the pointer is invalidated by the next map_add or map_remove.
+     */
+    void *map_get_or_insert(Map *map, const void *key, int *inserted);
+
+    /**
+     * @brief Let fn update the value of key in place, adding the key with a zeroed value first if it is missing.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param fn Called once with the value, inserted is 1 if the key was just added. Must not add or remove keys.
+     * @param context Passed to fn.
+     * @return 0 if the key was added, 1 if it was already in the map, -1 on failure (fn is not called then).
+     *
+     * @details Example, counting words:
+     *  static void count(void *value, int inserted, void *context) { ++*(int *)value; }
+     *  map_upsert_with(map, &word, count, NULL);
+     */
+    int map_upsert_with(Map *map, const void *key, void (*fn)(void *value, int inserted, void *context), void *context);
+
     /**
      * @brief Find a key in the map, and return its value pair.
      *
@@ -165,48 +655,718 @@ extern "C"
     int map_remove(Map *map, const void *key);
 
     /**
-     * @brief Get the number of elements in the map.
+     * @brief Hash a key the way the map does, to pass to map_add_hashed, map_get_hashed and map_remove_hashed.
      *
      * @param map
-     * @return double
+     * @param key Valid memory address to key.
+     * @return size_t
+     *
+     * @details This is key_hash(key), or key_hash_seeded(key, seed) for seeded types. Each map finishes the hash for its own layout inside the *_hashed calls, so one result can be reused for every map with the same key_hash and seed.
      */
-    double map_load_factor(const Map *map);
+    size_t map_hash(const Map *map, const void *key);
 
     /**
-     * @brief Get the number of elements in the map.
+     * @brief map_add with a hash the caller already computed.
      *
      * @param map
-     * @return size_t
+     * @param hash map_hash of key, or anything equal to key_hash(key).
+     * @param key Valid memory address to key.
+     * @param value Valid memory address to value.
+     * @return 0 on success, -1 on failure, 1 if the key is already in the map and it updated the value.
+     *
+     * @warning A hash that differs from key_hash(key) files the key where map_get can not find it.
      */
-    size_t map_count_collisions(const Map *map);
+    int map_add_hashed(Map *map, size_t hash, const void *key, const void *value);
 
     /**
-     * @brief Resize the map to have a load factor of 0.75.
+     * @brief map_get with a hash the caller already computed.
      *
      * @param map
-     * @return void
-     *
-     * @details This function will create a new map of the correct size, and add all elements from the old map to the new map. Then it will free the old map and set the pointer to the new map.
+     * @param hash map_hash of key, or anything equal to key_hash(key).
+     * @param key Valid memory address to key.
+     * @return void* to matching key or NULL if not found.
+     */
+    void *map_get_hashed(Map *map, size_t hash, const void *key);
+
+    /**
+     * @brief map_remove with a hash the caller already computed.
      *
-     * @note If the load factor is above 0.75 after optimzing, the hash function may not be suitable for the data.
+     * @param map
+     * @param hash map_hash of key, or anything equal to key_hash(key).
+     * @param key Valid memory address to key.
+     * @return 0 on success, -1 on failure.
+     */
+    int map_remove_hashed(Map *map, size_t hash, const void *key);
+
+    /**
+     * @brief Key for a MAP_STR_TYPE map that borrows str, to pass to any map_* function that only looks keys up.
      *
+     * @param str Does not need to be NUL terminated.
+     * @param length Must be below 4 GiB.
+     * @return MapStr
      */
-    void map_optimize(Map **map);
+    MapStr map_str(const char *str, size_t length);
 
     /**
-     * @brief Pass to MAP_TYPE to use the default hash function for strings.
+     * @brief Pass to MAP_TYPE to hash MapStr keys, map_hash_bytes of their characters.
      *
      * @param key
      * @return size_t
+     */
+    size_t map_str_hash(const void *key);
+
+    /**
+     * @brief map_str_hash with a seed, the key_hash_seeded of MAP_STR_TYPE.
      *
-     * @details Hashes the string pointed to by key.
-     *
-     * @warning Found on wikipedia. Probably not the best string hash function.
+     * @param key
+     * @param seed
+     * @return size_t
      */
-    size_t map_default_hash_str(const void *key);
+    size_t map_str_seeded_hash(const void *key, uint64_t seed);
 
     /**
-     * @brief Pass to MAP_TYPE to use the default compare function for strings.
+     * @brief Pass to MAP_TYPE to compare MapStr keys.
+     *
+     * @param a
+     * @param b
+     * @return int
+     */
+    int map_str_cmp(const void *a, const void *b);
+
+    /**
+     * @brief The characters of a MapStr key, NUL terminated for keys the map stored.
+     *
+     * @param key
+     * @return const char*
+     *
+     * @warning Short strings live inside the key, the pointer is only valid as long as the key does not move, like a map_get result.
+     */
+    const char *map_str_chars(const MapStr *key);
+
+    /**
+     * @brief map_add for a MAP_STR_TYPE map, a new key is copied into the map.
+     *
+     * @param map
+     * @param key Does not need to be NUL terminated.
+     * @param length Bytes of key, below 4 GiB.
+     * @param value Valid memory address to value.
+     * @return 0 on success, -1 on failure, 1 if the key is already in the map and it updated the value.
+     */
+    int map_str_add(Map *map, const char *key, size_t length, const void *value);
+
+    /**
+     * @brief map_get for a MAP_STR_TYPE map.
+     *
+     * @param map
+     * @param key Does not need to be NUL terminated.
+     * @param length Bytes of key.
+     * @return void* to the value or NULL if not found.
+     */
+    void *map_str_get(Map *map, const char *key, size_t length);
+
+    /**
+     * @brief map_remove for a MAP_STR_TYPE map.
+     *
+     * @param map
+     * @param key Does not need to be NUL terminated.
+     * @param length Bytes of key.
+     * @return 0 on success, -1 on failure.
+     */
+    int map_str_remove(Map *map, const char *key, size_t length);
+
+    /**
+     * @brief Prepare an empty interner.
+     *
+     * @param interner
+     * @return 0 on success, -1 on failure.
+     */
+    int map_interner_init(MapInterner *interner);
+
+    /**
+     * @brief Free the interner and every string it stored.
+     *
+     * @param interner
+     */
+    void map_interner_destroy(MapInterner *interner);
+
+    /**
+     * @brief Id of str, storing a copy of it the first time it is seen.
+     *
+     * @param interner
+     * @param str Does not need to be NUL terminated.
+     * @param length Bytes of str, below 4 GiB.
+     * @return size_t Ids count up from 0, MAP_INTERN_NONE on failure.
+     *
+     * @details Equal strings always get the same id, so they can be compared and hashed as integers afterwards.
+     */
+    size_t map_intern(MapInterner *interner, const char *str, size_t length);
+
+    /**
+     * @brief Id of str without adding it.
+     *
+     * @param interner
+     * @param str
+     * @param length
+     * @return size_t MAP_INTERN_NONE if str was never interned.
+     */
+    size_t map_interner_find(const MapInterner *interner, const char *str, size_t length);
+
+    /**
+     * @brief The string with an id from map_intern.
+     *
+     * @param interner
+     * @param id
+     * @return const char* NUL terminated, valid until map_interner_destroy. NULL for unknown ids.
+     */
+    const char *map_interned(const MapInterner *interner, size_t id);
+
+    /**
+     * @brief Create an empty multimap.
+     *
+     * @param multi
+     * @param type value_size, value_free and storage describe one value, everything else the keys like for map_new.
+     * @param buckets_count
+     * @return 0 on success, -1 on failure.
+     */
+    int map_multi_init(MapMulti *multi, MapTypeData type, size_t buckets_count);
+
+    /**
+     * @brief Free the multimap, calling key_free on every key and value_free on every value.
+     *
+     * @param multi
+     */
+    void map_multi_destroy(MapMulti *multi);
+
+    /**
+     * @brief Add value to the values of key, keeping the ones already there.
+     *
+     * @param multi
+     * @param key Valid memory address to key, copied in if the key is new.
+     * @param value Valid memory address to value.
+     * @return 0 if the key was added, 1 if it already had values, -1 on failure.
+     */
+    int map_multi_add(MapMulti *multi, const void *key, const void *value);
+
+    /**
+     * @brief All values of key in the order they were added.
+     *
+     * @param multi
+     * @param key Valid memory address to key.
+     * @return MapSpan with count 0 and values NULL if key has none.
+     *
+     * @warning The span is invalidated by the next map_multi_add or map_multi_remove of any key.
+     */
+    MapSpan map_get_all(const MapMulti *multi, const void *key);
+
+    /**
+     * @brief Remove key with all its values.
+     *
+     * @param multi
+     * @param key Valid memory address to key.
+     * @return 0 on success, -1 if key is not in the multimap.
+     */
+    int map_multi_remove(MapMulti *multi, const void *key);
+
+    /**
+     * @brief Remove every key and value.
+     *
+     * @param multi
+     */
+    void map_multi_clear(MapMulti *multi);
+
+    /**
+     * @brief Add delta to the count of key in a MAP_COUNTER_TYPE map, starting from 0 for a new key.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param delta
+     * @return uint64_t The new count, 0 if the key could not be added.
+     *
+     * @details One probe, like map_get_or_insert.
+     */
+    uint64_t map_counter_add(Map *map, const void *key, uint64_t delta);
+
+    /**
+     * @brief Add delta to the count of a key already in a MAP_COUNTER_TYPE map with a relaxed atomic add.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param delta
+     * @return 0 on success, -1 if the key is not in the map, it is not added.
+     *
+     * @details Only looks the key up, so threads can count into the same map at once as long as no thread adds or removes keys meanwhile,
+     * for example after every key was added with a count of 0. MAP_STATS counters are not exact then.
+     *
+     * @warning Without GCC or Clang atomic builtins the add is a plain one.
+     */
+    int map_counter_add_atomic(Map *map, const void *key, uint64_t delta);
+
+    /**
+     * @brief Count of key in a MAP_COUNTER_TYPE map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return uint64_t 0 if the key is not in the map.
+     */
+    uint64_t map_counter_get(Map *map, const void *key);
+
+    /**
+     * @brief Split the whole map into k cursors over disjoint ranges of its buckets or slots, to scan with map_scan.
+     *
+     * @param map
+     * @param cursors k cursors to fill, together they cover every entry once.
+     * @param k
+     * @return 0 on success, -1 if a resize in progress could not be finished.
+     *
+     * @details Finishes a chained map's resize first, so ranges only cover buckets. Ranges have about buckets_count / k buckets each, not the same number of entries.
+     */
+    int map_cursor_split(Map *map, MapCursor *cursors, size_t k);
+
+    /**
+     * @brief Fill out with up to max entries of the cursor's range and move the cursor past them.
+     *
+     * @param map
+     * @param cursor From map_cursor_split.
+     * @param out Room for max entries, read them with map_iter_key and map_iter_value.
+     * @param max
+     * @return size_t Entries stored in out, 0 once the range is done or the cursor is stale.
+     *
+     * @details Only reads the map, so threads can scan their own cursors of the same map at once, for example one each from map_cursor_split(map, cursors, threads).
+     * The cursor holds no pointer into the map, writers may change it between calls, a background dump only has to hold their lock around each map_scan.
+     * Entries in the map for the whole scan are returned once, entries added or removed in between may or may not be.
+     * A chain is only split over two batches when it alone does not fit in max, removing from such a chain in between can make the scan miss or repeat some of its entries.
+     *
+     * @warning Once the map moved its entries, by growing or any other rehash, the scan stops with cursor->stale set. Split the map again to start over. Pointers in out are invalidated like map_get.
+     *
+     * @details Example:
+     *  MapCursor cursor;
+     *  MapNode *batch[256];
+     *  size_t n, i;
+     *  map_cursor_split(map, &cursor, 1);
+     *  while ((n = map_scan(map, &cursor, batch, 256)) > 0)
+     *      for (i = 0; i < n; i++)
+     *          dump(map_iter_key(map, batch[i]), map_iter_value(map, batch[i]));
+     */
+    size_t map_scan(const Map *map, MapCursor *cursor, MapNode **out, size_t max);
+
+    /**
+     * @brief Take a read-only view of the map as it is now, which keeps its contents while the map goes on changing.
+     *
+     * @param map
+     * @return MapSnapshot* NULL on failure, free it with map_snapshot_free.
+     *
+     * @details Chained and flat maps share their table with the snapshot. The first time the map changes a chunk of MAP_SNAPSHOT_CHUNK buckets or slots,
+     * the snapshot gets its own copy of that chunk first, so a snapshot costs memory for the chunks written since, not for the whole map.
+     * map_get, map_get_or_insert and every other call handing out a value pointer count as writes. A rehash, map_clear and map_free copy every chunk left and let the snapshot go on alone.
+     * A chained map that is still growing finishes first. Dense maps and MAP_FLAG_SMALL maps that have not grown yet are copied whole.
+     *
+     * @details Snapshot calls do not take locks, run them between writes to the map, for example holding the writers' lock around each one or a batch of them.
+     *
+     * @warning Writes through pointers from MAP_FOR_EACH, map_iter_value or map_scan bypass the copy and show up in the snapshot.
+     * Entries are copied byte for byte, memory they point to, like keys freed by key_free or long MapStr keys in a cleared map, is not kept alive.
+     */
+    MapSnapshot *map_snapshot(Map *map);
+
+    /**
+     * @brief Position of an iteration over a snapshot, see map_snapshot_next.
+     *
+     */
+    typedef struct
+    {
+        size_t index;
+        size_t depth;
+        MapNode *node;
+    } MapSnapshotIter;
+
+    /**
+     * @brief Value of key in the snapshot.
+     *
+     * @param snapshot
+     * @param key Valid memory address to key.
+     * @return const void* NULL if the key was not in the map when the snapshot was taken.
+     *
+     * @warning Until the map writes to its chunk the pointer may point into the map's own table, read it before the next write, entries from map_snapshot_next too.
+     */
+    const void *map_snapshot_get(const MapSnapshot *snapshot, const void *key);
+
+    /**
+     * @brief Step through the snapshot's entries like map_iter_next.
+     *
+     * @param snapshot
+     * @param iter Zeroed before the first call.
+     * @param key Set to the key of the next entry.
+     * @param value Set to its value.
+     * @return 1 while there are entries, 0 after the last one.
+     *
+     * @details Writes to the map may come between two calls, iter keeps no pointer into the map's chains.
+     *
+     * @details Example:
+     *  MapSnapshotIter iter = {0, 0, NULL};
+     *  const void *key, *value;
+     *  while (map_snapshot_next(snapshot, &iter, &key, &value))
+     *      write_entry(out, key, value);
+     */
+    int map_snapshot_next(const MapSnapshot *snapshot, MapSnapshotIter *iter, const void **key, const void **value);
+
+    /**
+     * @brief Number of entries in the snapshot.
+     *
+     * @param snapshot
+     * @return size_t
+     */
+    size_t map_snapshot_length(const MapSnapshot *snapshot);
+
+    /**
+     * @brief 0 if the snapshot lost some of its contents, because a chunk could not be copied before its map changed it.
+     *
+     * @param snapshot
+     * @return int
+     */
+    int map_snapshot_complete(const MapSnapshot *snapshot);
+
+    /**
+     * @brief Free a snapshot, the map stops copying chunks for it.
+     *
+     * @param snapshot May be NULL.
+     */
+    void map_snapshot_free(MapSnapshot *snapshot);
+
+    /**
+     * @brief Add a key to a set, or to any map with a zeroed value.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return 0 if the key was added, 1 if it was already in the map, -1 on failure.
+     *
+     * @details Same as map_add without a value to copy, value stays untouched for keys already in the map.
+     */
+    int map_insert_key(Map *map, const void *key);
+
+    /**
+     * @brief Add a key with buffer as its value in a MAP_BOXED_TYPE map, the map takes ownership of buffer without copying it.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param buffer From malloc, freed by the map's value_free when the key is removed or replaced.
+     * @return 0 on success, -1 on failure (the caller still owns buffer), 1 if the key is already in the map and its old buffer was freed.
+     */
+    int map_add_take(Map *map, const void *key, void *buffer);
+
+    /**
+     * @brief Remove a key of a MAP_BOXED_TYPE map and give its buffer back to the caller instead of freeing it.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return void* The buffer, NULL if key is not in the map.
+     */
+    void *map_remove_take(Map *map, const void *key);
+
+    /**
+     * @brief Check whether a key is in the map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return 1 if it is, 0 if not.
+     */
+    int map_contains(Map *map, const void *key);
+
+    /**
+     * @brief Add every key of src that is missing from dst, with its value.
+     *
+     * @param dst
+     * @param src Map with the same key_size, value_size and key_cmp as dst.
+     * @return 0 on success, -1 on failure, keys added until then stay in dst.
+     *
+     * @details One pass over src. When both maps store the same hash for a key, same key_hash, or key_hash_seeded and seed, and both mixed or both not
+     * (chained maps without MAP_FLAG_POW2 store the key_hash result, every other map mixes it), the hash src cached with each key is reused and no key is hashed again.
+     * Keys already in dst keep their value.
+     *
+     * @warning Keys and values are copied byte for byte like map_add, leave key_free and value_free unset in dst if src still owns what they point to.
+     */
+    int map_union(Map *dst, const Map *src);
+
+    /**
+     * @brief Remove every key of map that is not in other.
+     *
+     * @param map
+     * @param other Map with the same key_size and key_cmp as map.
+     * @return size_t Number of keys removed.
+     *
+     * @details One pass over map like map_remove_if, probing other with the hashes map cached when they match, see map_union.
+     */
+    size_t map_intersect(Map *map, Map *other);
+
+    /**
+     * @brief Remove every key of map that is also in other.
+     *
+     * @param map
+     * @param other Map with the same key_size and key_cmp as map.
+     * @return size_t Number of keys removed.
+     *
+     * @details Same single pass as map_intersect.
+     */
+    size_t map_difference(Map *map, Map *other);
+
+    /**
+     * @brief Look up n keys, same as calling map_get for each of them.
+     *
+     * @param map
+     * @param keys n keys of key_size bytes, one after the other.
+     * @param n
+     * @param out_values Receives n value pointers, NULL for keys not in the map.
+     * @return Number of keys found.
+     *
+     * @details Keys are taken MAP_BATCH_GROUP at a time: all of them are hashed and their buckets prefetched, then the chains that continue get their next node prefetched,
+     * and only then are they resolved, so the cache misses of the group overlap instead of being waited for one after the other.
+     */
+    size_t map_get_batch(Map *map, const void *keys, size_t n, void **out_values);
+
+    /**
+     * @brief Add n keys, same as calling map_add for each of them in order.
+     *
+     * @param map
+     * @param keys n keys of key_size bytes, one after the other.
+     * @param values n values of value_size bytes, one after the other.
+     * @param n
+     * @return Number of keys that were not already in the map, or -1 if an add failed. Keys before the failing one stay added.
+     *
+     * @details Hashes and prefetches MAP_BATCH_GROUP keys ahead like map_get_batch.
+     */
+    int map_add_batch(Map *map, const void *keys, const void *values, size_t n);
+
+    /**
+     * @brief Get the number of elements in the map.
+     *
+     * @param map
+     * @return double
+     */
+    double map_load_factor(const Map *map);
+
+    /**
+     * @brief Get the number of elements in the map.
+     *
+     * @param map
+     * @return size_t
+     */
+    size_t map_count_collisions(const Map *map);
+
+    /**
+     * @brief Resize the map to have a load factor of 0.75.
+     *
+     * @param map
+     * @return void
+     *
+     * @details Resizes the table in place like map_shrink_to_fit, chained maps relink their nodes and no key is hashed or value copied again, *map stays the same.
+     * A map from map_open_mmap, or a MAP_FLAG_SMALL map that may fit its small array again, is copied into a new map by the cached hashes instead, then the old map is freed and *map set to the new one.
+     *
+     * @note If the load factor is above 0.75 after optimzing, the hash function may not be suitable for the data.
+     *
+     */
+    void map_optimize(Map **map);
+
+    /**
+     * @brief Make room for n entries, so adding up to n keys never grows the table.
+     *
+     * @param map
+     * @param n
+     * @return 0 on success, -1 on failure.
+     *
+     * @details Resizes in place, nodes and entries are moved by their cached hashes without hashing or copying keys. Never shrinks, a map that already has room is left alone.
+     * A MAP_FLAG_SMALL map asked for more than MAP_SMALL_CAPACITY gets its table now.
+     */
+    int map_reserve(Map *map, size_t n);
+
+    /**
+     * @brief Shrink the table to what length entries need and give back memory that is not in use.
+     *
+     * @param map
+     * @return 0 on success, -1 on failure.
+     *
+     * @details Sizes the table like map_optimize, but in place. Flat and dense maps also drop their tombstones, dense maps trim entries to length, chained maps free slabs map_clear set aside, and all of them once the map is empty.
+     *
+     * @note Bytes of removed MapStr keys stay in the strings arena until map_clear.
+     */
+    int map_shrink_to_fit(Map *map);
+
+    /**
+     * @brief Bytes allocated for the map.
+     *
+     * @param map
+     * @param out Filled with the breakdown, may be NULL.
+     * @return size_t The total.
+     *
+     * @details Counts what the map asked its allocator for, not what the allocator keeps for bookkeeping. A map from map_open_mmap counts the mapped file as its table.
+     */
+    size_t map_memory_usage(const Map *map, MapMemoryUsage *out);
+
+    /**
+     * @brief Create a map holding n keys and values, built by up to threads threads.
+     *
+     * @param type
+     * @param keys n keys of key_size bytes, one after the other.
+     * @param values n values of value_size bytes, one after the other.
+     * @param n
+     * @param threads 0 for one per online processor, capped at MAP_BUILD_MAX_THREADS.
+     * @return Map* or NULL on failure.
+     *
+     * @details Same result as adding the arrays in order to a map sized for n entries, later duplicates update earlier ones.
+     * The entries are partitioned by destination bucket range so every thread writes its own buckets without locking, collisions take their nodes from one preallocated slab.
+     *
+     * @details key_hash and key_cmp are called from several threads. Small inputs, MAP_STORAGE_FLAT and builds with MAP_NO_THREADS run on the calling thread.
+     */
+    Map *map_build_from_arrays(MapTypeData type, const void *keys, const void *values, size_t n, size_t threads);
+
+    /**
+     * @brief map_optimize using up to threads threads, see map_build_from_arrays.
+     *
+     * @param map
+     * @param threads 0 for one per online processor.
+     *
+     * @details Keys are not hashed again, the cached hashes are partitioned. MAP_STORAGE_FLAT maps fall back to map_optimize.
+     */
+    void map_optimize_parallel(Map **map, size_t threads);
+
+    /**
+     * @brief Write the map to path in the layout of MAP_STORAGE_FLAT, so map_open_mmap can use the file as is.
+     *
+     * @param map
+     * @param path
+     * @return 0 on success, -1 on failure.
+     *
+     * @details The file is a header followed by the control bytes and the slots exactly as a flat map keeps them in memory, nothing in it is a pointer.
+     * Chained maps are copied into a temporary flat map first.
+     *
+     * @warning Keys and values are written byte for byte, so only types without pointers (no char* keys) survive a save.
+     */
+    int map_save(const Map *map, const char *path);
+
+    /**
+     * @brief Open a file written by map_save as a read-only flat map, queried straight from the mapped file.
+     *
+     * @param path
+     * @param type Must have the key_size, value_size and key_hash the file was saved with, storage and the free functions are ignored.
+     * @return Map* or NULL if the file cannot be read or was saved with another type, group width, size_t or byte order.
+     *
+     * @details Nothing is deserialized, pages are loaded on first access and shared between processes mapping the same file.
+     * Where mmap is unavailable the file is read into memory in one go instead.
+     *
+     * @details map_add, map_remove and the other writes fail with -1 (map_clear does nothing). map_optimize copies it into a normal map, map_free unmaps the file.
+     */
+    Map *map_open_mmap(const char *path, MapTypeData type);
+
+    /**
+     * @brief Copy the counters of the map into out.
+     *
+     * @param map
+     * @param out
+     * @return 0 on success, -1 if map.c was compiled without MAP_STATS, out is zeroed then.
+     *
+     * @details Counting costs a few increments per call, nothing walks the table. A growing probe_max or a heavy tail in probe_histogram points at a bad key_hash.
+     */
+    int map_stats(const Map *map, MapStats *out);
+
+    /**
+     * @brief Set every counter of the map back to 0.
+     *
+     * @param map
+     */
+    void map_stats_reset(Map *map);
+
+    /**
+     * @brief Advance an iteration over every entry, used by MAP_FOR_EACH and MAP_FOR_EACH_ANSI.
+     *
+     * @param map May be NULL.
+     * @param idx Set to 0 before the first call.
+     * @param node Set to NULL before the first call.
+     * @return 1 if node now refers to an entry, 0 once every entry has been visited.
+     *
+     * @warning Adding or removing keys while iterating is undefined.
+     */
+    int map_iter_next(const Map *map, size_t *idx, MapNode **node);
+
+    /**
+     * @brief Key of the entry an iteration is positioned at.
+     *
+     * @param map
+     * @param node Cursor filled by map_iter_next.
+     * @return void*
+     */
+    void *map_iter_key(const Map *map, const MapNode *node);
+
+    /**
+     * @brief Value of the entry an iteration is positioned at.
+     *
+     * @param map
+     * @param node Cursor filled by map_iter_next.
+     * @return void*
+     */
+    void *map_iter_value(const Map *map, const MapNode *node);
+
+    /**
+     * @brief Pass to MAP_TYPE to use the default hash function for strings.
+     *
+     * @param key
+     * @return size_t
+     *
+     * @details Hashes the string pointed to by key.
+     *
+     * @warning Found on wikipedia. Probably not the best string hash function. Only keeps about 30 bits and works a byte at a time, prefer map_fast_hash_str.
+     */
+    size_t map_default_hash_str(const void *key);
+
+    /**
+     * @brief Pass to MAP_TYPE to hash char* keys with a fast 64 bit hash, used by STR_MAP_TYPE.
+     *
+     * @param key
+     * @return size_t
+     *
+     * @details Hashes the string pointed to by key with map_hash_bytes after one strlen.
+     */
+    size_t map_fast_hash_str(const void *key);
+
+    /**
+     * @brief Hash len bytes of data, for keys whose length is already known.
+     *
+     * @param data
+     * @param len
+     * @return size_t
+     *
+     * @details wyhash, reads up to 48 bytes per step. Call it from your own key_hash to avoid scanning the key twice.
+     */
+    size_t map_hash_bytes(const void *data, size_t len);
+
+    /**
+     * @brief map_hash_bytes keyed by seed, different seeds give unrelated hashes for the same bytes.
+     *
+     * @param data
+     * @param len
+     * @param seed
+     * @return size_t
+     *
+     * @details Seeded wyhash. It is not a cryptographic MAC, but without the seed collisions can not be found offline.
+     */
+    size_t map_seeded_hash_bytes(const void *data, size_t len, uint64_t seed);
+
+    /**
+     * @brief Pass to MAP_TYPE_SEEDED to hash char* keys with map_seeded_hash_bytes, used by SEEDED_STR_MAP_TYPE.
+     *
+     * @param key
+     * @param seed
+     * @return size_t
+     */
+    size_t map_seeded_hash_str(const void *key, uint64_t seed);
+
+    /**
+     * @brief A new random seed, never 0. map_new calls it for seeded types with seed 0.
+     *
+     * @return uint64_t
+     *
+     * @details A secret read once from /dev/urandom, where there is one, is mixed with a counter, so seeds are cheap enough for short lived maps. Thread safe.
+     */
+    uint64_t map_random_seed(void);
+
+    /**
+     * @brief Pass to MAP_TYPE to use the default compare function for strings.
      *
      * @param a
      * @param b
@@ -231,6 +1391,35 @@ extern "C"
 
 #define map_default_free_str map_deref_free
 
+    /**
+     * @brief Prepare an empty arena.
+     *
+     * @param arena
+     * @param block_size Bytes requested from malloc at a time, 0 for MAP_ARENA_DEFAULT_BLOCK_SIZE.
+     */
+    void map_arena_init(MapArena *arena, size_t block_size);
+
+    /**
+     * @brief Free every block of the arena at once. Maps allocated from it must not be used afterwards.
+     *
+     * @param arena
+     *
+     * @details The arena can be reused for new maps afterwards.
+     */
+    void map_arena_destroy(MapArena *arena);
+
+    /**
+     * @brief Allocator handing out memory from the arena, pass it in MapTypeData.allocator.
+     *
+     * @param arena Must outlive every map using it.
+     * @return MapAllocator
+     *
+     * @details Freeing is a no-op, so map_free on an arena backed map with the default free functions only touches the Map. Memory comes back with map_arena_destroy.
+     *
+     * @warning Not thread safe.
+     */
+    MapAllocator map_arena_allocator(MapArena *arena);
+
     /**
      * @brief Pass to MAP_TYPE to use the default hash function.
      *
@@ -265,9 +1454,23 @@ extern "C"
      * @brief Remove all elements from the map without freeing the underlying buckets.
      * 
      * @param map 
+     *
+     * @details When key_free and value_free are both map_default_free no entry is visited, the table is reset with one memset and chained maps keep their node slabs for reuse.
      */
     void map_clear(Map *map);
 
+    /**
+     * @brief Remove every entry pred returns nonzero for, in one pass over the table.
+     *
+     * @param map
+     * @param pred Called once per entry with its key, its value and context. Must not add or remove keys.
+     * @param context Passed to pred.
+     * @return size_t Number of entries removed.
+     *
+     * @details Entries are removed where they are found, no key is hashed or looked up again. Calls key_free and value_free on removed entries.
+     */
+    size_t map_remove_if(Map *map, int (*pred)(const void *key, void *value, void *context), void *context);
+
 #ifdef __cplusplus
 } /* Extern "C" */
 #endif
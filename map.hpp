@@ -0,0 +1,427 @@
+#ifndef _MAP_HPP
+#define _MAP_HPP
+
+#include "map.h"
+#include "map_typed.h"
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace cmap
+{
+    /**
+     * @brief C++ wrapper owning a Map of K to V, lookups are specialized for the types like MAP_DECLARE.
+     *
+     * @details Hash and Eq are default constructed for every call, so they must be stateless. K and V are copied byte for byte and never destroyed.
+     * Call get() to use the map with any map_* function.
+     *
+     * @warning Pointers returned by find are invalidated by the next insert or erase, like map_get.
+     */
+    template <class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+    class Map
+    {
+        static_assert(std::is_trivially_copyable<K>::value, "cmap::Map copies keys with memcpy");
+        static_assert(std::is_trivially_copyable<V>::value, "cmap::Map copies values with memcpy");
+
+    public:
+        /**
+         * @brief Create an empty map.
+         *
+         * @param buckets_count 0 for MAP_DEFAULT_BUCKETS_COUNT.
+         * @param storage A MapStorage.
+         * @param flags A combination of MAP_FLAG_* values.
+         *
+         * @details Throws std::bad_alloc if map_new fails.
+         */
+        explicit Map(std::size_t buckets_count = MAP_DEFAULT_BUCKETS_COUNT, int storage = MAP_STORAGE_CHAINED, unsigned flags = 0)
+        {
+            MapTypeData type = MapTypeData();
+            type.key_size = sizeof(K);
+            type.value_size = sizeof(V);
+            type.key_hash = key_hash;
+            type.key_cmp = key_cmp;
+            type.storage = storage;
+            type.flags = flags;
+            map_ = map_new(type, buckets_count == 0 ? MAP_DEFAULT_BUCKETS_COUNT : buckets_count);
+            if (map_ == nullptr)
+                throw std::bad_alloc();
+        }
+
+        ~Map()
+        {
+            if (map_ != nullptr)
+                map_free(map_);
+        }
+
+        Map(const Map &) = delete;
+        Map &operator=(const Map &) = delete;
+
+        Map(Map &&other) noexcept : map_(other.map_)
+        {
+            other.map_ = nullptr;
+        }
+
+        Map &operator=(Map &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (map_ != nullptr)
+                    map_free(map_);
+                map_ = other.map_;
+                other.map_ = nullptr;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Add a key, or update its value if it is already in the map.
+         *
+         * @return 0 on success, -1 on failure, 1 if the key is already in the map and it updated the value.
+         */
+        int insert(const K &key, const V &value)
+        {
+            byte *entry = map_->mapped == nullptr && map_->snapshots == nullptr ? find_entry(map_, hash_of(key), &key) : nullptr;
+            if (entry == nullptr)
+                return map_add(map_, &key, &value);
+            *reinterpret_cast<V *>(entry + map_->value_offset) = value;
+            return 1;
+        }
+
+        /**
+         * @brief Value of key, added zeroed if it was missing, see map_get_or_insert.
+         *
+         * @return nullptr on failure.
+         */
+        V *get_or_insert(const K &key, bool *inserted = nullptr)
+        {
+            byte *entry = map_->mapped == nullptr && map_->snapshots == nullptr ? find_entry(map_, hash_of(key), &key) : nullptr;
+            int added = 0;
+            V *value = entry != nullptr ? reinterpret_cast<V *>(entry + map_->value_offset) : static_cast<V *>(map_get_or_insert(map_, &key, &added));
+            if (inserted != nullptr)
+                *inserted = added != 0;
+            return value;
+        }
+
+        /**
+         * @brief Construct the value of key in place from args if the key is missing, like std::unordered_map::try_emplace.
+         *
+         * @return The value and whether it was added, nullptr and false on failure. An existing value is left alone.
+         */
+        template <class... Args>
+        std::pair<V *, bool> emplace(const K &key, Args &&...args)
+        {
+            bool inserted = false;
+            V *value = get_or_insert(key, &inserted);
+            if (value != nullptr && inserted)
+                ::new (static_cast<void *>(value)) V(std::forward<Args>(args)...);
+            return std::pair<V *, bool>(value, inserted);
+        }
+
+        /**
+         * @brief Value of key or nullptr.
+         */
+        V *find(const K &key)
+        {
+            if (map_->snapshots != nullptr)
+                return static_cast<V *>(map_get(map_, &key));
+            byte *entry = find_entry(map_, hash_of(key), &key);
+            return entry == nullptr ? nullptr : reinterpret_cast<V *>(entry + map_->value_offset);
+        }
+
+        const V *find(const K &key) const
+        {
+            byte *entry = find_entry(map_, hash_of(key), &key);
+            return entry == nullptr ? nullptr : reinterpret_cast<const V *>(entry + map_->value_offset);
+        }
+
+        bool contains(const K &key) const
+        {
+            return find_entry(map_, hash_of(key), &key) != nullptr;
+        }
+
+        /**
+         * @brief Remove key.
+         *
+         * @return true if it was in the map.
+         */
+        bool erase(const K &key)
+        {
+            return map_remove(map_, &key) == 0;
+        }
+
+        std::size_t size() const
+        {
+            return map_->length;
+        }
+
+        bool empty() const
+        {
+            return map_->length == 0;
+        }
+
+        void clear()
+        {
+            map_clear(map_);
+        }
+
+        void optimize()
+        {
+            map_optimize(&map_);
+        }
+
+        /**
+         * @brief Call fn(const K &key, V &value) on every entry.
+         *
+         * @warning fn must not insert or erase.
+         */
+        template <class Fn>
+        void for_each(Fn fn)
+        {
+            std::size_t index = 0;
+            MapNode *node = nullptr;
+            while (map_iter_next(map_, &index, &node))
+                fn(*static_cast<const K *>(map_iter_key(map_, node)), *static_cast<V *>(map_iter_value(map_, node)));
+        }
+
+        ::Map *get()
+        {
+            return map_;
+        }
+
+        const ::Map *get() const
+        {
+            return map_;
+        }
+
+    private:
+        static std::size_t key_hash(const void *key)
+        {
+            return Hash()(*static_cast<const K *>(key));
+        }
+
+        static int key_cmp(const void *a, const void *b)
+        {
+            return Eq()(*static_cast<const K *>(a), *static_cast<const K *>(b)) ? 0 : 1;
+        }
+
+        static bool key_eq(const K *a, const K *b)
+        {
+            return Eq()(*a, *b);
+        }
+
+        MAP_TYPED_DEFINE_FIND(find_entry, ::Map, K, key_eq)
+
+        std::size_t hash_of(const K &key) const
+        {
+            return map_typed_hash(map_, Hash()(key));
+        }
+
+        ::Map *map_;
+    };
+
+    /**
+     * @brief C++ wrapper owning a Map of K to heap allocated V, for values that are large or not trivially copyable.
+     *
+     * @details Entries only hold a V *, so growing and map_optimize move pointers and a value is never copied after it was built.
+     * emplace constructs it once with new, insert moves into it, and the map deletes it when the key is removed, replaced or the map freed.
+     *
+     * @warning Pointers returned by find stay valid until the key is removed or replaced, unlike Map they survive inserting other keys.
+     */
+    template <class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+    class BoxedMap
+    {
+        static_assert(std::is_trivially_copyable<K>::value, "cmap::BoxedMap copies keys with memcpy");
+
+    public:
+        /**
+         * @brief Create an empty map, see Map::Map.
+         */
+        explicit BoxedMap(std::size_t buckets_count = MAP_DEFAULT_BUCKETS_COUNT, int storage = MAP_STORAGE_CHAINED, unsigned flags = 0)
+        {
+            MapTypeData type = MapTypeData();
+            type.key_size = sizeof(K);
+            type.value_size = sizeof(V *);
+            type.key_hash = key_hash;
+            type.key_cmp = key_cmp;
+            type.value_free = value_free;
+            type.storage = storage;
+            type.flags = flags;
+            map_ = map_new(type, buckets_count == 0 ? MAP_DEFAULT_BUCKETS_COUNT : buckets_count);
+            if (map_ == nullptr)
+                throw std::bad_alloc();
+        }
+
+        ~BoxedMap()
+        {
+            if (map_ != nullptr)
+                map_free(map_);
+        }
+
+        BoxedMap(const BoxedMap &) = delete;
+        BoxedMap &operator=(const BoxedMap &) = delete;
+
+        BoxedMap(BoxedMap &&other) noexcept : map_(other.map_)
+        {
+            other.map_ = nullptr;
+        }
+
+        BoxedMap &operator=(BoxedMap &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (map_ != nullptr)
+                    map_free(map_);
+                map_ = other.map_;
+                other.map_ = nullptr;
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Build the value of key from args if the key is missing.
+         *
+         * @return The value and whether it was added. An existing value is left alone.
+         *
+         * @details Throws std::bad_alloc if the key can not be added, whatever V's constructor throws leaves the map unchanged.
+         */
+        template <class... Args>
+        std::pair<V *, bool> emplace(const K &key, Args &&...args)
+        {
+            if (V *existing = find(key))
+                return std::pair<V *, bool>(existing, false);
+            std::unique_ptr<V> value(new V(std::forward<Args>(args)...));
+            if (map_add_take(map_, &key, value.get()) < 0)
+                throw std::bad_alloc();
+            return std::pair<V *, bool>(value.release(), true);
+        }
+
+        /**
+         * @brief Move value into the value of key, building a new one if the key is missing.
+         *
+         * @return true if the key was added.
+         */
+        bool insert(const K &key, V &&value)
+        {
+            if (V *existing = find(key))
+            {
+                *existing = std::move(value);
+                return false;
+            }
+            return emplace(key, std::move(value)).second;
+        }
+
+        /**
+         * @brief Value of key or nullptr.
+         */
+        V *find(const K &key) const
+        {
+            byte *entry = find_entry(map_, hash_of(key), &key);
+            return entry == nullptr ? nullptr : *reinterpret_cast<V **>(entry + map_->value_offset);
+        }
+
+        bool contains(const K &key) const
+        {
+            return find_entry(map_, hash_of(key), &key) != nullptr;
+        }
+
+        /**
+         * @brief Remove key and hand its value to the caller instead of deleting it.
+         *
+         * @return nullptr if key is not in the map.
+         */
+        std::unique_ptr<V> take(const K &key)
+        {
+            return std::unique_ptr<V>(static_cast<V *>(map_remove_take(map_, &key)));
+        }
+
+        /**
+         * @brief Remove key and delete its value.
+         *
+         * @return true if it was in the map.
+         */
+        bool erase(const K &key)
+        {
+            return map_remove(map_, &key) == 0;
+        }
+
+        std::size_t size() const
+        {
+            return map_->length;
+        }
+
+        bool empty() const
+        {
+            return map_->length == 0;
+        }
+
+        void clear()
+        {
+            map_clear(map_);
+        }
+
+        void optimize()
+        {
+            map_optimize(&map_);
+        }
+
+        /**
+         * @brief Call fn(const K &key, V &value) on every entry.
+         *
+         * @warning fn must not insert or erase.
+         */
+        template <class Fn>
+        void for_each(Fn fn)
+        {
+            std::size_t index = 0;
+            MapNode *node = nullptr;
+            while (map_iter_next(map_, &index, &node))
+                fn(*static_cast<const K *>(map_iter_key(map_, node)), **static_cast<V **>(map_iter_value(map_, node)));
+        }
+
+        ::Map *get()
+        {
+            return map_;
+        }
+
+        const ::Map *get() const
+        {
+            return map_;
+        }
+
+    private:
+        static std::size_t key_hash(const void *key)
+        {
+            return Hash()(*static_cast<const K *>(key));
+        }
+
+        static int key_cmp(const void *a, const void *b)
+        {
+            return Eq()(*static_cast<const K *>(a), *static_cast<const K *>(b)) ? 0 : 1;
+        }
+
+        static bool key_eq(const K *a, const K *b)
+        {
+            return Eq()(*a, *b);
+        }
+
+        /* NULL boxes are values map_remove_take already handed out. */
+        static void value_free(void *slot)
+        {
+            delete *static_cast<V **>(slot);
+        }
+
+        MAP_TYPED_DEFINE_FIND(find_entry, ::Map, K, key_eq)
+
+        std::size_t hash_of(const K &key) const
+        {
+            return map_typed_hash(map_, Hash()(key));
+        }
+
+        ::Map *map_;
+    };
+}
+
+#endif /* _MAP_HPP */
@@ -0,0 +1,197 @@
+#ifndef _MAP_TYPED_H
+#define _MAP_TYPED_H
+
+#include "map.h"
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief Turn a key_hash result into the hash the map stores, same as map.c does before every lookup.
+     *
+     * @param map
+     * @param hash Result of the map's key_hash.
+     * @return size_t
+     */
+    static inline size_t map_typed_hash(const Map *map, size_t hash)
+    {
+        if (map->type.storage != MAP_STORAGE_CHAINED || (map->type.flags & MAP_FLAG_POW2))
+            hash = map_mix_hash(hash);
+        return hash | MAP_HASH_USED;
+    }
+
+    /**
+     * @brief Bucket head of a chained map that hash belongs to, in old_buckets if it has not been migrated yet.
+     *
+     * @param map
+     * @param hash Stored hash, see map_typed_hash.
+     * @return MapNode*
+     */
+    static inline MapNode *map_typed_bucket(const Map *map, size_t hash)
+    {
+        if (map->old_buckets != NULL)
+        {
+            size_t old_index = (map->type.flags & MAP_FLAG_POW2) ? hash & (map->old_buckets_count - 1) : hash % map->old_buckets_count;
+            if (old_index >= map->migrate_index)
+                return (MapNode *)(map->old_buckets + old_index * map->entry_size);
+        }
+        size_t index = (map->type.flags & MAP_FLAG_POW2) ? hash & (map->buckets_count - 1) : hash % map->buckets_count;
+        return (MapNode *)(map->buckets + index * map->entry_size);
+    }
+
+/**
+ * @brief Define static inline byte *fn(const map_type *map, size_t hash, const K *key) returning the node, slot or dense entry holding key, or NULL.
+ *
+ * @details Scans the same small array, walks the same chains and probes the same groups as map_get, but calls eq(const K *, const K *) directly so it can be inlined.
+ * Control bytes are scanned one at a time, which compilers vectorize well enough for the one or two groups a lookup touches.
+ * 0x80 is the control byte of an empty slot in map.c.
+ *
+ * @note map_type is the Map typedef, it is a parameter because the C++ wrapper has to spell it ::Map.
+ */
+#define MAP_TYPED_DEFINE_FIND(fn, map_type, K, eq)                                                                    \
+    static inline byte *fn(const map_type *map, size_t hash, const K *key)                                           \
+    {                                                                                                                 \
+        if (map->small_hashes != NULL)                                                                                \
+        {                                                                                                             \
+            size_t i;                                                                                                 \
+            for (i = 0; i < map->length; i++)                                                                         \
+                if (map->small_hashes[i] == hash && eq((const K *)(map->small_entries + i * map->entry_size + map->key_offset), key)) \
+                    return map->small_entries + i * map->entry_size;                                                  \
+            return NULL;                                                                                              \
+        }                                                                                                             \
+        if (map->type.storage != MAP_STORAGE_CHAINED)                                                                \
+        {                                                                                                             \
+            size_t mask = map->buckets_count - 1, pos = (hash >> 7) & mask, step = 0;                                \
+            byte h2 = (byte)(hash & 0x7F);                                                                            \
+            while (1)                                                                                                 \
+            {                                                                                                         \
+                const byte *group = map->ctrl + pos;                                                                  \
+                int empty = 0;                                                                                        \
+                size_t i;                                                                                             \
+                for (i = 0; i < MAP_GROUP_WIDTH; i++)                                                                 \
+                {                                                                                                     \
+                    if (group[i] == h2)                                                                               \
+                    {                                                                                                 \
+                        size_t index = (pos + i) & mask;                                                              \
+                        byte *slot = map->type.storage == MAP_STORAGE_FLAT                                            \
+                                         ? map->slots + index * map->entry_size                                       \
+                                         : map->entries + ((const size_t *)map->slots)[index] * map->entry_size;      \
+                        if (*(const size_t *)slot == hash && eq((const K *)(slot + map->key_offset), key))           \
+                            return slot;                                                                              \
+                    }                                                                                                 \
+                    empty |= group[i] == 0x80;                                                                        \
+                }                                                                                                     \
+                if (empty)                                                                                            \
+                    return NULL;                                                                                      \
+                step += MAP_GROUP_WIDTH;                                                                              \
+                pos = (pos + step) & mask;                                                                            \
+            }                                                                                                         \
+        }                                                                                                             \
+        const MapNode *node = map_typed_bucket(map, hash);                                                           \
+        if (node->hash == 0)                                                                                          \
+            return NULL;                                                                                              \
+        for (; node != NULL; node = node->next)                                                                       \
+            if (node->hash == hash && eq((const K *)((const byte *)node + map->key_offset), key))                    \
+                return (byte *)node;                                                                                  \
+        return NULL;                                                                                                  \
+    }
+
+/**
+ * @brief Declare a map of K to V whose lookups are specialized for the two types.
+ *
+ * @param name Prefix of the generated functions.
+ * @param K Key type, stored by value.
+ * @param V Value type, stored by value.
+ * @param hash size_t hash(const K *key)
+ * @param eq int eq(const K *a, const K *b), nonzero when the keys are equal.
+ *
+ * @details Generates, all static inline:
+ *  MapTypeData name_type(void), the type with key_hash and key_cmp wrapping hash and eq.
+ *  Map *name_new(size_t buckets_count), map_new(name_type(), buckets_count).
+ *  V *name_get(Map *map, K key), int name_contains(Map *map, K key).
+ *  int name_add(Map *map, K key, V value), int name_remove(Map *map, K key), same results as map_add and map_remove.
+ *  V *name_get_or_insert(Map *map, K key, int *inserted), same as map_get_or_insert.
+ *
+ * @details name_get and name_contains call hash and eq directly and copy sizeof(K) and sizeof(V) bytes, so both get inlined. So do name_add and name_get_or_insert on keys already in the map.
+ * While the map has an open snapshot, everything but name_contains goes through map_get and map_add, which copy the chunk first.
+ * Adding a new key and removing one change the table and go through map_add and map_remove, which only call key_cmp on keys with the same full hash.
+ *
+ * @details The result is an ordinary Map, set storage, flags or allocator on name_type() and call map_new for other layouts, every map_* function works on it.
+ *
+ * @warning Only pass maps made with name_type() to the generated functions, they must hash keys the same way, so do not set key_hash_seeded on it. Generated lookups are not counted by MAP_STATS.
+ *
+ * @details Example:
+ *  static size_t int_hash(const int *key) { return (size_t)*key; }
+ *  static int int_eq(const int *a, const int *b) { return *a == *b; }
+ *  MAP_DECLARE(IntMap, int, int, int_hash, int_eq)
+ *
+ *  Map *map = IntMap_new(0);
+ *  IntMap_add(map, 1, 10);
+ *  int *value = IntMap_get(map, 1);
+ */
+#define MAP_DECLARE(name, K, V, hash, eq)                                                            \
+    static inline size_t name##_key_hash(const void *key)                                            \
+    {                                                                                                \
+        return hash((const K *)key);                                                                 \
+    }                                                                                                \
+    static inline int name##_key_cmp(const void *a, const void *b)                                   \
+    {                                                                                                \
+        return eq((const K *)a, (const K *)b) ? 0 : 1;                                               \
+    }                                                                                                \
+    MAP_TYPED_DEFINE_FIND(name##_find, Map, K, eq)                                                   \
+    static inline MapTypeData name##_type(void)                                                      \
+    {                                                                                                \
+        MapTypeData type;                                                                            \
+        memset(&type, 0, sizeof(type));                                                              \
+        type.key_size = sizeof(K);                                                                   \
+        type.value_size = sizeof(V);                                                                 \
+        type.key_hash = name##_key_hash;                                                             \
+        type.key_cmp = name##_key_cmp;                                                               \
+        return type;                                                                                 \
+    }                                                                                                \
+    static inline Map *name##_new(size_t buckets_count)                                              \
+    {                                                                                                \
+        return map_new(name##_type(), buckets_count == 0 ? MAP_DEFAULT_BUCKETS_COUNT : buckets_count); \
+    }                                                                                                \
+    static inline V *name##_get(Map *map, K key)                                                     \
+    {                                                                                                \
+        if (map->snapshots != NULL)                                                                  \
+            return (V *)map_get(map, &key);                                                          \
+        byte *entry = name##_find(map, map_typed_hash(map, hash(&key)), &key);                       \
+        return entry == NULL ? NULL : (V *)(entry + map->value_offset);                              \
+    }                                                                                                \
+    static inline int name##_contains(Map *map, K key)                                               \
+    {                                                                                                \
+        return name##_find(map, map_typed_hash(map, hash(&key)), &key) != NULL;                      \
+    }                                                                                                \
+    static inline int name##_add(Map *map, K key, V value)                                           \
+    {                                                                                                \
+        byte *entry = map->mapped == NULL && map->snapshots == NULL ? name##_find(map, map_typed_hash(map, hash(&key)), &key) : NULL; \
+        if (entry == NULL)                                                                           \
+            return map_add(map, &key, &value);                                                       \
+        map->type.value_free(entry + map->value_offset);                                             \
+        memcpy(entry + map->value_offset, &value, sizeof(V));                                        \
+        return 1;                                                                                    \
+    }                                                                                                \
+    static inline V *name##_get_or_insert(Map *map, K key, int *inserted)                            \
+    {                                                                                                \
+        byte *entry = map->mapped == NULL && map->snapshots == NULL ? name##_find(map, map_typed_hash(map, hash(&key)), &key) : NULL; \
+        if (entry == NULL)                                                                           \
+            return (V *)map_get_or_insert(map, &key, inserted);                                      \
+        if (inserted != NULL)                                                                        \
+            *inserted = 0;                                                                           \
+        return (V *)(entry + map->value_offset);                                                     \
+    }                                                                                                \
+    static inline int name##_remove(Map *map, K key)                                                 \
+    {                                                                                                \
+        return map_remove(map, &key);                                                                \
+    }
+
+#ifdef __cplusplus
+} /* Extern "C" */
+#endif
+
+#endif /* _MAP_TYPED_H */
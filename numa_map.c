@@ -0,0 +1,228 @@
+/* sched_getcpu is a GNU extension. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "numa_map.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#ifdef NUMA_MAP_LIBNUMA
+#include <numa.h>
+#endif
+
+/* The highest bits pick the node, the ConcurrentMap of the node picks its shard from the low end of the upper half. */
+static size_t numa_map_node_index(const NumaMap *map, const void *key)
+{
+    const size_t half = sizeof(size_t) * 4;
+    size_t upper = map_mix_hash(map_type_hash(&map->type, key)) >> half;
+    return (upper * map->nodes_count) >> half;
+}
+
+static void *numa_map_node_alloc(void *context, size_t size)
+{
+#ifdef NUMA_MAP_LIBNUMA
+    const NumaMapNode *node = (const NumaMapNode *)context;
+    /* numa_alloc_onnode hands out whole pages, headers and the first slabs stay in malloc's. */
+    if (node->node >= 0 && size >= NUMA_MAP_PAGE_SIZE)
+        return numa_alloc_onnode(size, node->node);
+#endif
+    return malloc(size);
+}
+
+static void numa_map_node_free(void *context, void *ptr, size_t size)
+{
+#ifdef NUMA_MAP_LIBNUMA
+    const NumaMapNode *node = (const NumaMapNode *)context;
+    if (node->node >= 0 && size >= NUMA_MAP_PAGE_SIZE)
+    {
+        numa_free(ptr, size);
+        return;
+    }
+#endif
+    free(ptr);
+}
+
+size_t numa_map_nodes_available(void)
+{
+#ifdef NUMA_MAP_LIBNUMA
+    if (numa_available() >= 0)
+    {
+        int count = numa_num_configured_nodes();
+        if (count > 0)
+            return (size_t)count;
+    }
+#endif
+    return 1;
+}
+
+NumaMap *numa_map_new(MapTypeData type, size_t buckets_count, size_t nodes_count, unsigned flags)
+{
+    size_t i, available = numa_map_nodes_available();
+    int placed = 0;
+#ifdef NUMA_MAP_LIBNUMA
+    placed = numa_available() >= 0;
+#endif
+    if ((flags & NUMA_MAP_REPLICATED) && (flags & NUMA_MAP_LOCK_FREE) && (type.key_free != NULL || type.value_free != NULL))
+    {
+        return NULL;
+    }
+    if (type.key_hash == NULL)
+    {
+        type.key_hash = map_default_hash;
+    }
+    if (type.key_hash_seeded != NULL && type.seed == 0)
+    {
+        /* Picked once, so every node and the node index agree on every hash. */
+        type.seed = map_random_seed();
+    }
+    memset(&type.allocator, 0, sizeof(type.allocator));
+    if (nodes_count == 0)
+    {
+        nodes_count = available;
+    }
+
+    NumaMap *map = (NumaMap *)malloc(sizeof(NumaMap));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    map->nodes = (NumaMapNode *)calloc(nodes_count, sizeof(NumaMapNode));
+    if (map->nodes == NULL)
+    {
+        free(map);
+        return NULL;
+    }
+    map->type = type;
+    map->flags = flags;
+    map->nodes_count = nodes_count;
+    pthread_mutex_init(&map->write_lock, NULL);
+    for (i = 0; i < nodes_count; i++)
+    {
+        MapTypeData node_type = type;
+        map->nodes[i].node = placed ? (int)(i % available) : -1;
+        node_type.allocator.alloc = numa_map_node_alloc;
+        node_type.allocator.free = numa_map_node_free;
+        node_type.allocator.context = &map->nodes[i];
+        if ((flags & NUMA_MAP_REPLICATED) && i > 0)
+        {
+            /* The copies hold the same keys and values as the first one, which frees them. */
+            node_type.key_free = NULL;
+            node_type.value_free = NULL;
+        }
+        map->nodes[i].map = (flags & NUMA_MAP_LOCK_FREE) ? concurrent_map_new_lock_free(node_type, buckets_count, 0) : concurrent_map_new(node_type, buckets_count, 0);
+        if (map->nodes[i].map == NULL)
+        {
+            numa_map_free(map);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+void numa_map_free(NumaMap *map)
+{
+    size_t i;
+    /* Copies go first, they must not outlive the keys the first one frees. */
+    for (i = map->nodes_count; i > 0; i--)
+        if (map->nodes[i - 1].map != NULL)
+            concurrent_map_free(map->nodes[i - 1].map);
+    pthread_mutex_destroy(&map->write_lock);
+    free(map->nodes);
+    free(map);
+}
+
+size_t numa_map_current_node(const NumaMap *map)
+{
+    if (map->nodes_count == 1)
+        return 0;
+    int cpu = sched_getcpu();
+    if (cpu < 0)
+        return 0;
+#ifdef NUMA_MAP_LIBNUMA
+    if (map->nodes[0].node >= 0)
+    {
+        int node = numa_node_of_cpu(cpu);
+        size_t available = numa_map_nodes_available();
+        if (node >= 0 && (size_t)node < map->nodes_count)
+        {
+            /* Indices node, node + available, ... are all on this node, CPUs take turns between them. */
+            size_t on_node = (map->nodes_count - (size_t)node + available - 1) / available;
+            return (size_t)node + ((size_t)cpu % on_node) * available;
+        }
+        if (node >= 0)
+            return (size_t)node % map->nodes_count;
+    }
+#endif
+    return (size_t)cpu % map->nodes_count;
+}
+
+int numa_map_add(NumaMap *map, const void *key, const void *value)
+{
+    if (!(map->flags & NUMA_MAP_REPLICATED))
+        return concurrent_map_add(map->nodes[numa_map_node_index(map, key)].map, key, value);
+    size_t i;
+    int result = 0;
+    /* One writer at a time, so every copy sees the writes in the same order.
+       The first copy goes last, it frees the old value once no other copy hands it out. */
+    pthread_mutex_lock(&map->write_lock);
+    for (i = map->nodes_count; i > 0; i--)
+    {
+        result = concurrent_map_add(map->nodes[i - 1].map, key, value);
+        if (result < 0)
+            break;
+    }
+    pthread_mutex_unlock(&map->write_lock);
+    return result;
+}
+
+int numa_map_get(NumaMap *map, const void *key, void *value_out)
+{
+    size_t index = (map->flags & NUMA_MAP_REPLICATED) ? numa_map_current_node(map) : numa_map_node_index(map, key);
+    return concurrent_map_get(map->nodes[index].map, key, value_out);
+}
+
+int numa_map_remove(NumaMap *map, const void *key)
+{
+    if (!(map->flags & NUMA_MAP_REPLICATED))
+        return concurrent_map_remove(map->nodes[numa_map_node_index(map, key)].map, key);
+    size_t i;
+    int result = -1;
+    pthread_mutex_lock(&map->write_lock);
+    for (i = map->nodes_count; i > 0; i--)
+        result = concurrent_map_remove(map->nodes[i - 1].map, key);
+    pthread_mutex_unlock(&map->write_lock);
+    return result;
+}
+
+size_t numa_map_length(NumaMap *map)
+{
+    if (map->flags & NUMA_MAP_REPLICATED)
+        return concurrent_map_length(map->nodes[0].map);
+    size_t i, length = 0;
+    for (i = 0; i < map->nodes_count; i++)
+        length += concurrent_map_length(map->nodes[i].map);
+    return length;
+}
+
+void numa_map_for_each(NumaMap *map, void (*fn)(const void *key, const void *value, void *context), void *context)
+{
+    if (map->flags & NUMA_MAP_REPLICATED)
+    {
+        concurrent_map_for_each(map->nodes[0].map, fn, context);
+        return;
+    }
+    size_t i;
+    for (i = 0; i < map->nodes_count; i++)
+        concurrent_map_for_each(map->nodes[i].map, fn, context);
+}
+
+void numa_map_clear(NumaMap *map)
+{
+    size_t i;
+    if (map->flags & NUMA_MAP_REPLICATED)
+        pthread_mutex_lock(&map->write_lock);
+    for (i = map->nodes_count; i > 0; i--)
+        concurrent_map_clear(map->nodes[i - 1].map);
+    if (map->flags & NUMA_MAP_REPLICATED)
+        pthread_mutex_unlock(&map->write_lock);
+}
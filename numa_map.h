@@ -0,0 +1,171 @@
+#ifndef _NUMA_MAP_H
+#define _NUMA_MAP_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "concurrent_map.h"
+#include <pthread.h>
+
+/**
+ * @brief Every node keeps a full copy of the map, see numa_map_new.
+ *
+ */
+#define NUMA_MAP_REPLICATED 1
+
+/**
+ * @brief Nodes are concurrent_map_new_lock_free maps, so their lookups take no lock.
+ *
+ */
+#define NUMA_MAP_LOCK_FREE 2
+
+/**
+ * @brief Blocks of at least this many bytes are placed on their node, smaller ones come from malloc.
+ *
+ */
+#ifndef NUMA_MAP_PAGE_SIZE
+#define NUMA_MAP_PAGE_SIZE 4096
+#endif
+
+    /**
+     * @brief The part of a NumaMap whose memory lives on one NUMA node.
+     *
+     * @details node is the NUMA node its blocks are allocated on, -1 when memory is not placed. map allocates through a MapAllocator whose context is this NumaMapNode.
+     */
+    typedef struct
+    {
+        int node;
+        ConcurrentMap *map;
+    } NumaMapNode;
+
+    /**
+     * @brief Thread safe map split into one ConcurrentMap per NUMA node, each allocated on its node through its own MapAllocator.
+     *
+     * @details By default every key lives on exactly one node, picked from the highest bits of the mixed key_hash. The ConcurrentMap of a node shards on the bits below them,
+     * so the keys of one node still spread over all of its shards. A thread on another node reaches it over the interconnect, but the locks and buckets of each part only
+     * bounce between the caches of the threads using them, instead of the whole table living on the node that happened to touch it first.
+     *
+     * @details NUMA_MAP_REPLICATED keeps a full copy on every node instead. Lookups read the copy of the node the calling thread runs on,
+     * so read-mostly tables never leave the socket. Writers take write_lock and update the copies one after the other.
+     *
+     * @details Build with NUMA_MAP_LIBNUMA defined and link with -lnuma to place memory with numa_alloc_onnode. Without it nodes are only a way to split the map,
+     * memory comes from malloc and threads are assigned to nodes by their CPU number.
+     */
+    typedef struct
+    {
+        MapTypeData type;
+        unsigned flags;
+        size_t nodes_count;
+        NumaMapNode *nodes;
+        pthread_mutex_t write_lock;
+    } NumaMap;
+
+    /**
+     * @brief Number of NUMA nodes of the machine.
+     *
+     * @return size_t 1 when built without NUMA_MAP_LIBNUMA or the kernel has no NUMA support.
+     */
+    size_t numa_map_nodes_available(void);
+
+    /**
+     * @brief Create a new NUMA map.
+     *
+     * @param type allocator is ignored, every node allocates on its own node. With NUMA_MAP_REPLICATED the copies share the keys and values, only the first one calls key_free and value_free.
+     * @param buckets_count Buckets of every node, split between its shards.
+     * @param nodes_count 0 for numa_map_nodes_available. More nodes than the machine has are spread over its nodes round robin.
+     * @param flags A combination of NUMA_MAP_* values.
+     * @return NumaMap* or NULL on failure.
+     *
+     * @warning Replicated lock free maps may still be read on one node while the first copy frees the entry, numa_map_new returns NULL for them if key_free or value_free is set.
+     *
+     * @details Each node is a ConcurrentMap of CONCURRENT_MAP_DEFAULT_SHARDS shards.
+     */
+    NumaMap *numa_map_new(MapTypeData type, size_t buckets_count, size_t nodes_count, unsigned flags);
+
+    /**
+     * @brief Free the map and every entry in it.
+     *
+     * @param map
+     *
+     * @warning No other thread may be using the map.
+     */
+    void numa_map_free(NumaMap *map);
+
+    /**
+     * @brief Index of the node the calling thread's lookups read from.
+     *
+     * @param map
+     * @return size_t Below nodes_count.
+     *
+     * @note The thread may move to another CPU right after, the result is a hint that is right most of the time, never a requirement for correctness.
+     */
+    size_t numa_map_current_node(const NumaMap *map);
+
+    /**
+     * @brief Add a key, or update its value if it is already in the map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param value Valid memory address to value.
+     * @return 0 on success, -1 on failure, 1 if the key is already in the map and it updated the value.
+     *
+     * @details Replicated maps update the copies one after the other and the first copy last, so value_free only sees values no other copy holds. A reader may see the new value on one node before another.
+     *
+     * @warning If a replicated add fails, the copies that were already updated keep the new value until the key is written again or removed.
+     */
+    int numa_map_add(NumaMap *map, const void *key, const void *value);
+
+    /**
+     * @brief Find a key and copy its value out, see concurrent_map_get.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @param value_out value_size bytes to copy the value into, may be NULL to only check for the key.
+     * @return 0 if the key was found, -1 if not.
+     */
+    int numa_map_get(NumaMap *map, const void *key, void *value_out);
+
+    /**
+     * @brief Remove a key from the map.
+     *
+     * @param map
+     * @param key Valid memory address to key.
+     * @return 0 on success, -1 if the key is not in the map.
+     *
+     * @details Replicated maps remove it from the first copy last, so key_free and value_free run once no other copy holds the key.
+     */
+    int numa_map_remove(NumaMap *map, const void *key);
+
+    /**
+     * @brief Number of entries in the map.
+     *
+     * @param map
+     * @return size_t
+     *
+     * @note Nodes are counted one after the other, concurrent adds and removes may or may not be included.
+     */
+    size_t numa_map_length(NumaMap *map);
+
+    /**
+     * @brief Call fn on every entry once, see concurrent_map_for_each.
+     *
+     * @param map
+     * @param fn Must not modify the map.
+     * @param context Passed to fn.
+     */
+    void numa_map_for_each(NumaMap *map, void (*fn)(const void *key, const void *value, void *context), void *context);
+
+    /**
+     * @brief Remove all elements from the map, one node at a time.
+     *
+     * @param map
+     */
+    void numa_map_clear(NumaMap *map);
+
+#ifdef __cplusplus
+} /* Extern "C" */
+#endif
+
+#endif /* _NUMA_MAP_H */
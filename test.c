@@ -1,8 +1,12 @@
 #include "map.h"
+#include "concurrent_map.h"
+#include "numa_map.h"
+#include "map_typed.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdatomic.h>
 #define CTF_TEST_NAMES
 #include "../Testing/ctf.h"
 
@@ -11,6 +15,11 @@ size_t int_hash(const void *key)
     return *(int *)key;
 }
 
+size_t seeded_int_hash(const void *key, uint64_t seed)
+{
+    return map_seeded_hash_bytes(key, sizeof(int), seed);
+}
+
 int int_cmp(const void *a, const void *b)
 {
     return *(int *)a - *(int *)b;
@@ -19,6 +28,8 @@ int int_cmp(const void *a, const void *b)
 TEST_MAKE(Map_Local_Value)
 {
     MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    /*  Keep the map from growing on its own so map_optimize has work to do. */
+    type.max_load_factor = 1000.0;
     Map *map = map_new(type, 10);
     TEST_ASSERT_LOG(map != NULL, "Failed to create map");
 
@@ -132,12 +143,1848 @@ TEST_MAKE(Heap_Int)
     TEST_PASS();
 }
 
+TEST_MAKE(Auto_Grow)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    Map *map = map_new(type, MAP_DEFAULT_BUCKETS_COUNT);
+    const int max = 100000;
+    int i;
+    for (i = 0; i < max; i++)
+    {
+        int value = i * 10;
+        int ret = map_add(map, &i, &value);
+        TEST_ASSERT_CLEAN_LOG(ret == 0, map_free(map), "Failed to add key %d, ret: %d", i, ret);
+    }
+    TEST_ASSERT_CLEAN_LOG(map->buckets_count > MAP_DEFAULT_BUCKETS_COUNT, map_free(map), "Map did not grow");
+    TEST_ASSERT_CLEAN_LOG(map_load_factor(map) <= MAP_DEFAULT_MAX_LOAD_FACTOR, map_free(map), "Load factor %f above max", map_load_factor(map));
+
+    /*  Iterating while a resize is in flight must still see every entry once. */
+    size_t seen = 0;
+    MAP_FOR_EACH(map, int, key, int, value)
+    {
+        TEST_ASSERT_CLEAN_LOG(*value == *key * 10, map_free(map), "Bad value for key %d", *key);
+        seen++;
+    }
+    TEST_ASSERT_CLEAN_LOG(seen == map->length, map_free(map), "Iterated %zu of %zu entries", seen, map->length);
+
+    for (i = 0; i < max; i += 2)
+    {
+        TEST_ASSERT_CLEAN_LOG(map_remove(map, &i) == 0, map_free(map), "Failed to remove key %d", i);
+    }
+    for (i = 0; i < max; i++)
+    {
+        int *value = (int *)map_get(map, &i);
+        if (i % 2 == 0)
+            TEST_ASSERT_CLEAN_LOG(value == NULL, map_free(map), "Key %d not removed", i);
+        else
+            TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i * 10, map_free(map), "Failed to retrieve key %d", i);
+    }
+    TEST_ASSERT_CLEAN_LOG(map->length == (size_t)max / 2, map_free(map), "Bad length %zu", map->length);
+    map_free(map);
+    TEST_PASS();
+}
+
+TEST_MAKE(Flat_Storage)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    type.storage = MAP_STORAGE_FLAT;
+    Map *map = map_new(type, MAP_DEFAULT_BUCKETS_COUNT);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+    const int max = 100000;
+    int i;
+    for (i = 0; i < max; i++)
+    {
+        int value = i * 10;
+        int ret = map_add(map, &i, &value);
+        TEST_ASSERT_CLEAN_LOG(ret == 0, map_free(map), "Failed to add key %d, ret: %d", i, ret);
+    }
+    i = 7;
+    int value = 70000;
+    TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &value) == 1, map_free(map), "Failed to update key");
+    TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &i) == 70000, map_free(map), "Updated value not stored");
+    TEST_ASSERT_CLEAN_LOG(map_load_factor(map) < 1.0, map_free(map), "Flat map overfilled");
+
+    /*  Remove and re-add to leave tombstones behind. */
+    for (i = 0; i < max; i += 2)
+    {
+        TEST_ASSERT_CLEAN_LOG(map_remove(map, &i) == 0, map_free(map), "Failed to remove key %d", i);
+    }
+    TEST_ASSERT_CLEAN_LOG(map_remove(map, &i) == -1, map_free(map), "Removed missing key %d", i);
+    for (i = 0; i < max; i++)
+    {
+        int *found = (int *)map_get(map, &i);
+        if (i % 2 == 0)
+            TEST_ASSERT_CLEAN_LOG(found == NULL, map_free(map), "Key %d not removed", i);
+        else
+            TEST_ASSERT_CLEAN_LOG(found != NULL && *found == (i == 7 ? 70000 : i * 10), map_free(map), "Failed to retrieve key %d", i);
+    }
+    for (i = max; i < 2 * max; i++)
+    {
+        int value = i * 10;
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &value) == 0, map_free(map), "Failed to re-add key %d", i);
+    }
+
+    size_t seen = 0;
+    MAP_FOR_EACH(map, int, key, int, entry)
+    {
+        TEST_ASSERT_CLEAN_LOG(map_get(map, key) == entry, map_free(map), "Iterated key %d not found", *key);
+        seen++;
+    }
+    TEST_ASSERT_CLEAN_LOG(seen == map->length && seen == (size_t)max + max / 2, map_free(map), "Iterated %zu of %zu entries", seen, map->length);
+
+    map_optimize(&map);
+    TEST_ASSERT_CLEAN_LOG(map->length == seen, map_free(map), "Optimize lost entries");
+    map_clear(map);
+    TEST_ASSERT_CLEAN_LOG(map->length == 0 && map_get(map, &i) == NULL, map_free(map), "Failed to clear map");
+    map_free(map);
+    TEST_PASS();
+}
+
+typedef struct
+{
+    char tag[3];
+} SmallKey;
+
+size_t small_key_hash(const void *key)
+{
+    const SmallKey *k = (const SmallKey *)key;
+    return (size_t)k->tag[0] * 65536 + (size_t)k->tag[1] * 256 + (size_t)k->tag[2];
+}
+
+int small_key_cmp(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(SmallKey));
+}
+
+TEST_MAKE(Inline_Entries)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_FLAT; storage++)
+    {
+        MapTypeData type = MAP_TYPE(SmallKey, double, small_key_hash, small_key_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 4);
+        int i;
+        TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+        TEST_ASSERT_CLEAN_LOG(map->value_offset % sizeof(double) == 0, map_free(map), "Value misaligned at offset %zu", map->value_offset);
+        for (i = 0; i < 5000; i++)
+        {
+            SmallKey key = {{(char)(i / 256), (char)(i % 256), 'k'}};
+            double value = i * 0.5;
+            TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &value) == 0, map_free(map), "Failed to add key %d", i);
+        }
+        for (i = 0; i < 5000; i += 3)
+        {
+            SmallKey key = {{(char)(i / 256), (char)(i % 256), 'k'}};
+            TEST_ASSERT_CLEAN_LOG(map_remove(map, &key) == 0, map_free(map), "Failed to remove key %d", i);
+        }
+        for (i = 0; i < 5000; i++)
+        {
+            SmallKey key = {{(char)(i / 256), (char)(i % 256), 'k'}};
+            double *value = (double *)map_get(map, &key);
+            if (i % 3 == 0)
+                TEST_ASSERT_CLEAN_LOG(value == NULL, map_free(map), "Key %d not removed", i);
+            else
+                TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i * 0.5, map_free(map), "Failed to retrieve key %d", i);
+        }
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+typedef struct
+{
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+} CountingAllocator;
+
+void *counting_alloc(void *context, size_t size)
+{
+    CountingAllocator *counter = (CountingAllocator *)context;
+    counter->allocs++;
+    counter->bytes += size;
+    return malloc(size);
+}
+
+void counting_free(void *context, void *ptr, size_t size)
+{
+    CountingAllocator *counter = (CountingAllocator *)context;
+    counter->frees++;
+    counter->bytes -= size;
+    free(ptr);
+}
+
+/*  Counts like CountingAllocator, but fails once left allocations have been handed out. */
+typedef struct
+{
+    CountingAllocator counter;
+    size_t left;
+} LimitedAllocator;
+
+void *limited_alloc(void *context, size_t size)
+{
+    LimitedAllocator *limited = (LimitedAllocator *)context;
+    if (limited->left == 0)
+        return NULL;
+    limited->left--;
+    return counting_alloc(&limited->counter, size);
+}
+
+TEST_MAKE(Allocators)
+{
+    CountingAllocator counter = {0, 0, 0};
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    type.allocator.alloc = counting_alloc;
+    type.allocator.free = counting_free;
+    type.allocator.context = &counter;
+    Map *map = map_new(type, 8);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+    int i;
+    for (i = 0; i < 10000; i++)
+    {
+        int value = i;
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &value) == 0, map_free(map), "Failed to add key %d", i);
+    }
+    /*  Removed nodes are reused, so churn must not allocate. */
+    size_t allocs = counter.allocs;
+    for (i = 0; i < 10000; i++)
+    {
+        int key = i + 10000, value = i;
+        map_remove(map, &i);
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &value) == 0, map_free(map), "Failed to add key %d", key);
+    }
+    TEST_ASSERT_CLEAN_LOG(counter.allocs - allocs < 8, map_free(map), "Churn allocated %zu times", counter.allocs - allocs);
+    map_free(map);
+    TEST_ASSERT_LOG(counter.allocs == counter.frees && counter.bytes == 0, "Leaked %zu allocations, %zu bytes", counter.allocs - counter.frees, counter.bytes);
+
+    /*  Arena backed maps are dropped with the arena. */
+    MapArena arena;
+    map_arena_init(&arena, 0);
+    type = MAP_TYPE(char *, int, map_default_hash_str, map_default_cmp_str, NULL, NULL);
+    type.allocator = map_arena_allocator(&arena);
+    int round;
+    for (round = 0; round < 3; round++)
+    {
+        char *keys[] = {"host", "accept", "cookie", "user-agent"};
+        map = map_new(type, 2);
+        TEST_ASSERT_CLEAN_LOG(map != NULL, map_arena_destroy(&arena), "Failed to create arena map");
+        for (i = 0; i < 4; i++)
+            map_add(map, &keys[i], &i);
+        TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &keys[2]) == 2, map_arena_destroy(&arena), "Failed to retrieve key");
+        map_free(map);
+        map_arena_destroy(&arena);
+    }
+
+    /*  Small maps are optimized by rebuilding them, a rebuild that runs out of memory keeps the old map and every boxed value in it. */
+    LimitedAllocator limited = {{0, 0, 0}, (size_t)-1};
+    type = MAP_BOXED_TYPE(int, int_hash, int_cmp, NULL);
+    type.flags = MAP_FLAG_SMALL;
+    type.allocator.alloc = limited_alloc;
+    type.allocator.free = counting_free;
+    type.allocator.context = &limited.counter;
+    map = map_new(type, 8);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create small map");
+    for (i = 0; i < 1000; i++)
+    {
+        int *box = (int *)malloc(sizeof(int));
+        *box = i;
+        TEST_ASSERT_CLEAN_LOG(map_add_take(map, &i, box) == 0, map_free(map), "Failed to add key %d", i);
+    }
+    size_t left;
+    for (left = 0; left < 64; left++)
+    {
+        Map *before = map;
+        limited.left = left;
+        map_optimize(&map);
+        TEST_ASSERT_CLEAN_LOG(map->length == 1000, map_free(map), "Optimize with %zu allocations left kept %zu keys", left, map->length);
+        for (i = 0; i < 1000; i++)
+        {
+            int **box = (int **)map_get(map, &i);
+            TEST_ASSERT_CLEAN_LOG(box != NULL && **box == i, map_free(map), "Optimize with %zu allocations left lost key %d", left, i);
+        }
+        if (map != before)
+            break;
+    }
+    TEST_ASSERT_CLEAN_LOG(left > 0 && left < 64, map_free(map), "Optimize never failed or never succeeded, %zu allocations", left);
+    limited.left = (size_t)-1;
+    map_free(map);
+    TEST_ASSERT_LOG(limited.counter.allocs == limited.counter.frees && limited.counter.bytes == 0, "Leaked %zu allocations, %zu bytes", limited.counter.allocs - limited.counter.frees, limited.counter.bytes);
+    TEST_PASS();
+}
+
+static size_t hash_calls = 0, cmp_calls = 0;
+
+size_t counting_int_hash(const void *key)
+{
+    hash_calls++;
+    return *(int *)key;
+}
+
+int counting_int_cmp(const void *a, const void *b)
+{
+    cmp_calls++;
+    return *(int *)a - *(int *)b;
+}
+
+TEST_MAKE(Cached_Hashes)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_FLAT; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, counting_int_hash, counting_int_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 1);
+        const int max = 20000;
+        int i;
+        hash_calls = 0;
+        for (i = 0; i < max; i++)
+            map_add(map, &i, &i);
+        /*  Growing reuses the cached hashes. */
+        TEST_ASSERT_CLEAN_LOG(hash_calls == (size_t)max, map_free(map), "Hashed %zu times for %d adds", hash_calls, max);
+        map_free(map);
+    }
+
+    /*  One bucket holding every key, only the matching hash may be compared. */
+    MapTypeData type = MAP_TYPE(int, int, counting_int_hash, counting_int_cmp, NULL, NULL);
+    type.max_load_factor = 1e9;
+    Map *map = map_new(type, 1);
+    int i;
+    for (i = 0; i < 1000; i++)
+        map_add(map, &i, &i);
+    cmp_calls = 0;
+    for (i = 0; i < 1000; i++)
+        TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &i) == i, map_free(map), "Failed to retrieve key %d", i);
+    TEST_ASSERT_CLEAN_LOG(cmp_calls == 1000, map_free(map), "Compared %zu times for 1000 lookups", cmp_calls);
+    map_free(map);
+    TEST_PASS();
+}
+
+TEST_MAKE(Pow2_Buckets)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    type.flags = MAP_FLAG_POW2;
+    Map *map = map_new(type, 1000);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+    TEST_ASSERT_CLEAN_LOG(map->buckets_count == 1024, map_free(map), "Bucket count %zu not rounded", map->buckets_count);
+
+    /*  Multiples of the bucket count all land in bucket 0 without the finalizer. */
+    int i;
+    for (i = 0; i < 700; i++)
+    {
+        int key = i * 1024;
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &i) == 0, map_free(map), "Failed to add key %d", key);
+    }
+    TEST_ASSERT_CLEAN_LOG(map_count_collisions(map) < 350, map_free(map), "Too many collisions: %zu", map_count_collisions(map));
+    for (i = 700; i < 5000; i++)
+    {
+        int key = i * 1024;
+        map_add(map, &key, &i);
+    }
+    TEST_ASSERT_CLEAN_LOG((map->buckets_count & (map->buckets_count - 1)) == 0, map_free(map), "Grew to %zu buckets", map->buckets_count);
+    for (i = 0; i < 5000; i++)
+    {
+        int key = i * 1024;
+        int *value = (int *)map_get(map, &key);
+        TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i, map_free(map), "Failed to retrieve key %d", key);
+    }
+    map_optimize(&map);
+    TEST_ASSERT_CLEAN_LOG((map->buckets_count & (map->buckets_count - 1)) == 0, map_free(map), "Optimized to %zu buckets", map->buckets_count);
+    map_free(map);
+    TEST_PASS();
+}
+
+TEST_MAKE(Fast_Hash_Str)
+{
+    char buffer[128];
+    char *str = buffer;
+    int i;
+    memset(buffer, 'x', sizeof(buffer));
+    /*  Every length takes a different path through the hash, they must all agree with map_hash_bytes and differ from each other. */
+    for (i = 0; i < 100; i++)
+    {
+        buffer[i] = '\0';
+        size_t hash = map_fast_hash_str(&str);
+        TEST_ASSERT_LOG(hash == map_hash_bytes(buffer, (size_t)i), "Length %d disagrees with map_hash_bytes", i);
+        buffer[i] = 'x';
+        TEST_ASSERT_LOG(hash != map_hash_bytes(buffer, (size_t)i + 1), "Lengths %d and %d collide", i, i + 1);
+    }
+
+    MapTypeData type = STR_MAP_TYPE;
+    type.flags = MAP_FLAG_POW2;
+    type.key_free = map_default_free_str;
+    type.max_load_factor = 1e9;
+    Map *map = map_new(type, 65536);
+    for (i = 0; i < 50000; i++)
+    {
+        char *key = malloc(16);
+        sprintf(key, "key%d", i);
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &i) == 0, map_free(map), "Failed to add key %s", key);
+    }
+    /*  About n - m(1 - e^(-n/m)) collisions are expected from a random hash, roughly 15000 here. */
+    TEST_ASSERT_CLEAN_LOG(map_count_collisions(map) < 16500, map_free(map), "Too many collisions: %zu", map_count_collisions(map));
+    map_free(map);
+    TEST_PASS();
+}
+
+static size_t constant_hash(const void *key)
+{
+    return 42;
+}
+
+TEST_MAKE(Stats)
+{
+    MapStats stats;
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_FLAT; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 1);
+        int i;
+        for (i = 0; i < 1000; i++)
+            map_add(map, &i, &i);
+        for (i = 0; i < 100; i++)
+            map_add(map, &i, &i);
+        for (i = 0; i < 1500; i++)
+            map_get(map, &i);
+        for (i = 0; i < 10; i++)
+            map_remove(map, &i);
+        if (map_stats(map, &stats) != 0)
+        {
+            /*  Built without MAP_STATS, nothing is counted. */
+            TEST_ASSERT_CLEAN_LOG(stats.lookups == 0 && stats.probe_total == 0, map_free(map), "Stats not zeroed");
+            map_free(map);
+            continue;
+        }
+        TEST_ASSERT_CLEAN_LOG(stats.inserts == 1000 && stats.updates == 100 && stats.removes == 10, map_free(map), "Counted %llu inserts, %llu updates, %llu removes",
+                              (unsigned long long)stats.inserts, (unsigned long long)stats.updates, (unsigned long long)stats.removes);
+        TEST_ASSERT_CLEAN_LOG(stats.lookups == 1500 && stats.hits == 1000 && stats.misses == 500, map_free(map), "Counted %llu lookups, %llu hits, %llu misses",
+                              (unsigned long long)stats.lookups, (unsigned long long)stats.hits, (unsigned long long)stats.misses);
+        TEST_ASSERT_CLEAN_LOG(stats.resizes > 0, map_free(map), "Growing was not counted");
+        uint64_t probes = 0;
+        for (i = 0; i < MAP_STATS_HISTOGRAM_SIZE; i++)
+            probes += stats.probe_histogram[i];
+        TEST_ASSERT_CLEAN_LOG(probes == 1000 + 100 + 1500 + 10, map_free(map), "Histogram holds %llu probes", (unsigned long long)probes);
+        TEST_ASSERT_CLEAN_LOG(stats.probe_max > 0 && stats.probe_total >= stats.probe_max, map_free(map), "Probe lengths not counted");
+        map_stats_reset(map);
+        map_stats(map, &stats);
+        TEST_ASSERT_CLEAN_LOG(stats.lookups == 0 && stats.probe_max == 0, map_free(map), "Reset left counters behind");
+        map_free(map);
+    }
+
+    /*  A hash that sends every key to one chain shows up in the tail of the histogram. */
+    MapTypeData type = MAP_TYPE(int, int, constant_hash, int_cmp, NULL, NULL);
+    Map *map = map_new(type, 16);
+    int i;
+    for (i = 0; i < 200; i++)
+        map_add(map, &i, &i);
+    if (map_stats(map, &stats) == 0)
+    {
+        TEST_ASSERT_CLEAN_LOG(stats.probe_max == 199, map_free(map), "Longest probe %llu", (unsigned long long)stats.probe_max);
+        TEST_ASSERT_CLEAN_LOG(stats.probe_histogram[8] == 72, map_free(map), "%llu probes of 128 to 255", (unsigned long long)stats.probe_histogram[8]);
+    }
+    map_free(map);
+    TEST_PASS();
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_KEYS 20000
+
+typedef struct
+{
+    ConcurrentMap *map;
+    int id;
+    int failures;
+} ConcurrentWorker;
+
+static void *concurrent_worker(void *arg)
+{
+    ConcurrentWorker *worker = (ConcurrentWorker *)arg;
+    int i, value, first = worker->id * CONCURRENT_KEYS;
+    for (i = first; i < first + CONCURRENT_KEYS; i++)
+    {
+        if (concurrent_map_add(worker->map, &i, &i) != 0)
+            worker->failures++;
+        /*  Keys of the other workers may or may not be there yet, but must never be wrong. */
+        int other = (i + CONCURRENT_KEYS) % (CONCURRENT_THREADS * CONCURRENT_KEYS);
+        if (concurrent_map_get(worker->map, &other, &value) == 0 && value != other)
+            worker->failures++;
+    }
+    for (i = first; i < first + CONCURRENT_KEYS; i++)
+    {
+        if (concurrent_map_get(worker->map, &i, &value) != 0 || value != i)
+            worker->failures++;
+        if (i % 2 == 0 && concurrent_map_remove(worker->map, &i) != 0)
+            worker->failures++;
+    }
+    return NULL;
+}
+
+static void concurrent_sum(const void *key, const void *value, void *context)
+{
+    *(long long *)context += *(const int *)value;
+}
+
+TEST_MAKE(Concurrent)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    ConcurrentMap *map = concurrent_map_new(type, 16, 6);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+    TEST_ASSERT_CLEAN_LOG(map->shards_count == 8, concurrent_map_free(map), "Shard count %zu not rounded", map->shards_count);
+
+    pthread_t threads[CONCURRENT_THREADS];
+    ConcurrentWorker workers[CONCURRENT_THREADS];
+    int i;
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        workers[i].map = map;
+        workers[i].id = i;
+        workers[i].failures = 0;
+        pthread_create(&threads[i], NULL, concurrent_worker, &workers[i]);
+    }
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_CLEAN_LOG(workers[i].failures == 0, concurrent_map_free(map), "Worker %d failed %d times", i, workers[i].failures);
+    }
+
+    const size_t expected = CONCURRENT_THREADS * CONCURRENT_KEYS / 2;
+    TEST_ASSERT_CLEAN_LOG(concurrent_map_length(map) == expected, concurrent_map_free(map), "Length %zu, expected %zu", concurrent_map_length(map), expected);
+    /*  Identity hashes still have to reach every shard. */
+    for (i = 0; i < (int)map->shards_count; i++)
+        TEST_ASSERT_CLEAN_LOG(map->shards[i].s.map->length > expected / map->shards_count / 2, concurrent_map_free(map), "Shard %d holds %zu keys", i, map->shards[i].s.map->length);
+
+    long long sum = 0, expected_sum = 0;
+    for (i = 1; i < CONCURRENT_THREADS * CONCURRENT_KEYS; i += 2)
+        expected_sum += i;
+    concurrent_map_for_each(map, concurrent_sum, &sum);
+    TEST_ASSERT_CLEAN_LOG(sum == expected_sum, concurrent_map_free(map), "Sum %lld, expected %lld", sum, expected_sum);
+
+    concurrent_map_optimize(map);
+    i = 1;
+    TEST_ASSERT_CLEAN_LOG(concurrent_map_get(map, &i, NULL) == 0, concurrent_map_free(map), "Lost key after optimize");
+    concurrent_map_clear(map);
+    TEST_ASSERT_CLEAN_LOG(concurrent_map_length(map) == 0, concurrent_map_free(map), "Clear left %zu keys", concurrent_map_length(map));
+    concurrent_map_free(map);
+    TEST_PASS();
+}
+
+typedef struct
+{
+    ConcurrentMap *map;
+    atomic_int *done;
+    int failures;
+    long long reads;
+} LockFreeReader;
+
+static void *lock_free_reader(void *arg)
+{
+    LockFreeReader *reader = (LockFreeReader *)arg;
+    ConcurrentMapReader *slot = concurrent_map_reader_new(reader->map);
+    int key = 0, value;
+    if (slot == NULL)
+    {
+        reader->failures++;
+        return NULL;
+    }
+    while (!atomic_load(reader->done))
+    {
+        /*  Values are always the key or its negation, anything else would be a torn or freed read. */
+        if (concurrent_map_read(reader->map, slot, &key, &value) == 0 && value != key && value != -key)
+            reader->failures++;
+        key = (key + 7) % CONCURRENT_KEYS;
+        reader->reads++;
+    }
+    concurrent_map_reader_free(reader->map, slot);
+    return NULL;
+}
+
+TEST_MAKE(Lock_Free_Reads)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    ConcurrentMap *map = concurrent_map_new_lock_free(type, 16, 4);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+
+    pthread_t threads[CONCURRENT_THREADS];
+    LockFreeReader readers[CONCURRENT_THREADS];
+    atomic_int done;
+    atomic_init(&done, 0);
+    int i, round;
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        readers[i].map = map;
+        readers[i].done = &done;
+        readers[i].failures = 0;
+        readers[i].reads = 0;
+        pthread_create(&threads[i], NULL, lock_free_reader, &readers[i]);
+    }
+    /*  Grow, update and shrink while the readers run. */
+    for (round = 0; round < 3; round++)
+    {
+        for (i = 0; i < CONCURRENT_KEYS; i++)
+            concurrent_map_add(map, &i, &i);
+        for (i = 0; i < CONCURRENT_KEYS; i++)
+        {
+            int value = -i;
+            concurrent_map_add(map, &i, &value);
+        }
+        for (i = 0; i < CONCURRENT_KEYS; i += 2)
+            concurrent_map_remove(map, &i);
+        concurrent_map_optimize(map);
+        if (round < 2)
+            concurrent_map_clear(map);
+    }
+    atomic_store(&done, 1);
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_CLEAN_LOG(readers[i].failures == 0, concurrent_map_free(map), "Reader %d failed %d times", i, readers[i].failures);
+    }
+
+    TEST_ASSERT_CLEAN_LOG(concurrent_map_length(map) == CONCURRENT_KEYS / 2, concurrent_map_free(map), "Length %zu", concurrent_map_length(map));
+    for (i = 0; i < CONCURRENT_KEYS; i++)
+    {
+        int value;
+        int found = concurrent_map_get(map, &i, &value) == 0;
+        TEST_ASSERT_CLEAN_LOG(found == (i % 2 == 1) && (!found || value == -i), concurrent_map_free(map), "Wrong entry for key %d", i);
+    }
+    long long sum = 0;
+    concurrent_map_for_each(map, concurrent_sum, &sum);
+    TEST_ASSERT_CLEAN_LOG(sum == -(long long)CONCURRENT_KEYS * CONCURRENT_KEYS / 4, concurrent_map_free(map), "Sum %lld", sum);
+    concurrent_map_free(map);
+
+    /*  Removed strings are only freed once, after the readers are gone. */
+    MapTypeData str_type = STR_MAP_TYPE;
+    str_type.key_free = map_default_free_str;
+    map = concurrent_map_new_lock_free(str_type, 0, 0);
+    for (i = 0; i < 1000; i++)
+    {
+        char *key = malloc(16);
+        sprintf(key, "key%d", i);
+        concurrent_map_add(map, &key, &i);
+    }
+    for (i = 0; i < 1000; i += 3)
+    {
+        char buffer[16], *key = buffer;
+        sprintf(buffer, "key%d", i);
+        TEST_ASSERT_CLEAN_LOG(concurrent_map_remove(map, &key) == 0, concurrent_map_free(map), "Failed to remove %s", key);
+    }
+    TEST_ASSERT_CLEAN_LOG(concurrent_map_length(map) == 666, concurrent_map_free(map), "Length %zu", concurrent_map_length(map));
+    concurrent_map_free(map);
+    TEST_PASS();
+}
+
+TEST_MAKE(Batches)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 1);
+        const int n = 1000;
+        int keys[1000], values[1000], i;
+        void *out[1000];
+        for (i = 0; i < n; i++)
+        {
+            /*  Every key shows up twice, the second add updates it. */
+            keys[i] = i % (n / 2);
+            values[i] = i;
+        }
+        TEST_ASSERT_CLEAN_LOG(map_add_batch(map, keys, values, n) == n / 2, map_free(map), "Batch did not add %d keys", n / 2);
+        TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n / 2, map_free(map), "Length %zu", map->length);
+        for (i = 0; i < n; i++)
+            keys[i] = i;
+        TEST_ASSERT_CLEAN_LOG(map_get_batch(map, keys, n, out) == (size_t)n / 2, map_free(map), "Batch did not find %d keys", n / 2);
+        for (i = 0; i < n; i++)
+        {
+            TEST_ASSERT_CLEAN_LOG(out[i] == map_get(map, &i), map_free(map), "Batch disagrees with map_get on key %d", i);
+            TEST_ASSERT_CLEAN_LOG(i >= n / 2 || *(int *)out[i] == i + n / 2, map_free(map), "Key %d was not updated", i);
+        }
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Parallel_Build)
+{
+    const int n = 200000;
+    int *keys = malloc(n * sizeof(int)), *values = malloc(n * sizeof(int)), i, variant;
+    TEST_ASSERT_LOG(keys != NULL && values != NULL, "Out of memory");
+    for (i = 0; i < n; i++)
+    {
+        /*  The last quarter repeats keys of the first, the later value has to win. */
+        keys[i] = i < n / 4 * 3 ? i : i - n / 4 * 3;
+        values[i] = i;
+    }
+    for (variant = 0; variant < 3; variant++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        if (variant == 1)
+            type.flags = MAP_FLAG_POW2;
+        if (variant == 2)
+            type.storage = MAP_STORAGE_FLAT;
+        Map *map = map_build_from_arrays(type, keys, values, n, 4);
+        TEST_ASSERT_CLEAN_LOG(map != NULL, free(keys); free(values), "Failed to build variant %d", variant);
+        TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n / 4 * 3, map_free(map); free(keys); free(values), "Variant %d holds %zu keys", variant, map->length);
+        for (i = 0; i < n / 4 * 3; i++)
+        {
+            int *value = (int *)map_get(map, &i);
+            int expected = i < n / 4 ? i + n / 4 * 3 : i;
+            TEST_ASSERT_CLEAN_LOG(value != NULL && *value == expected, map_free(map); free(keys); free(values), "Variant %d has the wrong value for key %d", variant, i);
+        }
+        /*  Nodes duplicates did not use are handed to later adds. */
+        for (i = n; i < n + 1000; i++)
+            TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &i) == 0, map_free(map); free(keys); free(values), "Failed to add key %d after building", i);
+        map_free(map);
+    }
+    free(keys);
+    free(values);
+
+    /*  Optimizing moves the strings into the new map, the old one must not free them. */
+    MapTypeData type = STR_MAP_TYPE;
+    type.key_free = map_default_free_str;
+    type.max_load_factor = 1e9;
+    Map *map = map_new(type, 16);
+    for (i = 0; i < 50000; i++)
+    {
+        char *key = malloc(16);
+        sprintf(key, "key%d", i);
+        map_add(map, &key, &i);
+    }
+    map_optimize_parallel(&map, 3);
+    TEST_ASSERT_CLEAN_LOG(map_load_factor(map) <= 0.75, map_free(map), "Load factor %f after optimize", map_load_factor(map));
+    for (i = 0; i < 50000; i++)
+    {
+        char buffer[16], *key = buffer;
+        sprintf(buffer, "key%d", i);
+        int *value = (int *)map_get(map, &key);
+        TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i, map_free(map), "Lost key %s", buffer);
+    }
+    map_free(map);
+    TEST_PASS();
+}
+
+/*  Whole file in a malloc'd buffer, NULL if it can not be read. */
+static byte *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    byte *data = length > 0 ? (byte *)malloc((size_t)length) : NULL;
+    if (data != NULL && fread(data, (size_t)length, 1, file) != 1)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = (size_t)length;
+    return data;
+}
+
+TEST_MAKE(Save_Mmap)
+{
+    const char *path = "map_test_save.bin";
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_FLAT; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, double, int_hash, int_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 16);
+        int i;
+        for (i = 0; i < 10000; i++)
+        {
+            double value = i * 0.5;
+            map_add(map, &i, &value);
+        }
+        for (i = 0; i < 10000; i += 10)
+            map_remove(map, &i);
+        TEST_ASSERT_CLEAN_LOG(map_save(map, path) == 0, map_free(map), "Failed to save storage %d", storage);
+        /*  Saving again gives the same bytes, nothing uninitialized reaches the file. */
+        size_t first_size = 0, second_size = 0;
+        byte *first = read_file(path, &first_size);
+        TEST_ASSERT_CLEAN_LOG(first != NULL && map_save(map, path) == 0, free(first); map_free(map), "Failed to save storage %d twice", storage);
+        byte *second = read_file(path, &second_size);
+        int same = second != NULL && first_size == second_size && memcmp(first, second, first_size) == 0;
+        free(first);
+        free(second);
+        TEST_ASSERT_CLEAN_LOG(same, map_free(map), "Two saves of storage %d differ", storage);
+        map_free(map);
+
+        /*  The type is what makes sense of the bytes, storage is always flat when opened. */
+        type.storage = MAP_STORAGE_CHAINED;
+        Map *opened = map_open_mmap(path, type);
+        TEST_ASSERT_CLEAN_LOG(opened != NULL, remove(path), "Failed to open storage %d", storage);
+        TEST_ASSERT_CLEAN_LOG(opened->length == 9000, map_free(opened); remove(path), "Opened %zu keys", opened->length);
+        /*  Padding and the slots that are not full are zeros, removed entries do not linger in the file. */
+        size_t slot_index, b;
+        for (slot_index = 0; slot_index < opened->buckets_count; slot_index++)
+        {
+            const byte *slot = opened->slots + slot_index * opened->entry_size;
+            int full = (opened->ctrl[slot_index] & 0x80) == 0;
+            for (b = 0; b < opened->entry_size; b++)
+            {
+                int field = b < sizeof(size_t) || (b >= opened->key_offset && b < opened->key_offset + sizeof(int)) || (b >= opened->value_offset && b < opened->value_offset + sizeof(double));
+                TEST_ASSERT_CLEAN_LOG((full && field) || slot[b] == 0, map_free(opened); remove(path), "Byte %zu of slot %zu is %d", b, slot_index, slot[b]);
+            }
+        }
+        for (i = 0; i < 11000; i++)
+        {
+            double *value = (double *)map_get(opened, &i);
+            int expected = i < 10000 && i % 10 != 0;
+            TEST_ASSERT_CLEAN_LOG((value != NULL) == expected && (value == NULL || *value == i * 0.5), map_free(opened); remove(path), "Wrong entry for key %d", i);
+        }
+        size_t count = 0;
+        MAP_FOR_EACH(opened, int, key, double, value)
+        {
+            count++;
+        }
+        TEST_ASSERT_CLEAN_LOG(count == 9000, map_free(opened); remove(path), "Iterated %zu entries", count);
+        double value = 1;
+        i = 1;
+        TEST_ASSERT_CLEAN_LOG(map_add(opened, &i, &value) == -1 && map_remove(opened, &i) == -1, map_free(opened); remove(path), "Wrote to a read-only map");
+        map_clear(opened);
+        TEST_ASSERT_CLEAN_LOG(map_get(opened, &i) != NULL, map_free(opened); remove(path), "Cleared a read-only map");
+
+        /*  Optimizing copies it into a normal map. */
+        map_optimize(&opened);
+        TEST_ASSERT_CLEAN_LOG(opened->mapped == NULL && map_add(opened, &i, &value) == 1, map_free(opened); remove(path), "Optimized map is still read-only");
+        map_free(opened);
+
+        MapTypeData wrong = MAP_TYPE(int, float, int_hash, int_cmp, NULL, NULL);
+        TEST_ASSERT_CLEAN_LOG(map_open_mmap(path, wrong) == NULL, remove(path), "Opened with the wrong value size");
+        wrong = MAP_TYPE(int, double, constant_hash, int_cmp, NULL, NULL);
+        TEST_ASSERT_CLEAN_LOG(map_open_mmap(path, wrong) == NULL, remove(path), "Opened with the wrong hash");
+    }
+    remove(path);
+    TEST_ASSERT_LOG(map_open_mmap(path, MAP_TYPE(int, double, int_hash, int_cmp, NULL, NULL)) == NULL, "Opened a missing file");
+    TEST_PASS();
+}
+
+static size_t typed_int_hash(const int *key)
+{
+    return (size_t)*key;
+}
+
+static int typed_int_eq(const int *a, const int *b)
+{
+    return *a == *b;
+}
+
+MAP_DECLARE(IntMap, int, int, typed_int_hash, typed_int_eq)
+
+TEST_MAKE(Typed_Maps)
+{
+    int layout;
+    for (layout = 0; layout < 5; layout++)
+    {
+        MapTypeData type = IntMap_type();
+        type.storage = layout == 2 ? MAP_STORAGE_FLAT : layout == 3 ? MAP_STORAGE_DENSE : MAP_STORAGE_CHAINED;
+        type.flags = layout == 1 ? MAP_FLAG_POW2 : layout == 4 ? MAP_FLAG_SMALL : 0;
+        Map *map = map_new(type, 1);
+        const int n = 1000;
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            TEST_ASSERT_CLEAN_LOG(IntMap_add(map, i, i * 2) == 0, map_free(map), "Failed to add %d", i);
+            /*  Chained maps are usually in the middle of growing here, old_buckets must be searched too. */
+            TEST_ASSERT_CLEAN_LOG(IntMap_get(map, i / 2) != NULL && *IntMap_get(map, i / 2) == i / 2 * 2, map_free(map), "Lost key %d after adding %d", i / 2, i);
+        }
+        TEST_ASSERT_CLEAN_LOG(IntMap_add(map, 7, -7) == 1, map_free(map), "Updating did not return 1");
+        TEST_ASSERT_CLEAN_LOG(*IntMap_get(map, 7) == -7, map_free(map), "Update was not stored");
+        for (i = 0; i < n; i++)
+            TEST_ASSERT_CLEAN_LOG(IntMap_get(map, i) == map_get(map, &i), map_free(map), "Typed get disagrees with map_get on %d", i);
+        TEST_ASSERT_CLEAN_LOG(!IntMap_contains(map, n), map_free(map), "Found a key that was never added");
+        {
+            int inserted;
+            TEST_ASSERT_CLEAN_LOG(*IntMap_get_or_insert(map, 8, &inserted) == 16 && !inserted, map_free(map), "get_or_insert missed key 8");
+            TEST_ASSERT_CLEAN_LOG(*IntMap_get_or_insert(map, n, &inserted) == 0 && inserted, map_free(map), "get_or_insert did not add %d", n);
+            TEST_ASSERT_CLEAN_LOG(IntMap_remove(map, n) == 0, map_free(map), "Failed to remove %d", n);
+        }
+        TEST_ASSERT_CLEAN_LOG(IntMap_remove(map, 7) == 0 && !IntMap_contains(map, 7), map_free(map), "Failed to remove 7");
+        TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n - 1, map_free(map), "Length %zu", map->length);
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Dense_Storage)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    type.storage = MAP_STORAGE_DENSE;
+    Map *map = map_new(type, 1);
+    const int n = 2000;
+    int i, seen[2000], count = 0, sum = 0;
+    for (i = 0; i < n; i++)
+    {
+        int value = i * 3;
+        TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &value) == 0, map_free(map), "Failed to add %d", i);
+    }
+    /*  Insertion order until something is removed. */
+    i = 0;
+    MAP_DENSE_FOR_EACH(map, int, key, int, value)
+    {
+        TEST_ASSERT_CLEAN_LOG(*key == i && *value == i * 3, map_free(map), "Entry %d holds key %d", i, *key);
+        i++;
+    }
+    /*  Leave one key in ten, every removal moves the last entry into the hole. */
+    for (i = 0; i < n; i++)
+    {
+        if (i % 10 != 0)
+            TEST_ASSERT_CLEAN_LOG(map_remove(map, &i) == 0, map_free(map), "Failed to remove %d", i);
+    }
+    TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n / 10, map_free(map), "Length %zu", map->length);
+    for (i = 0; i < n; i++)
+    {
+        int *value = (int *)map_get(map, &i);
+        TEST_ASSERT_CLEAN_LOG((i % 10 == 0) == (value != NULL), map_free(map), "Wrong presence of %d", i);
+        TEST_ASSERT_CLEAN_LOG(value == NULL || *value == i * 3, map_free(map), "Wrong value for %d", i);
+    }
+    memset(seen, 0, sizeof(seen));
+    MAP_FOR_EACH(map, int, key, int, value)
+    {
+        seen[*key]++;
+        count++;
+    }
+    TEST_ASSERT_CLEAN_LOG(count == n / 10, map_free(map), "MAP_FOR_EACH visited %d entries", count);
+    for (i = 0; i < n; i += 10)
+        TEST_ASSERT_CLEAN_LOG(seen[i] == 1, map_free(map), "Key %d visited %d times", i, seen[i]);
+    {
+        size_t idx;
+        MapNode *node;
+        int *key, *value;
+        MAP_DENSE_FOR_EACH_ANSI(map, idx, node, int, key, int, value)
+        {
+            sum += *value - *key * 3;
+            count--;
+        }
+    }
+    TEST_ASSERT_CLEAN_LOG(count == 0 && sum == 0, map_free(map), "MAP_DENSE_FOR_EACH_ANSI disagrees with MAP_FOR_EACH");
+    map_optimize(&map);
+    TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n / 10 && map->type.storage == MAP_STORAGE_DENSE, map_free(map), "Optimize lost entries");
+    i = 10;
+    TEST_ASSERT_CLEAN_LOG(map_get(map, &i) != NULL && *(int *)map_get(map, &i) == 30, map_free(map), "Optimize lost key 10");
+    map_clear(map);
+    TEST_ASSERT_CLEAN_LOG(map->length == 0 && map_get(map, &i) == NULL, map_free(map), "Clear left entries");
+    TEST_ASSERT_CLEAN_LOG(map_add(map, &i, &i) == 0, map_free(map), "Failed to add after clear");
+    map_free(map);
+    TEST_PASS();
+}
+
+static void upsert_count(void *value, int inserted, void *context)
+{
+    *(int *)value += inserted ? 100 : 1;
+    ++*(int *)context;
+}
+
+TEST_MAKE(Get_Or_Insert)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 1);
+        int i, inserted, calls = 0;
+        for (i = 0; i < 3000; i++)
+        {
+            int key = i % 1000;
+            int *count = (int *)map_get_or_insert(map, &key, &inserted);
+            TEST_ASSERT_CLEAN_LOG(count != NULL, map_free(map), "Failed to insert %d", key);
+            TEST_ASSERT_CLEAN_LOG(inserted == (i < 1000), map_free(map), "Key %d inserted %d on pass %d", key, inserted, i / 1000);
+            TEST_ASSERT_CLEAN_LOG(!inserted || *count == 0, map_free(map), "New value of %d not zeroed", key);
+            ++*count;
+        }
+        TEST_ASSERT_CLEAN_LOG(map->length == 1000, map_free(map), "Length %zu", map->length);
+        for (i = 0; i < 1000; i++)
+            TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &i) == 3, map_free(map), "Key %d counted %d times", i, *(int *)map_get(map, &i));
+
+        i = 5;
+        TEST_ASSERT_CLEAN_LOG(map_upsert_with(map, &i, upsert_count, &calls) == 1, map_free(map), "Upsert of an existing key did not return 1");
+        TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &i) == 4, map_free(map), "Upsert did not update in place");
+        i = 5000;
+        TEST_ASSERT_CLEAN_LOG(map_upsert_with(map, &i, upsert_count, &calls) == 0, map_free(map), "Upsert of a new key did not return 0");
+        TEST_ASSERT_CLEAN_LOG(*(int *)map_get(map, &i) == 100 && calls == 2, map_free(map), "Upsert of a new key did not start from 0");
+        TEST_ASSERT_CLEAN_LOG(map_get_or_insert(map, &i, NULL) == map_get(map, &i), map_free(map), "inserted must be optional");
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Precomputed_Hashes)
+{
+    Map *maps[4];
+    int m, i;
+    for (m = 0; m < 4; m++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, counting_int_hash, int_cmp, NULL, NULL);
+        type.storage = m == 2 ? MAP_STORAGE_FLAT : m == 3 ? MAP_STORAGE_DENSE : MAP_STORAGE_CHAINED;
+        type.flags = m == 1 ? MAP_FLAG_POW2 : 0;
+        maps[m] = map_new(type, 1);
+    }
+#define PRECOMPUTED_HASHES_FREE() for (m = 0; m < 4; m++) map_free(maps[m])
+    hash_calls = 0;
+    /*  One hash per key feeds every layout. */
+    for (i = 0; i < 1000; i++)
+    {
+        size_t hash = map_hash(maps[0], &i);
+        for (m = 0; m < 4; m++)
+            TEST_ASSERT_CLEAN_LOG(map_add_hashed(maps[m], hash, &i, &i) == 0, PRECOMPUTED_HASHES_FREE(), "Failed to add %d to map %d", i, m);
+        for (m = 0; m < 4; m++)
+            TEST_ASSERT_CLEAN_LOG(map_get_hashed(maps[m], hash, &i) != NULL, PRECOMPUTED_HASHES_FREE(), "Map %d lost %d", m, i);
+    }
+    TEST_ASSERT_CLEAN_LOG(hash_calls == 1000, PRECOMPUTED_HASHES_FREE(), "key_hash called %zu times", hash_calls);
+    /*  Hashed and plain calls must agree on where keys live. */
+    for (m = 0; m < 4; m++)
+    {
+        for (i = 0; i < 1000; i++)
+            TEST_ASSERT_CLEAN_LOG(map_get(maps[m], &i) == map_get_hashed(maps[m], map_hash(maps[m], &i), &i), PRECOMPUTED_HASHES_FREE(), "Map %d disagrees on %d", m, i);
+        for (i = 0; i < 1000; i += 2)
+            TEST_ASSERT_CLEAN_LOG(map_remove_hashed(maps[m], map_hash(maps[m], &i), &i) == 0, PRECOMPUTED_HASHES_FREE(), "Map %d failed to remove %d", m, i);
+        i = 0;
+        TEST_ASSERT_CLEAN_LOG(map_get(maps[m], &i) == NULL && maps[m]->length == 500, PRECOMPUTED_HASHES_FREE(), "Map %d kept removed keys", m);
+    }
+    PRECOMPUTED_HASHES_FREE();
+#undef PRECOMPUTED_HASHES_FREE
+    TEST_PASS();
+}
+
+TEST_MAKE(Small_Maps)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_FLAT; storage++)
+    {
+        MapTypeData type = MAP_TYPE(char *, int, map_fast_hash_str, map_default_cmp_str, map_deref_free, NULL);
+        type.storage = storage;
+        type.flags = MAP_FLAG_SMALL;
+        Map *map = map_new(type, 1);
+        char name[16];
+        int i;
+        TEST_ASSERT_CLEAN_LOG(map != NULL && map->small_hashes != NULL && map->buckets == NULL && map->ctrl == NULL, map_free(map), "Small map allocated a table");
+        for (i = 0; i < MAP_SMALL_CAPACITY; i++)
+        {
+            char *key = malloc(16);
+            sprintf(key, "attr%d", i);
+            TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &i) == 0, map_free(map), "Failed to add %s", key);
+        }
+        TEST_ASSERT_CLEAN_LOG(map->small_hashes != NULL, map_free(map), "Promoted before it was full");
+        /*  Swap-remove one, then look everything up through a second copy of each string. */
+        char *lookup = name;
+        sprintf(name, "attr%d", 2);
+        TEST_ASSERT_CLEAN_LOG(map_remove(map, &lookup) == 0 && map_get(map, &lookup) == NULL, map_free(map), "Failed to remove attr2");
+        for (i = 0; i < MAP_SMALL_CAPACITY; i++)
+        {
+            sprintf(name, "attr%d", i);
+            int *value = (int *)map_get(map, &lookup);
+            TEST_ASSERT_CLEAN_LOG(i == 2 ? value == NULL : value != NULL && *value == i, map_free(map), "Wrong value for %s", name);
+        }
+        size_t seen = 0;
+        MAP_FOR_EACH(map, char *, key, int, value)
+        {
+            seen++;
+        }
+        TEST_ASSERT_CLEAN_LOG(seen == map->length && seen == MAP_SMALL_CAPACITY - 1, map_free(map), "Iterated %zu entries", seen);
+        /*  Growing past the array moves every entry into the real table. */
+        for (i = MAP_SMALL_CAPACITY; i < 100; i++)
+        {
+            char *key = malloc(16);
+            sprintf(key, "attr%d", i);
+            TEST_ASSERT_CLEAN_LOG(map_add(map, &key, &i) == 0, map_free(map), "Failed to add %s", key);
+        }
+        TEST_ASSERT_CLEAN_LOG(map->small_hashes == NULL && map->length == 99, map_free(map), "Did not grow out of the small array");
+        for (i = 0; i < 100; i++)
+        {
+            sprintf(name, "attr%d", i);
+            int *value = (int *)map_get(map, &lookup);
+            TEST_ASSERT_CLEAN_LOG(i == 2 ? value == NULL : value != NULL && *value == i, map_free(map), "Lost %s after growing", name);
+        }
+        map_free(map);
+    }
+    {
+        /*  Optimizing a map that shrank puts it back into the small array. */
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.flags = MAP_FLAG_SMALL;
+        Map *map = map_new(type, 0);
+        int i;
+        for (i = 0; i < 50; i++)
+            map_add(map, &i, &i);
+        for (i = 3; i < 50; i++)
+            map_remove(map, &i);
+        map_optimize(&map);
+        TEST_ASSERT_CLEAN_LOG(map->small_hashes != NULL && map->length == 3, map_free(map), "Optimize did not return to the small array");
+        map_clear(map);
+        TEST_ASSERT_CLEAN_LOG(map->length == 0 && map_get(map, &i) == NULL, map_free(map), "Clear left entries");
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(String_Keys)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE + 1; storage++)
+    {
+        MapTypeData type = MAP_STR_TYPE(int);
+        /*  One past dense is a small chained map. */
+        type.storage = storage > MAP_STORAGE_DENSE ? MAP_STORAGE_CHAINED : storage;
+        type.flags = storage > MAP_STORAGE_DENSE ? MAP_FLAG_SMALL : 0;
+        Map *map = map_new(type, 0);
+        char name[64];
+        int i;
+        TEST_ASSERT_LOG(map != NULL, "Failed to create string map");
+        /*  The buffer is reused for every key, the map has to keep its own bytes. */
+        for (i = 0; i < 200; i++)
+        {
+            sprintf(name, i % 2 ? "k%d" : "a-much-longer-header-name-%d", i);
+            TEST_ASSERT_CLEAN_LOG(map_str_add(map, name, strlen(name), &i) == 0, map_free(map), "Failed to add %s", name);
+        }
+        i = -1;
+        TEST_ASSERT_CLEAN_LOG(map_str_add(map, "k1", 2, &i) == 1 && *(int *)map_str_get(map, "k1", 2) == -1, map_free(map), "Failed to update k1");
+        /*  Same prefix and length, different tail. */
+        TEST_ASSERT_CLEAN_LOG(map_str_get(map, "a-much-longer-header-name-x", 27) == NULL, map_free(map), "Matched on the prefix only");
+        TEST_ASSERT_CLEAN_LOG(map_str_remove(map, "a-much-longer-header-name-0", 27) == 0, map_free(map), "Failed to remove a long key");
+        map_optimize(&map);
+        for (i = 1; i < 200; i++)
+        {
+            sprintf(name, i % 2 ? "k%d" : "a-much-longer-header-name-%d", i);
+            int *value = (int *)map_str_get(map, name, strlen(name));
+            TEST_ASSERT_CLEAN_LOG(value != NULL && *value == (i == 1 ? -1 : i), map_free(map), "Lost %s", name);
+        }
+        MAP_FOR_EACH(map, MapStr, key, int, value)
+        {
+            TEST_ASSERT_CLEAN_LOG(strlen(map_str_chars(key)) == key->length, map_free(map), "Key bytes are not terminated");
+        }
+        map_free(map);
+    }
+    {
+        MapInterner interner;
+        TEST_ASSERT_LOG(map_interner_init(&interner) == 0, "Failed to create interner");
+        size_t a = map_intern(&interner, "content-type", 12);
+        size_t b = map_intern(&interner, "host", 4);
+        char copy[] = "content-type";
+        TEST_ASSERT_CLEAN_LOG(a == 0 && b == 1 && map_intern(&interner, copy, 12) == a, map_interner_destroy(&interner), "Repeated string got a new id");
+        TEST_ASSERT_CLEAN_LOG(map_interner_find(&interner, "host", 4) == b && map_interner_find(&interner, "accept", 6) == MAP_INTERN_NONE, map_interner_destroy(&interner), "Wrong find result");
+        /*  Interned strings stay put while the table grows. */
+        const char *host = map_interned(&interner, b);
+        char name[32];
+        int i;
+        for (i = 0; i < 500; i++)
+        {
+            sprintf(name, "header-%d", i);
+            map_intern(&interner, name, strlen(name));
+        }
+        TEST_ASSERT_CLEAN_LOG(map_interned(&interner, b) == host && strcmp(host, "host") == 0 && strcmp(map_interned(&interner, a), "content-type") == 0, map_interner_destroy(&interner), "Interned string moved");
+        TEST_ASSERT_CLEAN_LOG(interner.count == 502 && map_interned(&interner, 502) == NULL, map_interner_destroy(&interner), "Wrong interned count");
+        map_interner_destroy(&interner);
+    }
+    TEST_PASS();
+}
+
+static int remove_if_odd(const void *key, void *value, void *context)
+{
+    ++*(int *)context;
+    return *(const int *)key % 2 != 0;
+}
+
+static int remove_if_freed;
+
+static void remove_if_count_free(void *ptr)
+{
+    remove_if_freed++;
+}
+
+TEST_MAKE(Remove_If_Clear)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE + 1; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        /*  One past dense is a small chained map. */
+        type.storage = storage > MAP_STORAGE_DENSE ? MAP_STORAGE_CHAINED : storage;
+        type.flags = storage > MAP_STORAGE_DENSE ? MAP_FLAG_SMALL : 0;
+        Map *map = map_new(type, 0);
+        int i, calls = 0, n = storage > MAP_STORAGE_DENSE ? MAP_SMALL_CAPACITY : 1000;
+        for (i = 0; i < n; i++)
+            map_add(map, &i, &i);
+        TEST_ASSERT_CLEAN_LOG(map_remove_if(map, remove_if_odd, &calls) == (size_t)n / 2 && calls == n, map_free(map), "Removed the wrong number of entries");
+        TEST_ASSERT_CLEAN_LOG(map->length == (size_t)n / 2, map_free(map), "Length is %zu", map->length);
+        for (i = 0; i < n; i++)
+        {
+            int *value = (int *)map_get(map, &i);
+            TEST_ASSERT_CLEAN_LOG(i % 2 ? value == NULL : value != NULL && *value == i, map_free(map), "Wrong entry for %d", i);
+        }
+        size_t seen = 0;
+        MAP_FOR_EACH(map, int, key, int, value)
+        {
+            seen++;
+        }
+        TEST_ASSERT_CLEAN_LOG(seen == map->length, map_free(map), "Iterated %zu entries", seen);
+        /*  Nothing to free, so clear only resets the table and the same nodes are used again. */
+        map_clear(map);
+        TEST_ASSERT_CLEAN_LOG(map->length == 0 && map->pool.slabs == NULL, map_free(map), "Clear kept entries");
+        for (i = 0; i < n; i++)
+            map_add(map, &i, &i);
+        for (i = 0; i < n; i++)
+        {
+            int *value = (int *)map_get(map, &i);
+            TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i, map_free(map), "Lost %d after clear", i);
+        }
+        map_free(map);
+    }
+    {
+        /*  Free callbacks still run for removed entries and for clear. */
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, remove_if_count_free);
+        Map *map = map_new(type, 4);
+        int i, calls = 0;
+        for (i = 0; i < 100; i++)
+            map_add(map, &i, &i);
+        remove_if_freed = 0;
+        map_remove_if(map, remove_if_odd, &calls);
+        TEST_ASSERT_CLEAN_LOG(remove_if_freed == 50, map_free(map), "Freed %d values", remove_if_freed);
+        map_clear(map);
+        TEST_ASSERT_CLEAN_LOG(remove_if_freed == 100 && map->length == 0, map_free(map), "Clear freed %d values", remove_if_freed);
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+static int reserve_keep_few(const void *key, void *value, void *context)
+{
+    return *(const int *)key >= 10;
+}
+
+TEST_MAKE(Reserve_Shrink)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE + 1; storage++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        /*  One past dense is a small chained map. */
+        type.storage = storage > MAP_STORAGE_DENSE ? MAP_STORAGE_CHAINED : storage;
+        type.flags = storage > MAP_STORAGE_DENSE ? MAP_FLAG_SMALL : 0;
+        Map *map = map_new(type, 1);
+        int i;
+        for (i = 0; i < 5; i++)
+            map_add(map, &i, &i);
+        TEST_ASSERT_CLEAN_LOG(map_reserve(map, 10000) == 0, map_free(map), "Failed to reserve");
+        size_t buckets_count = map->buckets_count;
+        for (i = 0; i < 10000; i++)
+            map_add(map, &i, &i);
+        TEST_ASSERT_CLEAN_LOG(map->buckets_count == buckets_count && map->old_buckets == NULL && map->length == 10000, map_free(map), "Grew after reserving");
+        TEST_ASSERT_CLEAN_LOG(storage != MAP_STORAGE_DENSE || map->entries_capacity == 10000, map_free(map), "Dense entries grew after reserving");
+
+        MapMemoryUsage before, after;
+        map_memory_usage(map, &before);
+        TEST_ASSERT_CLEAN_LOG(before.payload == 10000 * 2 * sizeof(int) && before.total > before.table + before.nodes && before.table + before.nodes > before.payload, map_free(map), "Odd memory usage");
+        map_remove_if(map, reserve_keep_few, NULL);
+        TEST_ASSERT_CLEAN_LOG(map_shrink_to_fit(map) == 0, map_free(map), "Failed to shrink");
+        map_memory_usage(map, &after);
+        TEST_ASSERT_CLEAN_LOG(after.total < before.total / 10 && map->buckets_count < buckets_count, map_free(map), "Shrinking kept %zu of %zu bytes", after.total, before.total);
+        for (i = 0; i < 100; i++)
+        {
+            int *value = (int *)map_get(map, &i);
+            TEST_ASSERT_CLEAN_LOG(i >= 10 ? value == NULL : value != NULL && *value == i, map_free(map), "Wrong entry for %d after shrinking", i);
+        }
+        for (i = 10; i < 1000; i++)
+            map_add(map, &i, &i);
+        TEST_ASSERT_CLEAN_LOG(map->length == 1000 && *(int *)map_get(map, &(int){999}) == 999, map_free(map), "Failed to grow again");
+        map_clear(map);
+        TEST_ASSERT_CLEAN_LOG(map_shrink_to_fit(map) == 0 && map->pool.slabs == NULL && map->pool.spare_slabs == NULL, map_free(map), "Empty map kept its nodes");
+        map_free(map);
+    }
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.flags = MAP_FLAG_SMALL;
+        Map *map = map_new(type, 0);
+        size_t small = map_memory_usage(map, NULL);
+        TEST_ASSERT_CLEAN_LOG(map_reserve(map, MAP_SMALL_CAPACITY) == 0 && map->small_hashes != NULL, map_free(map), "Reserving what fits left the small array");
+        TEST_ASSERT_CLEAN_LOG(map_reserve(map, 100) == 0 && map->small_hashes == NULL && map_memory_usage(map, NULL) > small, map_free(map), "Reserving more kept the small array");
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Seeded_Hashes)
+{
+    const char *path = "map_test_seeded.bin";
+    char *key = "client-supplied";
+    Map *a = map_new(SEEDED_STR_MAP_TYPE, 0);
+    Map *b = map_new(SEEDED_STR_MAP_TYPE, 0);
+    TEST_ASSERT_CLEAN_LOG(a->type.seed != 0 && a->type.seed != b->type.seed && map_hash(a, &key) != map_hash(b, &key), map_free(a); map_free(b), "Maps share a seed");
+    map_free(b);
+    MapTypeData fixed = SEEDED_STR_MAP_TYPE;
+    fixed.seed = 42;
+    b = map_new(fixed, 0);
+    Map *c = map_new(fixed, 0);
+    TEST_ASSERT_CLEAN_LOG(b->type.seed == 42 && map_hash(b, &key) == map_hash(c, &key) && map_hash(b, &key) == map_seeded_hash_str(&key, 42), map_free(a); map_free(b); map_free(c), "Fixed seed was not used");
+    map_free(b);
+    map_free(c);
+
+    /*  Copies keep the seed, the cached hashes stay valid. */
+    MapTypeData type = MAP_TYPE_SEEDED(int, int, seeded_int_hash, int_cmp, NULL, NULL);
+    type.storage = MAP_STORAGE_FLAT;
+    Map *map = map_new(type, 0);
+    uint64_t seed = map->type.seed;
+    int i;
+    for (i = 0; i < 5000; i++)
+        map_add(map, &i, &i);
+    map_optimize(&map);
+    TEST_ASSERT_CLEAN_LOG(map->type.seed == seed, map_free(a); map_free(map), "Optimizing changed the seed");
+    TEST_ASSERT_CLEAN_LOG(map_save(map, path) == 0, map_free(a); map_free(map), "Failed to save");
+    map_free(map);
+    type.storage = MAP_STORAGE_CHAINED;
+    Map *opened = map_open_mmap(path, type);
+    TEST_ASSERT_CLEAN_LOG(opened != NULL && opened->type.seed == seed, map_free(a); remove(path), "Saved seed was not restored");
+    for (i = 0; i < 5000; i++)
+    {
+        int *value = (int *)map_get(opened, &i);
+        TEST_ASSERT_CLEAN_LOG(value != NULL && *value == i, map_free(a); map_free(opened); remove(path), "Lost %d after reopening", i);
+    }
+    map_free(opened);
+    remove(path);
+
+    /*  MapStr maps are seeded too. */
+    Map *strings = map_new(MAP_STR_TYPE(int), 0);
+    TEST_ASSERT_CLEAN_LOG(strings->type.seed != 0, map_free(a); map_free(strings), "String map is not seeded");
+    map_free(strings);
+    map_free(a);
+    TEST_PASS();
+}
+
+static int multi_freed;
+
+static void multi_count_free(void *ptr)
+{
+    multi_freed++;
+}
+
+TEST_MAKE(Multi_And_Counter)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        MapMulti multi;
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, multi_count_free);
+        type.storage = storage;
+        TEST_ASSERT_LOG(map_multi_init(&multi, type, 0) == 0, "Failed to create multimap");
+        int i, j;
+        /*  Key i gets the values i * 100 up to i * 100 + i, so key 0 has one value and key 99 a hundred. */
+        for (j = 0; j < 100; j++)
+        {
+            for (i = j; i < 100; i++)
+            {
+                int value = i * 100 + j;
+                TEST_ASSERT_CLEAN_LOG(map_multi_add(&multi, &i, &value) == (j == 0 ? 0 : 1), map_multi_destroy(&multi), "Wrong add result for %d", i);
+            }
+        }
+        TEST_ASSERT_CLEAN_LOG(multi.map->length == 100, map_multi_destroy(&multi), "Multimap has %zu keys", multi.map->length);
+        for (i = 0; i < 100; i++)
+        {
+            MapSpan span = map_get_all(&multi, &i);
+            TEST_ASSERT_CLEAN_LOG(span.count == (size_t)i + 1, map_multi_destroy(&multi), "Key %d has %zu values", i, span.count);
+            for (j = 0; j <= i; j++)
+                TEST_ASSERT_CLEAN_LOG(((int *)span.values)[j] == i * 100 + j, map_multi_destroy(&multi), "Values of %d out of order", i);
+        }
+        i = 1000;
+        TEST_ASSERT_CLEAN_LOG(map_get_all(&multi, &i).count == 0 && map_get_all(&multi, &i).values == NULL, map_multi_destroy(&multi), "Missing key has values");
+        multi_freed = 0;
+        i = 99;
+        TEST_ASSERT_CLEAN_LOG(map_multi_remove(&multi, &i) == 0 && multi_freed == 100 && map_get_all(&multi, &i).count == 0, map_multi_destroy(&multi), "Failed to remove key 99");
+        map_multi_destroy(&multi);
+        TEST_ASSERT_LOG(multi_freed == 100 + 99 * 100 / 2, "Destroy freed %d values", multi_freed);
+    }
+    {
+        Map *counts = map_new(MAP_COUNTER_TYPE(int, int_hash, int_cmp), 0);
+        int i;
+        for (i = 0; i < 10000; i++)
+        {
+            int key = i % 100;
+            map_counter_add(counts, &key, 1);
+        }
+        i = 42;
+        TEST_ASSERT_CLEAN_LOG(map_counter_get(counts, &i) == 100 && map_counter_add(counts, &i, 5) == 105, map_free(counts), "Wrong count for 42");
+        TEST_ASSERT_CLEAN_LOG(map_counter_add_atomic(counts, &i, 1) == 0 && map_counter_get(counts, &i) == 106, map_free(counts), "Atomic add failed");
+        i = 100;
+        TEST_ASSERT_CLEAN_LOG(map_counter_add_atomic(counts, &i, 1) == -1 && map_counter_get(counts, &i) == 0 && counts->length == 100, map_free(counts), "Atomic add inserted a key");
+        map_free(counts);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Set_Mode)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        MapTypeData type = MAP_SET_TYPE(int, int_hash, int_cmp, NULL), other_type = type, pair_type = MAP_TYPE(int, size_t, int_hash, int_cmp, NULL, NULL);
+        type.storage = storage;
+        pair_type.storage = storage;
+        /*  Evens in a map of the next storage, so both the cached hash and the rehash paths run. */
+        other_type.storage = (storage + 1) % 3;
+        Map *set = map_new(type, 0), *evens = map_new(other_type, 0), *same = map_new(type, 0), *pairs = map_new(pair_type, 0);
+        int i;
+        TEST_ASSERT_CLEAN_LOG(set->type.value_size == 0 && set->entry_size < pairs->entry_size, (map_free(set), map_free(evens), map_free(same), map_free(pairs)), "Set entries store a value");
+        map_free(pairs);
+        for (i = 0; i < 1000; i++)
+        {
+            TEST_ASSERT_CLEAN_LOG(map_insert_key(set, &i) == 0, (map_free(set), map_free(evens), map_free(same)), "Failed to add %d", i);
+            int even = 2 * i;
+            map_insert_key(evens, &even);
+            if (i % 3 == 0)
+                map_insert_key(same, &i);
+        }
+        i = 10;
+        TEST_ASSERT_CLEAN_LOG(map_insert_key(set, &i) == 1 && map_contains(set, &i) && set->length == 1000, (map_free(set), map_free(evens), map_free(same)), "Duplicate key added");
+        i = 1000;
+        TEST_ASSERT_CLEAN_LOG(!map_contains(set, &i), (map_free(set), map_free(evens), map_free(same)), "Contains a missing key");
+
+        TEST_ASSERT_CLEAN_LOG(map_union(same, evens) == 0 && same->length == 1000 + 167, (map_free(set), map_free(evens), map_free(same)), "Union has %zu keys", same->length);
+        TEST_ASSERT_CLEAN_LOG(map_intersect(same, set) == 1000 - 500 && same->length == 667, (map_free(set), map_free(evens), map_free(same)), "Intersection has %zu keys", same->length);
+        for (i = 0; i < 1000; i++)
+            TEST_ASSERT_CLEAN_LOG(map_contains(same, &i) == (i % 2 == 0 || i % 3 == 0), (map_free(set), map_free(evens), map_free(same)), "Wrong membership of %d", i);
+        TEST_ASSERT_CLEAN_LOG(map_difference(set, evens) == 500 && set->length == 500, (map_free(set), map_free(evens), map_free(same)), "Difference has %zu keys", set->length);
+        for (i = 0; i < 1000; i++)
+            TEST_ASSERT_CLEAN_LOG(map_contains(set, &i) == (i % 2 == 1), (map_free(set), map_free(evens), map_free(same)), "Wrong membership of %d", i);
+        TEST_ASSERT_CLEAN_LOG(map_intersect(set, set) == 0 && map_difference(set, set) == 500 && set->length == 0, (map_free(set), map_free(evens), map_free(same)), "Self operations failed");
+        map_free(set);
+        map_free(evens);
+        map_free(same);
+    }
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.flags = MAP_FLAG_SMALL;
+        Map *small = map_new(type, 0), *big = map_new(MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL), 0);
+        int i;
+        for (i = 0; i < 4; i++)
+        {
+            int value = i * 10;
+            map_add(small, &i, &value);
+        }
+        for (i = 2; i < 100; i++)
+        {
+            int value = -i;
+            map_add(big, &i, &value);
+        }
+        TEST_ASSERT_CLEAN_LOG(map_intersect(small, big) == 2 && small->length == 2, (map_free(small), map_free(big)), "Small intersection has %zu keys", small->length);
+        TEST_ASSERT_CLEAN_LOG(map_union(big, small) == 0 && big->length == 98, (map_free(small), map_free(big)), "Union added keys");
+        i = 0;
+        map_add(small, &i, &(int){7});
+        TEST_ASSERT_CLEAN_LOG(map_union(big, small) == 0 && *(int *)map_get(big, &i) == 7, (map_free(small), map_free(big)), "Union lost the value");
+        i = 2;
+        TEST_ASSERT_CLEAN_LOG(*(int *)map_get(big, &i) == -2, (map_free(small), map_free(big)), "Union overwrote a value");
+        map_free(small);
+        map_free(big);
+    }
+    TEST_PASS();
+}
+
+static size_t collide_hash(const void *key)
+{
+    return 42;
+}
+
+/* Scans the rest of a cursor's range in batches of 7, counting every key in seen. */
+static size_t cursor_scan(Map *map, MapCursor *cursor, unsigned char *seen)
+{
+    MapNode *batch[7];
+    size_t n, i, total = 0;
+    while ((n = map_scan(map, cursor, batch, 7)) > 0)
+    {
+        for (i = 0; i < n; i++)
+            seen[*(int *)map_iter_key(map, batch[i])]++;
+        total += n;
+    }
+    return total;
+}
+
+TEST_MAKE(Cursors)
+{
+    static unsigned char seen[5000];
+    int variant;
+    /*  Chained, flat and dense maps, then chained with every key in one chain, then a small map. */
+    for (variant = 0; variant < 5; variant++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, variant == 3 ? collide_hash : int_hash, int_cmp, NULL, NULL);
+        type.storage = variant < 3 ? variant : MAP_STORAGE_CHAINED;
+        type.flags = variant == 4 ? MAP_FLAG_SMALL : 0;
+        int keys = variant == 3 ? 100 : variant == 4 ? 5 : 5000, i;
+        Map *map = map_new(type, 0);
+        MapCursor cursors[4], cursor;
+        size_t total = 0, c;
+        for (i = 0; i < keys; i++)
+            map_add(map, &i, &i);
+        memset(seen, 0, sizeof(seen));
+        TEST_ASSERT_CLEAN_LOG(map_cursor_split(map, cursors, 4) == 0, map_free(map), "Failed to split");
+        for (c = 0; c < 4; c++)
+            total += cursor_scan(map, &cursors[c], seen);
+        TEST_ASSERT_CLEAN_LOG(total == (size_t)keys, map_free(map), "Cursors returned %zu of %d keys", total, keys);
+        for (i = 0; i < keys; i++)
+            TEST_ASSERT_CLEAN_LOG(seen[i] == 1, map_free(map), "Key %d seen %d times in variant %d", i, seen[i], variant);
+
+        /*  Removing every odd key between batches moves dense entries, each even key must still come once. Small maps go stale, the long chain is split over batches. */
+        MapNode *batch[7];
+        memset(seen, 0, sizeof(seen));
+        map_cursor_split(map, &cursor, 1);
+        size_t n = map_scan(map, &cursor, batch, 7);
+        for (c = 0; c < n; c++)
+            seen[*(int *)map_iter_key(map, batch[c])]++;
+        for (i = 1; i < keys; i += 2)
+            map_remove(map, &i);
+        cursor_scan(map, &cursor, seen);
+        TEST_ASSERT_CLEAN_LOG(!cursor.stale || variant == 4, map_free(map), "Removing made variant %d stale", variant);
+        for (i = 0; i < keys && variant < 3; i += 2)
+            TEST_ASSERT_CLEAN_LOG(seen[i] == 1, map_free(map), "Key %d seen %d times after removals", i, seen[i]);
+
+        map_cursor_split(map, &cursor, 1);
+        map_scan(map, &cursor, batch, 1);
+        map_reserve(map, 100000);
+        TEST_ASSERT_CLEAN_LOG(map_scan(map, &cursor, batch, 7) == 0 && cursor.stale, map_free(map), "Cursor survived a rehash");
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+/* 1 if snapshot holds exactly the keys below count, each with itself as value, iterating and looking each one up. */
+static int snapshot_matches(const MapSnapshot *snapshot, int count)
+{
+    static unsigned char seen[4000];
+    MapSnapshotIter iter = {0, 0, NULL};
+    const void *key, *value;
+    size_t total = 0;
+    int i;
+    memset(seen, 0, sizeof(seen));
+    while (map_snapshot_next(snapshot, &iter, &key, &value))
+    {
+        i = *(const int *)key;
+        if (i < 0 || i >= count || seen[i]++ || *(const int *)value != i)
+            return 0;
+        total++;
+    }
+    for (i = 0; i < count + 10; i++)
+    {
+        const int *found = (const int *)map_snapshot_get(snapshot, &i);
+        if ((found != NULL) != (i < count) || (found != NULL && *found != i))
+            return 0;
+    }
+    return total == (size_t)count && map_snapshot_length(snapshot) == (size_t)count && map_snapshot_complete(snapshot);
+}
+
+TEST_MAKE(Snapshots)
+{
+    int variant;
+    /*  Chained, flat, dense, chained with MAP_FLAG_POW2 and a small map. */
+    for (variant = 0; variant < 5; variant++)
+    {
+        MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+        type.storage = variant < 3 ? variant : MAP_STORAGE_CHAINED;
+        type.flags = variant == 3 ? MAP_FLAG_POW2 : variant == 4 ? MAP_FLAG_SMALL : 0;
+        int count = variant == 4 ? 5 : 2000, i;
+        Map *map = map_new(type, 4096);
+        for (i = 0; i < count; i++)
+            map_add(map, &i, &i);
+        MapSnapshot *snapshot = map_snapshot(map);
+        TEST_ASSERT_CLEAN_LOG(snapshot != NULL && snapshot_matches(snapshot, count), (map_snapshot_free(snapshot), map_free(map)), "Fresh snapshot of variant %d is wrong", variant);
+
+        /*  Writes that fit the table interleaved with iterating, each chunk is copied before its first change. */
+        MapSnapshotIter iter = {0, 0, NULL};
+        const void *key, *value;
+        size_t walked = 0;
+        for (i = 0; i < count; i++)
+        {
+            int negative = -i;
+            if (i % 3 == 0)
+                map_add(map, &i, &negative);
+            else if (i % 3 == 1)
+                map_remove(map, &i);
+            else
+                *(int *)map_get(map, &i) = negative;
+            if (map_snapshot_next(snapshot, &iter, &key, &value) && *(const int *)value == *(const int *)key)
+                walked++;
+        }
+        while (map_snapshot_next(snapshot, &iter, &key, &value))
+            walked += *(const int *)value == *(const int *)key;
+        TEST_ASSERT_CLEAN_LOG(walked == (size_t)count && snapshot_matches(snapshot, count), (map_snapshot_free(snapshot), map_free(map)), "Snapshot of variant %d changed with its map", variant);
+        map_snapshot_free(snapshot);
+
+        /*  Growing detaches the snapshot, freeing the map afterwards leaves it readable. */
+        map_clear(map);
+        for (i = 0; i < count; i++)
+            map_add(map, &i, &i);
+        snapshot = map_snapshot(map);
+        MapSnapshot *second = map_snapshot(map);
+        for (i = count; i < 4 * count + 20000; i++)
+            map_add(map, &i, &(int){0});
+        map_remove(map, &(int){0});
+        TEST_ASSERT_CLEAN_LOG(snapshot_matches(snapshot, count), (map_snapshot_free(snapshot), map_snapshot_free(second), map_free(map)), "Snapshot of variant %d changed as its map grew", variant);
+        map_free(map);
+        TEST_ASSERT_CLEAN_LOG(snapshot_matches(second, count), (map_snapshot_free(snapshot), map_snapshot_free(second)), "Snapshot of variant %d lost its map", variant);
+        map_snapshot_free(snapshot);
+        map_snapshot_free(second);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Boxed_Values)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        MapTypeData type = MAP_BOXED_TYPE(int, int_hash, int_cmp, NULL);
+        type.storage = storage;
+        Map *map = map_new(type, 0), *before;
+        char *buffers[1000];
+        int i;
+        for (i = 0; i < 1000; i++)
+        {
+            buffers[i] = (char *)malloc(512);
+            TEST_ASSERT_CLEAN_LOG(buffers[i] != NULL && map_add_take(map, &i, buffers[i]) == 0, map_free(map), "Failed to add %d", i);
+            sprintf(buffers[i], "value %d", i);
+        }
+        /*  Replacing frees the old buffer, the sanitizers catch a leak. */
+        i = 0;
+        buffers[0] = (char *)malloc(512);
+        strcpy(buffers[0], "replaced");
+        TEST_ASSERT_CLEAN_LOG(map_add_take(map, &i, buffers[0]) == 1, map_free(map), "Replacing did not update");
+        for (i = 1; i < 1000; i += 2)
+            map_remove(map, &i);
+        before = map;
+        map_optimize(&map);
+        TEST_ASSERT_CLEAN_LOG(map == before && map->length == 500, map_free(map), "Optimize rebuilt storage %d", storage);
+        for (i = 0; i < 1000; i += 2)
+            TEST_ASSERT_CLEAN_LOG(*(char **)map_get(map, &i) == buffers[i], map_free(map), "Buffer of %d moved", i);
+        i = 2;
+        char *taken = (char *)map_remove_take(map, &i);
+        TEST_ASSERT_CLEAN_LOG(taken == buffers[2] && strcmp(taken, "value 2") == 0 && map_get(map, &i) == NULL, (free(taken), map_free(map)), "Take returned the wrong buffer");
+        free(taken);
+        TEST_ASSERT_CLEAN_LOG(map_remove_take(map, &i) == NULL, map_free(map), "Took a missing key");
+        map_free(map);
+    }
+    TEST_PASS();
+}
+
+#define NUMA_NODES 4
+
+typedef struct
+{
+    NumaMap *map;
+    int id;
+    int failures;
+} NumaWorker;
+
+static void *numa_worker(void *arg)
+{
+    NumaWorker *worker = (NumaWorker *)arg;
+    int i, value, first = worker->id * CONCURRENT_KEYS;
+    for (i = first; i < first + CONCURRENT_KEYS; i++)
+    {
+        if (numa_map_add(worker->map, &i, &i) != 0)
+            worker->failures++;
+        if (numa_map_get(worker->map, &i, &value) != 0 || value != i)
+            worker->failures++;
+    }
+    for (i = first; i < first + CONCURRENT_KEYS; i += 2)
+        if (numa_map_remove(worker->map, &i) != 0)
+            worker->failures++;
+    return NULL;
+}
+
+/*  Writers of the same keys race, the copies still have to agree in the end. */
+static void *numa_replica_writer(void *arg)
+{
+    NumaWorker *worker = (NumaWorker *)arg;
+    int i, value;
+    for (i = 0; i < CONCURRENT_KEYS; i++)
+    {
+        value = i * 2 + worker->id;
+        if (numa_map_add(worker->map, &i, &value) < 0)
+            worker->failures++;
+    }
+    return NULL;
+}
+
+static atomic_int numa_freed;
+
+static void numa_count_free(void *ptr)
+{
+    atomic_fetch_add(&numa_freed, 1);
+}
+
+typedef struct
+{
+    int key;
+    int value;
+} NumaBox;
+
+static NumaMap *numa_boxes;
+static int numa_box_failures;
+
+/*  Replicated updates free the old box from the first copy, no other copy may still hand it out by then. */
+static void numa_box_free(void *ptr)
+{
+    NumaBox *box = *(NumaBox **)ptr;
+    size_t n;
+    for (n = 1; numa_boxes != NULL && n < numa_boxes->nodes_count; n++)
+    {
+        NumaBox *other = NULL;
+        if (concurrent_map_get(numa_boxes->nodes[n].map, &box->key, &other) == 0 && other == box)
+            numa_box_failures++;
+    }
+    free(box);
+}
+
+TEST_MAKE(Numa_Map)
+{
+    MapTypeData type = MAP_TYPE(int, int, int_hash, int_cmp, NULL, NULL);
+    TEST_ASSERT_LOG(numa_map_nodes_available() >= 1, "No NUMA node");
+    NumaMap *map = numa_map_new(type, 64, NUMA_NODES, 0);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create map");
+    TEST_ASSERT_CLEAN_LOG(numa_map_current_node(map) < NUMA_NODES, numa_map_free(map), "Current node %zu", numa_map_current_node(map));
+
+    pthread_t threads[CONCURRENT_THREADS];
+    NumaWorker workers[CONCURRENT_THREADS];
+    int i;
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        workers[i].map = map;
+        workers[i].id = i;
+        workers[i].failures = 0;
+        pthread_create(&threads[i], NULL, numa_worker, &workers[i]);
+    }
+    for (i = 0; i < CONCURRENT_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_CLEAN_LOG(workers[i].failures == 0, numa_map_free(map), "Worker %d failed %d times", i, workers[i].failures);
+    }
+    const size_t expected = CONCURRENT_THREADS * CONCURRENT_KEYS / 2;
+    TEST_ASSERT_CLEAN_LOG(numa_map_length(map) == expected, numa_map_free(map), "Length %zu, expected %zu", numa_map_length(map), expected);
+    /*  Identity hashes still have to reach every node, and every shard inside it. */
+    for (i = 0; i < NUMA_NODES; i++)
+    {
+        ConcurrentMap *node = map->nodes[i].map;
+        size_t length = concurrent_map_length(node), s;
+        TEST_ASSERT_CLEAN_LOG(length > expected / NUMA_NODES / 2, numa_map_free(map), "Node %d holds %zu keys", i, length);
+        for (s = 0; s < node->shards_count; s++)
+            TEST_ASSERT_CLEAN_LOG(node->shards[s].s.map->length > length / node->shards_count / 2, numa_map_free(map), "Node %d shard %zu holds %zu keys", i, s, node->shards[s].s.map->length);
+    }
+    long long sum = 0, expected_sum = 0;
+    for (i = 1; i < CONCURRENT_THREADS * CONCURRENT_KEYS; i += 2)
+        expected_sum += i;
+    numa_map_for_each(map, concurrent_sum, &sum);
+    TEST_ASSERT_CLEAN_LOG(sum == expected_sum, numa_map_free(map), "Sum %lld, expected %lld", sum, expected_sum);
+    numa_map_clear(map);
+    TEST_ASSERT_CLEAN_LOG(numa_map_length(map) == 0, numa_map_free(map), "Clear left %zu keys", numa_map_length(map));
+    numa_map_free(map);
+
+    type.value_free = numa_count_free;
+    map = numa_map_new(type, 0, 3, NUMA_MAP_REPLICATED);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create replicated map");
+    for (i = 0; i < 2; i++)
+    {
+        workers[i].map = map;
+        workers[i].id = i;
+        workers[i].failures = 0;
+        pthread_create(&threads[i], NULL, numa_replica_writer, &workers[i]);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_CLEAN_LOG(workers[i].failures == 0, numa_map_free(map), "Writer %d failed %d times", i, workers[i].failures);
+    }
+    TEST_ASSERT_CLEAN_LOG(numa_map_length(map) == CONCURRENT_KEYS, numa_map_free(map), "Length %zu", numa_map_length(map));
+    for (i = 0; i < CONCURRENT_KEYS; i++)
+    {
+        int first, value, n;
+        TEST_ASSERT_CLEAN_LOG(numa_map_get(map, &i, &first) == 0 && first / 2 == i, numa_map_free(map), "Key %d reads %d", i, first);
+        TEST_ASSERT_CLEAN_LOG(concurrent_map_get(map->nodes[0].map, &i, &first) == 0, numa_map_free(map), "Key %d missing", i);
+        for (n = 1; n < 3; n++)
+            TEST_ASSERT_CLEAN_LOG(concurrent_map_get(map->nodes[n].map, &i, &value) == 0 && value == first, numa_map_free(map), "Copy %d of key %d holds %d, not %d", n, i, value, first);
+    }
+    /*  Updates replaced CONCURRENT_KEYS values, only the first copy frees them. */
+    TEST_ASSERT_CLEAN_LOG(atomic_load(&numa_freed) == CONCURRENT_KEYS, numa_map_free(map), "Freed %d values", atomic_load(&numa_freed));
+    i = 7;
+    TEST_ASSERT_CLEAN_LOG(numa_map_remove(map, &i) == 0 && numa_map_get(map, &i, NULL) == -1, numa_map_free(map), "Key survived remove");
+    for (i = 0; i < 3; i++)
+        TEST_ASSERT_CLEAN_LOG(concurrent_map_length(map->nodes[i].map) == CONCURRENT_KEYS - 1, numa_map_free(map), "Copy %d holds %zu keys", i, concurrent_map_length(map->nodes[i].map));
+    numa_map_free(map);
+    TEST_ASSERT_LOG(atomic_load(&numa_freed) == 2 * CONCURRENT_KEYS, "Freed %d values", atomic_load(&numa_freed));
+
+    TEST_ASSERT_LOG(numa_map_new(type, 0, 2, NUMA_MAP_REPLICATED | NUMA_MAP_LOCK_FREE) == NULL, "Lock free copies accepted value_free");
+    type.value_free = NULL;
+    map = numa_map_new(type, 0, 2, NUMA_MAP_REPLICATED | NUMA_MAP_LOCK_FREE);
+    TEST_ASSERT_LOG(map != NULL, "Failed to create lock free replicated map");
+    for (i = 0; i < 1000; i++)
+        numa_map_add(map, &i, &i);
+    int value;
+    i = 999;
+    TEST_ASSERT_CLEAN_LOG(numa_map_get(map, &i, &value) == 0 && value == 999, numa_map_free(map), "Lock free copy lost a key");
+    numa_map_free(map);
+
+    MapTypeData box_type = MAP_TYPE(int, NumaBox *, int_hash, int_cmp, NULL, numa_box_free);
+    numa_boxes = numa_map_new(box_type, 0, 3, NUMA_MAP_REPLICATED);
+    TEST_ASSERT_LOG(numa_boxes != NULL, "Failed to create replicated box map");
+    int round;
+    for (round = 0; round < 3; round++)
+        for (i = 0; i < 1000; i++)
+        {
+            NumaBox *box = (NumaBox *)malloc(sizeof(NumaBox));
+            box->key = i;
+            box->value = round;
+            TEST_ASSERT_CLEAN_LOG(numa_map_add(numa_boxes, &i, &box) == (round == 0 ? 0 : 1), numa_map_free(numa_boxes), "Add of key %d in round %d", i, round);
+        }
+    TEST_ASSERT_CLEAN_LOG(numa_box_failures == 0, numa_map_free(numa_boxes), "%d boxes freed while a copy still held them", numa_box_failures);
+    for (i = 0; i < 1000; i++)
+    {
+        NumaBox *box = NULL;
+        TEST_ASSERT_CLEAN_LOG(numa_map_get(numa_boxes, &i, &box) == 0 && box->key == i && box->value == 2, numa_map_free(numa_boxes), "Box of key %d", i);
+    }
+    for (i = 0; i < 1000; i += 2)
+        TEST_ASSERT_CLEAN_LOG(numa_map_remove(numa_boxes, &i) == 0, numa_map_free(numa_boxes), "Remove of key %d", i);
+    TEST_ASSERT_CLEAN_LOG(numa_box_failures == 0, numa_map_free(numa_boxes), "%d boxes freed while a copy still held them", numa_box_failures);
+    /*  The copies are freed before the first one, stop checking them. */
+    map = numa_boxes;
+    numa_boxes = NULL;
+    numa_map_free(map);
+    TEST_PASS();
+}
+
 TEST_SUITE_MAKE(Map)
 {
     TEST_SUITE_INIT(Map);
     TEST_SUITE_LINK(Map, Heap_Str);
     TEST_SUITE_LINK(Map, Map_Local_Value);
     TEST_SUITE_LINK(Map, Heap_Int);
+    TEST_SUITE_LINK(Map, Auto_Grow);
+    TEST_SUITE_LINK(Map, Flat_Storage);
+    TEST_SUITE_LINK(Map, Inline_Entries);
+    TEST_SUITE_LINK(Map, Allocators);
+    TEST_SUITE_LINK(Map, Cached_Hashes);
+    TEST_SUITE_LINK(Map, Pow2_Buckets);
+    TEST_SUITE_LINK(Map, Fast_Hash_Str);
+    TEST_SUITE_LINK(Map, Stats);
+    TEST_SUITE_LINK(Map, Concurrent);
+    TEST_SUITE_LINK(Map, Lock_Free_Reads);
+    TEST_SUITE_LINK(Map, Batches);
+    TEST_SUITE_LINK(Map, Parallel_Build);
+    TEST_SUITE_LINK(Map, Save_Mmap);
+    TEST_SUITE_LINK(Map, Typed_Maps);
+    TEST_SUITE_LINK(Map, Dense_Storage);
+    TEST_SUITE_LINK(Map, Get_Or_Insert);
+    TEST_SUITE_LINK(Map, Precomputed_Hashes);
+    TEST_SUITE_LINK(Map, Small_Maps);
+    TEST_SUITE_LINK(Map, String_Keys);
+    TEST_SUITE_LINK(Map, Remove_If_Clear);
+    TEST_SUITE_LINK(Map, Reserve_Shrink);
+    TEST_SUITE_LINK(Map, Seeded_Hashes);
+    TEST_SUITE_LINK(Map, Multi_And_Counter);
+    TEST_SUITE_LINK(Map, Set_Mode);
+    TEST_SUITE_LINK(Map, Cursors);
+    TEST_SUITE_LINK(Map, Snapshots);
+    TEST_SUITE_LINK(Map, Boxed_Values);
+    TEST_SUITE_LINK(Map, Numa_Map);
     TEST_SUITE_END(Map);
 }
 
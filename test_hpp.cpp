@@ -0,0 +1,180 @@
+/*
+    Tests for the C++ wrappers in map.hpp, map.c is compiled as C and linked in:
+        cc -c map.c -o map.o && c++ -std=c++11 -o test_hpp test_hpp.cpp map.o -lm -pthread
+*/
+#include "map.hpp"
+#include <cstdlib>
+#include <string>
+#include <utility>
+#define CTF_TEST_NAMES
+#include "../Testing/ctf.h"
+
+/*  Counts live instances, so BoxedMap can be checked for leaks and double deletes. */
+struct Tracked
+{
+    static int live;
+    std::string text;
+
+    explicit Tracked(const std::string &text) : text(text)
+    {
+        live++;
+    }
+
+    Tracked(Tracked &&other) : text(std::move(other.text))
+    {
+        live++;
+    }
+
+    Tracked &operator=(Tracked &&other)
+    {
+        text = std::move(other.text);
+        return *this;
+    }
+
+    ~Tracked()
+    {
+        live--;
+    }
+};
+
+int Tracked::live = 0;
+
+struct Pair
+{
+    int a;
+    int b;
+
+    Pair(int a, int b) : a(a), b(b)
+    {
+    }
+};
+
+static int check_storage(int storage, unsigned flags)
+{
+    cmap::Map<int, double> map(1, storage, flags);
+    int i;
+    for (i = 0; i < 5000; i++)
+        if (map.insert(i, i * 0.5) != 0)
+            return 1;
+    if (map.insert(3, 9.0) != 1 || *map.find(3) != 9.0 || map.size() != 5000)
+        return 2;
+    for (i = 0; i < 5000; i++)
+        if (i != 3 && (map.find(i) == nullptr || *map.find(i) != i * 0.5))
+            return 3;
+    if (map.contains(5000) || !map.erase(4) || map.erase(4) || map.contains(4) || map.size() != 4999)
+        return 4;
+
+    bool inserted = true;
+    double *value = map.get_or_insert(10, &inserted);
+    if (value == nullptr || inserted || *value != 5.0)
+        return 5;
+    value = map.get_or_insert(4, &inserted);
+    if (value == nullptr || !inserted || *value != 0.0)
+        return 6;
+    /*  emplace leaves existing values alone. */
+    if (map.emplace(10, 1.0).second || *map.emplace(10, 1.0).first != 5.0 || !map.emplace(-1, 1.0).second)
+        return 7;
+
+    double sum = 0;
+    map.for_each([&sum](const int &, double &v) { sum += v; });
+    double expected = 0;
+    for (i = 0; i < 5000; i++)
+        expected += i == 3 ? 9.0 : i == 4 ? 0.0 : i * 0.5;
+    if (sum != expected + 1.0)
+        return 8;
+
+    cmap::Map<int, double> moved(std::move(map));
+    if (map.get() != nullptr || moved.size() != 5001)
+        return 9;
+    moved.optimize();
+    for (i = 0; i < 5000; i++)
+        if (moved.find(i) == nullptr)
+            return 10;
+    cmap::Map<int, double> assigned;
+    assigned = std::move(moved);
+    const cmap::Map<int, double> &view = assigned;
+    if (view.find(7) == nullptr || *view.find(7) != 3.5 || !view.contains(-1))
+        return 11;
+    assigned.clear();
+    if (!assigned.empty() || assigned.find(7) != nullptr)
+        return 12;
+    return 0;
+}
+
+TEST_MAKE(Map_Storages)
+{
+    const int storages[] = {MAP_STORAGE_CHAINED, MAP_STORAGE_CHAINED, MAP_STORAGE_CHAINED, MAP_STORAGE_FLAT, MAP_STORAGE_FLAT, MAP_STORAGE_DENSE};
+    const unsigned flags[] = {0, MAP_FLAG_POW2, MAP_FLAG_SMALL, 0, MAP_FLAG_SMALL, 0};
+    int i;
+    for (i = 0; i < 6; i++)
+    {
+        int failed = check_storage(storages[i], flags[i]);
+        TEST_ASSERT_LOG(failed == 0, "Storage %d flags %u failed check %d", storages[i], flags[i], failed);
+    }
+    TEST_PASS();
+}
+
+TEST_MAKE(Map_Emplace)
+{
+    cmap::Map<int, Pair> map;
+    std::pair<Pair *, bool> result = map.emplace(1, 2, 3);
+    TEST_ASSERT_LOG(result.second && result.first->a == 2 && result.first->b == 3, "emplace did not construct the value");
+    result = map.emplace(1, 4, 5);
+    TEST_ASSERT_LOG(!result.second && result.first->a == 2, "emplace replaced an existing value");
+    TEST_PASS();
+}
+
+TEST_MAKE(Boxed_Map)
+{
+    int storage;
+    for (storage = MAP_STORAGE_CHAINED; storage <= MAP_STORAGE_DENSE; storage++)
+    {
+        {
+            cmap::BoxedMap<int, Tracked> map(1, storage);
+            std::pair<Tracked *, bool> first = map.emplace(0, "zero");
+            TEST_ASSERT_LOG(first.second && first.first->text == "zero", "emplace failed on storage %d", storage);
+            int i;
+            for (i = 1; i < 5000; i++)
+                map.emplace(i, std::to_string(i));
+            /*  Growing moved the boxes, not the values. */
+            TEST_ASSERT_LOG(map.find(0) == first.first && first.first->text == "zero", "Value moved on storage %d", storage);
+            TEST_ASSERT_LOG(!map.emplace(0, "other").second && map.find(0)->text == "zero", "emplace replaced a value on storage %d", storage);
+            TEST_ASSERT_LOG(!map.insert(0, Tracked("moved")) && map.find(0) == first.first && first.first->text == "moved", "insert did not move into the value on storage %d", storage);
+            TEST_ASSERT_LOG(map.insert(5000, Tracked("new")) && map.size() == 5001, "insert did not add a key on storage %d", storage);
+
+            Tracked *kept = map.find(42);
+            map.optimize();
+            TEST_ASSERT_LOG(map.find(42) == kept && kept->text == "42", "optimize moved a value on storage %d", storage);
+
+            std::unique_ptr<Tracked> taken = map.take(42);
+            TEST_ASSERT_LOG(taken.get() == kept && !map.contains(42) && map.take(42) == nullptr, "take failed on storage %d", storage);
+            TEST_ASSERT_LOG(map.erase(7) && !map.erase(7) && map.find(7) == nullptr, "erase failed on storage %d", storage);
+            TEST_ASSERT_LOG(Tracked::live == 5000, "%d values alive, expected 5000 on storage %d", Tracked::live, storage);
+
+            size_t count = 0;
+            map.for_each([&count](const int &, Tracked &) { count++; });
+            TEST_ASSERT_LOG(count == map.size() && count == 4999, "for_each visited %zu of %zu", count, map.size());
+
+            cmap::BoxedMap<int, Tracked> moved(std::move(map));
+            TEST_ASSERT_LOG(map.get() == nullptr && moved.find(0) == first.first, "Moved map lost its values");
+        }
+        TEST_ASSERT_LOG(Tracked::live == 0, "%d values leaked on storage %d", Tracked::live, storage);
+    }
+    TEST_PASS();
+}
+
+TEST_SUITE_MAKE(Map_Hpp)
+{
+    TEST_SUITE_INIT(Map_Hpp);
+    TEST_SUITE_LINK(Map_Hpp, Map_Storages);
+    TEST_SUITE_LINK(Map_Hpp, Map_Emplace);
+    TEST_SUITE_LINK(Map_Hpp, Boxed_Map);
+    TEST_SUITE_END(Map_Hpp);
+}
+
+int main(void)
+{
+    TEST_LOG("Map C++ tests");
+    TEST_SUITE_RUN(Map_Hpp);
+    return 0;
+}